@@ -0,0 +1,308 @@
+#include <cassert>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "builder.h"
+#include "number.h"
+
+
+using std::invalid_argument;
+using std::numeric_limits;
+using std::vector;
+
+
+Node::Ptr build_uint(uint64_t value) {
+    if (value <= static_cast<uint64_t>(numeric_limits<int64_t>::max())) {
+        return Node::Ptr(new NodeInt(static_cast<int64_t>(value)));
+    }
+    char buf[INT_BUF_SIZE];
+    return Node::Ptr(new NodeNumber(string(buf, write_uint(buf, value))));
+}
+
+
+// Canonical objects are sorted by key, which needs the whole object.
+static const FormatOption &streamable(const FormatOption &opt) {
+    if (opt.canonical()) {
+        throw invalid_argument("canonical output can not be streamed, build a tree instead");
+    }
+    return opt;
+}
+
+
+// Output of the builders in streaming mode.
+class BuildStream {
+public:
+    BuildStream(Sink &out, const FormatOption &opt)
+        : out(out), opt(streamable(opt)), fmt(opt), compact(opt.compact())
+    {}
+    BuildStream(ostream &os, const FormatOption &opt)
+        : own_sink(new OstreamSink(os)), out(*own_sink), opt(streamable(opt)), fmt(opt),
+          compact(opt.compact())
+    {}
+
+    void open(char ch) {
+        this->out.put(ch);
+        this->counts.push_back(0);
+    }
+
+    // Flushes the output after the outermost container.
+    void close(char ch) {
+        bool empty = this->counts.back() == 0;
+        this->counts.pop_back();
+        if (!empty && !this->compact) {
+            this->out.put('\n');
+            this->indent();
+        }
+        this->out.put(ch);
+        if (this->counts.empty()) {
+            this->out.flush();
+        }
+    }
+
+    void begin_item() {
+        bool first = this->counts.back()++ == 0;
+        if (this->compact) {
+            if (!first) {
+                this->out.put(',');
+            }
+        } else {
+            this->out.write(first ? "\n" : ",\n");
+            this->indent();
+        }
+    }
+
+    // K is ustring or NodeString, see Formatter::write_string()
+    template<class K>
+    void key(const K &key) {
+        this->begin_item();
+        this->fmt.write_string(this->out, key);
+        this->out.write(this->compact ? ":" : ": ");
+    }
+
+    void write(const Node &node) {
+        this->fmt.format(this->out, node, static_cast<unsigned int>(this->counts.size()));
+    }
+
+    void write(const ustring &value) {
+        this->fmt.write_string(this->out, value);
+    }
+
+private:
+    void indent() {
+        size_t level = this->counts.size();
+        if (this->opt.use_tab()) {
+            this->out.fill('\t', level);
+        } else {
+            this->out.fill(' ', level * this->opt.indent());
+        }
+    }
+
+    unique_ptr<OstreamSink> own_sink;
+    Sink &out;
+    FormatOption opt;
+    Formatter fmt;
+    bool compact;
+    vector<size_t> counts;  // children written to the open containers
+};
+
+
+BuilderBase::BuilderBase(Node *node, BuildStream *stream, char open, char close)
+    : node(node), stream(stream), close(close)
+{
+    if (this->stream != nullptr) {
+        this->stream->open(open);
+    }
+}
+
+
+BuilderBase::BuilderBase(Sink &out, const FormatOption &opt, char open, char close)
+    : stream(new BuildStream(out, opt)), own_stream(this->stream), close(close)
+{
+    this->stream->open(open);
+}
+
+
+BuilderBase::BuilderBase(ostream &os, const FormatOption &opt, char open, char close)
+    : stream(new BuildStream(os, opt)), own_stream(this->stream), close(close)
+{
+    this->stream->open(open);
+}
+
+
+// Closing while an exception propagates would make truncated output look complete.
+BuilderBase::~BuilderBase() {
+    if (uncaught_exception() && !this->unwinding) {
+        return;
+    }
+    try {
+        this->finish();
+    } catch (...) {
+        // destructors must not throw, finish() reports the errors
+    }
+}
+
+
+void BuilderBase::finish() {
+    if (this->stream != nullptr && !this->finished) {
+        this->finished = true;
+        this->stream->close(this->close);
+    }
+}
+
+
+Node::Ptr BuilderBase::take() {
+    assert(this->stream == nullptr);
+    return move(this->node);
+}
+
+
+void BuilderBase::begin_item() {
+    if (this->stream != nullptr) {
+        this->stream->begin_item();
+    }
+}
+
+
+void BuilderBase::put(nullptr_t) {
+    if (this->stream != nullptr) {
+        this->stream->write(NodeNull());
+    } else {
+        this->append(Node::Ptr(new NodeNull()));
+    }
+}
+
+
+void BuilderBase::put(bool value) {
+    if (this->stream != nullptr) {
+        this->stream->write(NodeBool(value));
+    } else {
+        this->append(Node::Ptr(new NodeBool(value)));
+    }
+}
+
+
+void BuilderBase::put(int64_t value) {
+    if (this->stream != nullptr) {
+        this->stream->write(NodeInt(value));
+    } else {
+        this->append(Node::Ptr(new NodeInt(value)));
+    }
+}
+
+
+void BuilderBase::put(double value) {
+    if (this->stream != nullptr) {
+        this->stream->write(NodeFloat(value));
+    } else {
+        this->append(Node::Ptr(new NodeFloat(value)));
+    }
+}
+
+
+void BuilderBase::put(const ustring &value) {
+    if (this->stream != nullptr) {
+        this->stream->write(value);
+    } else {
+        this->append(Node::Ptr(new NodeString(value)));
+    }
+}
+
+
+void BuilderBase::put(Node::Ptr &&value) {
+    if (this->stream != nullptr) {
+        this->stream->write(*value);
+    } else {
+        this->append(move(value));
+    }
+}
+
+
+void BuilderBase::put_child(BuilderBase &child) {
+    if (this->stream != nullptr) {
+        child.finish();
+    } else {
+        this->append(child.take());
+    }
+}
+
+
+ArrayBuilder::ArrayBuilder() : BuilderBase(new NodeList(), nullptr, '[', ']') {}
+
+
+ArrayBuilder::ArrayBuilder(Sink &out, const FormatOption &opt)
+    : BuilderBase(out, opt, '[', ']')
+{}
+
+
+ArrayBuilder::ArrayBuilder(ostream &os, const FormatOption &opt)
+    : BuilderBase(os, opt, '[', ']')
+{}
+
+
+ArrayBuilder::ArrayBuilder(BuildStream *stream)
+    : BuilderBase(stream == nullptr ? new NodeList() : nullptr, stream, '[', ']')
+{}
+
+
+ArrayBuilder &ArrayBuilder::reserve(size_t n) {
+    if (this->stream == nullptr) {
+        static_cast<NodeList &>(*this->node).value.reserve(n);
+    }
+    return *this;
+}
+
+
+void ArrayBuilder::append(Node::Ptr &&value) {
+    static_cast<NodeList &>(*this->node).value.push_back(move(value));
+}
+
+
+ObjectBuilder::ObjectBuilder() : BuilderBase(new NodeObject(), nullptr, '{', '}') {}
+
+
+ObjectBuilder::ObjectBuilder(Sink &out, const FormatOption &opt)
+    : BuilderBase(out, opt, '{', '}')
+{}
+
+
+ObjectBuilder::ObjectBuilder(ostream &os, const FormatOption &opt)
+    : BuilderBase(os, opt, '{', '}')
+{}
+
+
+ObjectBuilder::ObjectBuilder(BuildStream *stream)
+    : BuilderBase(stream == nullptr ? new NodeObject() : nullptr, stream, '{', '}')
+{}
+
+
+ObjectBuilder &ObjectBuilder::reserve(size_t n) {
+    if (this->stream == nullptr) {
+        static_cast<NodeObject &>(*this->node).pairs.reserve(n);
+    }
+    return *this;
+}
+
+
+void ObjectBuilder::set_key(const ustring &key) {
+    if (this->stream != nullptr) {
+        this->stream->key(key);
+    } else {
+        this->key.reset(new NodeKey(key));
+    }
+}
+
+
+void ObjectBuilder::set_key(const NodePair::KeyPtr &key) {
+    if (this->stream != nullptr) {
+        this->stream->key(*key);
+    } else {
+        this->key = key;
+    }
+}
+
+
+void ObjectBuilder::append(Node::Ptr &&value) {
+    NodeObject &obj = static_cast<NodeObject &>(*this->node);
+    obj.pairs.emplace_back(new NodePair(move(this->key), move(value)));
+}
@@ -0,0 +1,275 @@
+#ifndef JSON_CXX_BUILDER_H
+#define JSON_CXX_BUILDER_H
+
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "formatter.h"
+#include "node.h"
+#include "unicode.h"
+
+
+using std::enable_if;
+using std::forward;
+using std::is_floating_point;
+using std::is_integral;
+using std::is_same;
+using std::is_signed;
+using std::is_unsigned;
+using std::nullptr_t;
+using std::ostream;
+using std::string;
+using std::uncaught_exception;
+using std::unique_ptr;
+
+
+// Values accepted by the builders: null, bool, integers, floating point numbers,
+// utf-8 and unicode strings, and nodes.
+inline nullptr_t build_value(nullptr_t) {
+    return nullptr;
+}
+
+
+inline bool build_value(bool value) {
+    return value;
+}
+
+
+// signed, or unsigned and narrower than int64_t
+template<class T>
+typename enable_if<
+    is_integral<T>::value && !is_same<T, bool>::value
+        && (is_signed<T>::value || sizeof(T) < sizeof(int64_t)),
+    int64_t
+>::type
+build_value(T value) {
+    return static_cast<int64_t>(value);
+}
+
+
+// NodeInt, or the exact NodeNumber above INT64_MAX.
+Node::Ptr build_uint(uint64_t value);
+
+
+template<class T>
+typename enable_if<
+    is_integral<T>::value && !is_same<T, bool>::value
+        && is_unsigned<T>::value && sizeof(T) >= sizeof(int64_t),
+    Node::Ptr
+>::type
+build_value(T value) {
+    return build_uint(static_cast<uint64_t>(value));
+}
+
+
+template<class T>
+typename enable_if<is_floating_point<T>::value, double>::type build_value(T value) {
+    return static_cast<double>(value);
+}
+
+
+inline ustring build_value(const char *value) {
+    return u8_decode(value);
+}
+
+
+inline ustring build_value(const string &value) {
+    return u8_decode(value.data(), value.size());
+}
+
+
+inline const ustring &build_value(const ustring &value) {
+    return value;
+}
+
+
+inline Node::Ptr build_value(Node::Ptr &&value) {
+    return move(value);
+}
+
+
+class BuildStream;
+class ArrayBuilder;
+class ObjectBuilder;
+
+
+// Common part of ArrayBuilder and ObjectBuilder, which build a tree,
+// or write the formatted output as they go in streaming mode, keeping nothing.
+// Streamed containers are laid out one child per line unless FormatOption::compact(),
+// since their children are not known in advance. Streaming throws std::invalid_argument
+// for FormatOption::canonical(), which sorts the keys of whole objects.
+class BuilderBase {
+public:
+    BuilderBase(const BuilderBase &) = delete;
+    BuilderBase &operator=(const BuilderBase &) = delete;
+    virtual ~BuilderBase();
+
+    // Writes the end of the container in streaming mode, also done by the destructor,
+    // which ignores errors and leaves the output unfinished while an exception propagates.
+    void finish();
+
+protected:
+    // tree mode if stream is nullptr
+    BuilderBase(Node *node, BuildStream *stream, char open, char close);
+    BuilderBase(Sink &out, const FormatOption &opt, char open, char close);
+    BuilderBase(ostream &os, const FormatOption &opt, char open, char close);
+
+    // in tree mode
+    virtual void append(Node::Ptr &&value) = 0;
+    Node::Ptr take();
+
+    // separator before a child in streaming mode
+    void begin_item();
+    void put(nullptr_t);
+    void put(bool value);
+    void put(int64_t value);
+    void put(double value);
+    void put(const ustring &value);
+    void put(Node::Ptr &&value);
+    void put_child(BuilderBase &child);
+
+    Node::Ptr node;
+    BuildStream *stream;
+
+private:
+    unique_ptr<BuildStream> own_stream;
+    char close;
+    bool finished = false;
+    bool unwinding = uncaught_exception();  // built while an exception propagates
+};
+
+
+class ArrayBuilder : public BuilderBase {
+public:
+    // Builds a NodeList.
+    ArrayBuilder();
+    // Writes the array to out, which is flushed after the array.
+    explicit ArrayBuilder(Sink &out, const FormatOption &opt = FormatOption());
+    explicit ArrayBuilder(ostream &os, const FormatOption &opt = FormatOption());
+
+    // Ignored in streaming mode.
+    ArrayBuilder &reserve(size_t n);
+
+    template<class T>
+    ArrayBuilder &add(T &&value) {
+        this->begin_item();
+        this->put(build_value(forward<T>(value)));
+        return *this;
+    }
+
+    // func(ArrayBuilder &) adds the children of a nested array.
+    template<class Func>
+    ArrayBuilder &add_array(Func func);
+    // func(ObjectBuilder &) adds the children of a nested object.
+    template<class Func>
+    ArrayBuilder &add_object(Func func);
+
+    // The NodeList, not for streaming mode.
+    Node::Ptr build() {
+        return this->take();
+    }
+
+private:
+    friend class ObjectBuilder;
+
+    explicit ArrayBuilder(BuildStream *stream);
+    virtual void append(Node::Ptr &&value);
+};
+
+
+class ObjectBuilder : public BuilderBase {
+public:
+    // Builds a NodeObject.
+    ObjectBuilder();
+    // Writes the object to out, which is flushed after the object.
+    explicit ObjectBuilder(Sink &out, const FormatOption &opt = FormatOption());
+    explicit ObjectBuilder(ostream &os, const FormatOption &opt = FormatOption());
+
+    // Ignored in streaming mode.
+    ObjectBuilder &reserve(size_t n);
+
+    // key is utf-8, a ustring, or a NodePair::KeyPtr shared with other pairs
+    template<class K, class T>
+    ObjectBuilder &add(K &&key, T &&value) {
+        this->set_key(forward<K>(key));
+        this->put(build_value(forward<T>(value)));
+        return *this;
+    }
+
+    template<class K, class Func>
+    ObjectBuilder &add_array(K &&key, Func func);
+    template<class K, class Func>
+    ObjectBuilder &add_object(K &&key, Func func);
+
+    // The NodeObject, not for streaming mode.
+    Node::Ptr build() {
+        return this->take();
+    }
+
+private:
+    friend class ArrayBuilder;
+
+    explicit ObjectBuilder(BuildStream *stream);
+    virtual void append(Node::Ptr &&value);
+
+    void set_key(const char *key) {
+        this->set_key(build_value(key));
+    }
+    void set_key(const string &key) {
+        this->set_key(build_value(key));
+    }
+    void set_key(const ustring &key);
+    void set_key(const NodePair::KeyPtr &key);
+
+    NodePair::KeyPtr key;   // of the next pair in tree mode
+};
+
+
+template<class Func>
+ArrayBuilder &ArrayBuilder::add_array(Func func) {
+    this->begin_item();
+    ArrayBuilder child(this->stream);
+    func(child);
+    this->put_child(child);
+    return *this;
+}
+
+
+template<class Func>
+ArrayBuilder &ArrayBuilder::add_object(Func func) {
+    this->begin_item();
+    ObjectBuilder child(this->stream);
+    func(child);
+    this->put_child(child);
+    return *this;
+}
+
+
+template<class K, class Func>
+ObjectBuilder &ObjectBuilder::add_array(K &&key, Func func) {
+    this->set_key(forward<K>(key));
+    ArrayBuilder child(this->stream);
+    func(child);
+    this->put_child(child);
+    return *this;
+}
+
+
+template<class K, class Func>
+ObjectBuilder &ObjectBuilder::add_object(K &&key, Func func) {
+    this->set_key(forward<K>(key));
+    ObjectBuilder child(this->stream);
+    func(child);
+    this->put_child(child);
+    return *this;
+}
+
+
+#endif //JSON_CXX_BUILDER_H
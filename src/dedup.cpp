@@ -0,0 +1,118 @@
+#include <unordered_set>
+#include <vector>
+
+#include "dedup.h"
+#include "memory.h"
+
+
+using std::move;
+using std::unordered_set;
+using std::vector;
+
+
+// Runs on a frozen tree, so that hashes are cached. Sharing the children of an equal node
+// keeps the caches of the ancestors valid, the nodes are modified through const_cast only
+// for that, while the tree is not handed out yet.
+class Deduplicator {
+public:
+    void run(const Node &root);
+
+    DedupStats stats;
+
+private:
+    void merge(const Node &node);
+    void add_stats(const Node &node);
+
+    // canonical subtrees, not modified after insertion
+    unordered_set<const Node *, NodePtrHash, NodePtrEqual> seen;
+    // the replaced children of merged nodes, which may hold canonical subtrees,
+    // kept until the pass ends
+    vector<Node::Ptr> retired;
+};
+
+
+static bool shares_children(const Node &node) {
+    if (node.type == NodeType::LIST) {
+        return static_cast<const NodeList &>(node).value.shared();
+    }
+    return static_cast<const NodeObject &>(node).pairs.shared();
+}
+
+
+// Iterative post-order, so that equal parents compare by shared children.
+// Subtrees already sharing children are merged as a whole only.
+void Deduplicator::run(const Node &root) {
+    struct Frame {
+        const Node *node;
+        size_t next;
+        size_t size;
+    };
+
+    vector<Frame> stack;
+    const Node *node = &root;
+    while (node != nullptr) {
+        if (node->type == NodeType::LIST || node->type == NodeType::OBJECT) {
+            stack.push_back(Frame{node, 0, shares_children(*node) ? 0 : child_count(*node)});
+        }
+        node = nullptr;
+        while (node == nullptr && !stack.empty()) {
+            Frame &frame = stack.back();
+            if (frame.next < frame.size) {
+                node = &child_at(*frame.node, frame.next++);
+            } else {
+                this->merge(*frame.node);
+                stack.pop_back();
+            }
+        }
+    }
+}
+
+
+// Shares the children of an equal node seen before.
+void Deduplicator::merge(const Node &node) {
+    auto inserted = this->seen.insert(&node);
+    const Node &canonical = **inserted.first;
+    if (inserted.second || canonical.type != node.type) {
+        return;     // first of its kind, or a list equal to a packed array
+    }
+
+    if (node.type == NodeType::LIST) {
+        NodeVector<Node::Ptr, ListCache> &value =
+            const_cast<NodeList &>(static_cast<const NodeList &>(node)).value;
+        const NodeVector<Node::Ptr, ListCache> &other =
+            static_cast<const NodeList &>(canonical).value;
+        if (!value.shares(other)) {
+            this->add_stats(node);
+            this->retired.emplace_back(share_node(node));
+            value.share(other);
+        }
+    } else {
+        PairVector &pairs = const_cast<NodeObject &>(static_cast<const NodeObject &>(node)).pairs;
+        const PairVector &other = static_cast<const NodeObject &>(canonical).pairs;
+        if (!pairs.shares(other)) {
+            this->add_stats(node);
+            this->retired.emplace_back(share_node(node));
+            pairs.share(other);
+        }
+    }
+}
+
+
+// before node drops its children
+void Deduplicator::add_stats(const Node &node) {
+    this->stats.subtrees++;
+    // the node itself stays
+    size_t self = node.type == NodeType::LIST ? sizeof(NodeList) : sizeof(NodeObject);
+    this->stats.bytes += tree_bytes(node) - self;
+}
+
+
+FrozenNode dedup_subtrees(Node::Ptr &&root, DedupStats *stats) {
+    FrozenNode frozen = freeze(move(root));
+    Deduplicator dedup;
+    dedup.run(*frozen);
+    if (stats != nullptr) {
+        *stats = dedup.stats;
+    }
+    return frozen;
+}
@@ -0,0 +1,26 @@
+#ifndef JSON_CXX_DEDUP_H
+#define JSON_CXX_DEDUP_H
+
+
+#include <cstddef>
+
+#include "document.h"
+#include "node.h"
+
+
+struct DedupStats {
+    size_t subtrees = 0;    // lists and objects now sharing children with an equal one
+    size_t bytes = 0;       // estimated heap bytes freed
+};
+
+
+// Hash-consing: equal list and object subtrees of root share their children.
+// Packed number arrays and strings are not shared. Subtrees that already share
+// children are left as they are. Takes the ownership of root and freezes it,
+// so the shared children can not be modified through one of the subtrees,
+// use replace_path() for modified versions. stats is filled in if not nullptr.
+// References into root taken before must not be used to modify it.
+FrozenNode dedup_subtrees(Node::Ptr &&root, DedupStats *stats = nullptr);
+
+
+#endif //JSON_CXX_DEDUP_H
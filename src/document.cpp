@@ -0,0 +1,141 @@
+#include <atomic>
+#include <vector>
+
+#include "document.h"
+#include "memory.h"
+
+
+using std::atomic_exchange;
+using std::atomic_load;
+using std::lock_guard;
+using std::unique_lock;
+using std::vector;
+
+
+// Returns false for other nodes, and for containers frozen before, see NodeVector::frozen().
+static bool mark_frozen(const Node &node) {
+    if (node.type == NodeType::LIST) {
+        return static_cast<const NodeList &>(node).value.mark_frozen();
+    } else if (node.type == NodeType::OBJECT) {
+        return static_cast<const NodeObject &>(node).pairs.mark_frozen();
+    }
+    return false;
+}
+
+
+// Iterative, marks all containers frozen, then hash() fills in the hashes of all subtrees.
+// The descendants of a frozen container are frozen already, so shared children are
+// visited once, and a tree from replace_path() is visited along the copied path only.
+static void build_caches(const Node &root) {
+    vector<const Node *> stack = {&root};
+    while (!stack.empty()) {
+        const Node &node = *stack.back();
+        stack.pop_back();
+        if (!mark_frozen(node)) {
+            continue;
+        }
+        if (node.type == NodeType::OBJECT) {
+            const PairVector &pairs = static_cast<const NodeObject &>(node).pairs;
+            if (!pairs.get_shape() && pairs.size() >= NodeObject::INDEX_THRESHOLD) {
+                pairs.index();
+            }
+        }
+        for (size_t i = 0; i < child_count(node); ++i) {
+            const Node &child = child_at(node, i);
+            if (child.type == NodeType::LIST || child.type == NodeType::OBJECT) {
+                stack.push_back(&child);
+            }
+        }
+    }
+    root.hash();
+}
+
+
+FrozenNode freeze(Node::Ptr &&root) {
+    build_caches(*root);
+    return FrozenNode(root.release());
+}
+
+
+FrozenNode freeze(Node::Ptr &&root, Reclaimer &reclaimer) {
+    build_caches(*root);
+    Reclaimer *target = &reclaimer;
+    return FrozenNode(root.release(), [target](const Node *node) {
+        target->retire(Node::Ptr(const_cast<Node *>(node)));
+    });
+}
+
+
+Reclaimer::Reclaimer() {
+    this->worker = thread(&Reclaimer::run, this);
+}
+
+
+Reclaimer::~Reclaimer() {
+    {
+        lock_guard<mutex> guard(this->lock);
+        this->stop = true;
+    }
+    this->wakeup.notify_one();
+    this->worker.join();
+}
+
+
+void Reclaimer::retire(Node::Ptr &&tree) {
+    if (!tree) {
+        return;
+    }
+    {
+        lock_guard<mutex> guard(this->lock);
+        this->queue.push_back(move(tree));
+    }
+    this->wakeup.notify_one();
+}
+
+
+void Reclaimer::drain() {
+    unique_lock<mutex> guard(this->lock);
+    this->idle.wait(guard, [this]() { return this->queue.empty() && !this->busy; });
+}
+
+
+size_t Reclaimer::queue_depth() const {
+    lock_guard<mutex> guard(this->lock);
+    return this->queue.size();
+}
+
+
+// Exits once stopped and the queue is empty.
+void Reclaimer::run() {
+    unique_lock<mutex> guard(this->lock);
+    while (true) {
+        this->wakeup.wait(guard, [this]() { return this->stop || !this->queue.empty(); });
+        if (this->queue.empty()) {
+            return;
+        }
+        Node::Ptr tree = move(this->queue.front());
+        this->queue.pop_front();
+        this->busy = true;
+        guard.unlock();
+
+        this->_reclaimed_bytes += tree_bytes(*tree);
+        tree.reset();
+        this->_reclaimed_trees++;
+
+        guard.lock();
+        this->busy = false;
+        if (this->queue.empty()) {
+            this->idle.notify_all();
+        }
+    }
+}
+
+
+FrozenNode DocumentHolder::get() const {
+    return atomic_load(&this->doc);
+}
+
+
+FrozenNode DocumentHolder::reload(FrozenNode doc) {
+    return atomic_exchange(&this->doc, move(doc));
+}
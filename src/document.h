@@ -0,0 +1,98 @@
+#ifndef JSON_CXX_DOCUMENT_H
+#define JSON_CXX_DOCUMENT_H
+
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "node.h"
+
+
+using std::atomic;
+using std::condition_variable;
+using std::deque;
+using std::mutex;
+using std::shared_ptr;
+using std::thread;
+
+
+// Read-only tree, safe to read from any number of threads without locks.
+// Node::Ptr is const-propagating, so only const nodes are reachable from it.
+typedef shared_ptr<const Node> FrozenNode;
+
+
+// Builds the lazily built caches of all subtrees (hashes, key indexes)
+// so that readers never fill them in, and takes the ownership of root.
+// References into root taken before must not be used to modify it.
+FrozenNode freeze(Node::Ptr &&root);
+
+
+// Frees retired trees on a background thread, so that dropping a large
+// document returns immediately instead of running its destructors.
+class Reclaimer {
+public:
+    Reclaimer();
+    // Frees the trees still queued.
+    ~Reclaimer();
+    Reclaimer(const Reclaimer &) = delete;
+    Reclaimer &operator=(const Reclaimer &) = delete;
+
+    void retire(Node::Ptr &&tree);
+    // Blocks until the trees retired so far are freed.
+    void drain();
+
+    // trees waiting to be freed
+    size_t queue_depth() const;
+    size_t reclaimed_trees() const {
+        return this->_reclaimed_trees.load();
+    }
+    // estimated with tree_bytes()
+    size_t reclaimed_bytes() const {
+        return this->_reclaimed_bytes.load();
+    }
+
+private:
+    void run();
+
+    mutable mutex lock;
+    condition_variable wakeup;
+    condition_variable idle;
+    deque<Node::Ptr> queue;
+    bool busy = false;
+    bool stop = false;
+    atomic<size_t> _reclaimed_trees{0};
+    atomic<size_t> _reclaimed_bytes{0};
+    thread worker;      // started last
+};
+
+
+// Same as freeze(root), but the last reader dropping the tree retires it to reclaimer,
+// which must outlive the tree.
+FrozenNode freeze(Node::Ptr &&root, Reclaimer &reclaimer);
+
+
+// The current version of a frozen document.
+// Readers take a snapshot which stays valid while they hold it,
+// reload() swaps in a new version without waiting for them (RCU style).
+// The old version is freed by the last reader releasing it,
+// on a Reclaimer thread if frozen with one.
+class DocumentHolder {
+public:
+    explicit DocumentHolder(FrozenNode doc = FrozenNode()) : doc(move(doc)) {}
+    DocumentHolder(const DocumentHolder &) = delete;
+    DocumentHolder &operator=(const DocumentHolder &) = delete;
+
+    FrozenNode get() const;
+    // Returns the previous version.
+    FrozenNode reload(FrozenNode doc);
+
+private:
+    FrozenNode doc;     // accessed with std::atomic_load and std::atomic_exchange only
+};
+
+
+#endif //JSON_CXX_DOCUMENT_H
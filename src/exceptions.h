@@ -14,6 +14,7 @@
 using std::shared_ptr;
 using std::runtime_error;
 using std::string;
+using std::to_string;
 using std::vector;
 
 
@@ -50,6 +51,17 @@ public:
 };
 
 
+class BudgetExceeded : public ParserError {
+public:
+    BudgetExceeded(size_t budget, const SourcePos &start, const SourcePos &end)
+        : ParserError("Byte budget of " + to_string(budget) + " exceeded.", start, end),
+          budget(budget)
+    {}
+
+    size_t budget;
+};
+
+
 class UnexpectedToken : public ParserError {
 public:
     UnexpectedToken(const Token &token, const vector<TokenType> &expected_types)
@@ -1,159 +1,616 @@
 #include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
 #include <string>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "formatter.h"
-#include "string_fmt.hpp"
+#include "number.h"
 #include "unicode.h"
 
 
 using std::all_of;
+using std::isfinite;
+using std::memcpy;
+using std::min;
+using std::out_of_range;
+using std::shared_ptr;
 using std::string;
 
 
-ostream &Formatter::format(ostream &os, const Node &node) {
-    FormatContext ctx(this->opt);
-    this->do_node(os, node, ctx);
+// How write_char() writes a code point below 256: 0 as is, 'u' as \u00XX,
+// 'x' encoded as UTF-8, otherwise as a backslash and the char.
+static const char ESCAPES[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x',
+    'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x',
+    'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x',
+    'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x',
+    'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x',
+    'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x',
+    'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x',
+    'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x', 'x',
+};
+
+
+// two lowercase hex digits for each byte
+static const char HEX_PAIRS[] =
+    "000102030405060708090a0b0c0d0e0f"
+    "101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f"
+    "303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f"
+    "505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f"
+    "707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f"
+    "909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeaf"
+    "b0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecf"
+    "d0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeef"
+    "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+
+// Copies the leading chars which are written as is to buf, returns their count.
+static size_t narrow_plain(const unichar *data, size_t size, char *buf) {
+    size_t i = 0;
+#ifdef __SSE2__
+    // code points are positive as int32
+    const __m128i space = _mm_set1_epi32(0x1f);
+    const __m128i del = _mm_set1_epi32(0x80);
+    const __m128i quote = _mm_set1_epi32('"');
+    const __m128i backslash = _mm_set1_epi32('\\');
+    auto is_plain = [&](__m128i chars) {
+        __m128i plain = _mm_and_si128(
+            _mm_cmpgt_epi32(chars, space), _mm_cmplt_epi32(chars, del));
+        __m128i special = _mm_or_si128(
+            _mm_cmpeq_epi32(chars, quote), _mm_cmpeq_epi32(chars, backslash));
+        return _mm_andnot_si128(special, plain);
+    };
+    const __m128i *src = reinterpret_cast<const __m128i *>(data);
+    // 16 chars at a time
+    for (; i + 16 <= size; i += 16, src += 4) {
+        __m128i a = _mm_loadu_si128(src);
+        __m128i b = _mm_loadu_si128(src + 1);
+        __m128i c = _mm_loadu_si128(src + 2);
+        __m128i d = _mm_loadu_si128(src + 3);
+        __m128i plain = _mm_and_si128(
+            _mm_and_si128(is_plain(a), is_plain(b)), _mm_and_si128(is_plain(c), is_plain(d)));
+        if (_mm_movemask_epi8(plain) != 0xffff) {
+            break;
+        }
+        __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(buf + i), bytes);
+    }
+    // then 4, up to the first char to escape
+    for (; i + 4 <= size; i += 4, ++src) {
+        __m128i chars = _mm_loadu_si128(src);
+        if (_mm_movemask_epi8(is_plain(chars)) != 0xffff) {
+            break;
+        }
+        __m128i bytes = _mm_packs_epi32(chars, chars);
+        int32_t packed = _mm_cvtsi128_si32(_mm_packus_epi16(bytes, bytes));
+        memcpy(buf + i, &packed, 4);
+    }
+#endif
+    for (; i < size && data[i] < 0x80 && ESCAPES[data[i]] == 0; ++i) {
+        buf[i] = static_cast<char>(data[i]);
+    }
+    return i;
+}
+
+
+// For strings without chars to escape, buf holds 4 bytes per char.
+static char *encode_escape_free(const unichar *data, size_t size, bool ascii, char *buf) {
+    if (ascii) {
+        for (size_t i = 0; i < size; ++i) {
+            buf[i] = static_cast<char>(data[i]);
+        }
+        return buf + size;
+    }
+    for (size_t i = 0; i < size; ++i) {
+        if (data[i] < 0x80) {
+            *buf++ = static_cast<char>(data[i]);
+        } else {
+            buf = u8_write_char(buf, data[i]);
+        }
+    }
+    return buf;
+}
+
+
+ostream &Formatter::format(ostream &os, const Node &node, unsigned int level) {
+    OstreamSink out(os);
+    this->format(out, node, level);
+    out.flush();
     return os;
 }
 
 
-void Formatter::do_node(ostream &os, const Node &node, FormatContext &ctx) {
+void Formatter::format(Sink &out, const Node &node, unsigned int level) {
+    if (this->opt.compact() || this->opt.canonical()) {
+        return this->do_compact(out, node);
+    }
+    FormatContext ctx(this->opt);
+    ctx.level = level;
+    this->do_node(out, node, ctx);
+}
+
+
+size_t Formatter::measure(const Node &node, unsigned int level) {
+    CountingSink counter;
+    if (this->size_key() != 0) {
+        this->do_compact(counter, node, &counter);
+    } else {
+        this->format(counter, node, level);
+    }
+    return counter.count();
+}
+
+
+size_t Formatter::measure(const Node &node, const FormatOption &opt) {
+    return Formatter(opt).measure(node);
+}
+
+
+unsigned int Formatter::size_key() const {
+    if (this->opt.canonical()) {
+        return 0x3;
+    }
+    int precision = this->opt.float_precision();
+    if (!this->opt.compact() || precision < 0 || precision >= 1 << (CachedSize::KEY_BITS - 3)) {
+        return 0;
+    }
+    return 0x1 | (this->opt.ensure_ascii() ? 0x4 : 0) | static_cast<unsigned int>(precision) << 3;
+}
+
+
+// Only for frozen containers, the descendants of others may be modified without notice.
+static const CachedSize *size_cache_of(const Node &container) {
+    if (container.type == NodeType::LIST) {
+        const NodeVector<Node::Ptr, ListCache> &value =
+            static_cast<const NodeList &>(container).value;
+        return value.frozen() ? &value.cache()->size : nullptr;
+    }
+    const PairVector &pairs = static_cast<const NodeObject &>(container).pairs;
+    return pairs.frozen() ? pairs.size_cache() : nullptr;
+}
+
+
+// Measuring would walk the tree once more unless its size can be cached,
+// otherwise the buffer grows as written.
+string Formatter::to_string(const Node &node, unsigned int level) {
+    bool container = node.type == NodeType::LIST || node.type == NodeType::OBJECT;
+    bool cached = this->size_key() != 0 && container && size_cache_of(node) != nullptr;
+    StringSink out(cached ? this->measure(node, level) : 0);
+    this->format(out, node, level);
+    return out.take();
+}
+
+
+// Only for frozen containers, like the sizes.
+static const CachedFragment *fragment_cache_of(const Node &container) {
+    if (container.type == NodeType::LIST) {
+        const NodeVector<Node::Ptr, ListCache> &value =
+            static_cast<const NodeList &>(container).value;
+        return value.frozen() ? &value.cache()->fragment : nullptr;
+    }
+    const PairVector &pairs = static_cast<const NodeObject &>(container).pairs;
+    return pairs.frozen() ? pairs.fragment_cache() : nullptr;
+}
+
+
+void Formatter::do_node(Sink &out, const Node &root, FormatContext &ctx) {
+    vector<FormatFrame> stack;
+    const Node *node = &root;
+    while (true) {
+        bool finished = false;  // a child of the top frame is finished
+        if (node->type == NodeType::LIST || node->type == NodeType::OBJECT) {
+            stack.push_back(this->open_container(out, *node, ctx));
+        } else {
+            this->do_scalar(out, *node, ctx);
+            finished = true;
+        }
+
+        node = nullptr;
+        while (node == nullptr) {
+            if (stack.empty()) {
+                return;
+            }
+            FormatFrame &frame = stack.back();
+            if (finished) {
+                this->end_child(out, frame, ctx);
+            }
+            if (frame.next < frame.size) {
+                node = &this->begin_child(out, frame, ctx);
+                frame.next++;
+            } else {
+                this->close_list_like(out, ctx, frame.node->type == NodeType::LIST ? "]" : "}");
+                stack.pop_back();
+                finished = true;
+            }
+        }
+    }
+}
+
+
+// Iterative like do_node().
+void Formatter::do_compact(Sink &out, const Node &root, CountingSink *counter) {
+    const unsigned int key = this->size_key();
+    const bool measuring = counter != nullptr && key != 0;
+    const bool fragments = counter == nullptr && key != 0 && this->opt.fragment_size() > 0;
+    vector<FormatFrame> stack;
+    const Node *node = &root;
+    while (true) {
+        while (node->type == NodeType::PAIR) {
+            const NodePair &pair = static_cast<const NodePair &>(*node);
+            this->write_string(out, *pair.key);
+            out.put(':');
+            node = pair.value.get();
+        }
+        const bool container = node->type == NodeType::LIST || node->type == NodeType::OBJECT;
+        size_t size = 0;
+        const CachedSize *cache = measuring && container ? size_cache_of(*node) : nullptr;
+        if (cache != nullptr && cache->get(key, size)) {
+            counter->skip(size);
+        } else if (fragments && container && this->write_fragment(out, *node)) {
+            // written from the cache
+        } else if (container) {
+            size_t start = measuring ? counter->count() : 0;
+            out.put(node->type == NodeType::LIST ? '[' : '{');
+            stack.push_back(FormatFrame{node, child_count(*node), 0, false, start, nullptr, {}});
+            FormatFrame &frame = stack.back();
+            if (this->opt.canonical() && node->type == NodeType::OBJECT) {
+                // the buffer keeps its data when the frame is moved
+                const PairVector &pairs = static_cast<const NodeObject &>(*node).pairs;
+                frame.order = pairs.key_order(frame.order_buffer).data();
+            }
+        } else {
+            this->do_compact_scalar(out, *node);
+        }
+
+        node = nullptr;
+        while (node == nullptr) {
+            if (stack.empty()) {
+                return;
+            }
+            FormatFrame &frame = stack.back();
+            if (frame.next == frame.size) {
+                out.put(frame.node->type == NodeType::LIST ? ']' : '}');
+                const CachedSize *cache = measuring ? size_cache_of(*frame.node) : nullptr;
+                if (cache != nullptr) {
+                    cache->set(key, counter->count() - frame.start);
+                }
+                stack.pop_back();
+                continue;
+            }
+            if (frame.next > 0) {
+                out.put(',');
+            }
+            if (frame.node->type == NodeType::LIST) {
+                node = static_cast<const NodeList &>(*frame.node).value[frame.next].get();
+            } else {
+                const PairVector &pairs = static_cast<const NodeObject &>(*frame.node).pairs;
+                size_t i = frame.order != nullptr ? frame.order[frame.next] : frame.next;
+                this->write_string(out, *pairs.key(i));
+                out.put(':');
+                node = pairs.value(i).get();
+            }
+            frame.next++;
+        }
+    }
+}
+
+
+// The fragment is formatted without fragments of its children, so each byte of the output
+// is cached once.
+bool Formatter::write_fragment(Sink &out, const Node &node) {
+    const CachedFragment *cache = fragment_cache_of(node);
+    if (cache == nullptr) {
+        return false;
+    }
+    const unsigned int key = this->size_key();
+    shared_ptr<const string> data = cache->get(key);
+    if (!data) {
+        if (this->measure(node) > this->opt.fragment_size()) {
+            return false;
+        }
+        FormatOption opt = this->opt;
+        data = cache->set(key, Formatter(opt.fragment_size(0)).to_string(node));
+    }
+    out.write(*data);
+    return true;
+}
+
+
+void Formatter::do_compact_scalar(Sink &out, const Node &node) {
     switch (node.type) {
     case NodeType::NIL:
-        return this->do_null(os, static_cast<const NodeNull &>(node), ctx);
+        return out.write("null", 4);
     case NodeType::BOOL:
-        return this->do_bool(os, static_cast<const NodeBool &>(node), ctx);
+        return out.write(static_cast<const NodeBool &>(node).value ? "true" : "false");
     case NodeType::INT:
-        return this->do_int(os, static_cast<const NodeInt &>(node), ctx);
+        return this->write_number(out, static_cast<const NodeInt &>(node).value);
     case NodeType::FLOAT:
-        return this->do_float(os, static_cast<const NodeFloat &>(node), ctx);
+        return this->write_number(out, static_cast<const NodeFloat &>(node).value);
+    case NodeType::NUMBER:
+        if (this->opt.canonical()) {
+            return this->write_number(out, static_cast<const NodeNumber &>(node).as_double());
+        }
+        return out.write(static_cast<const NodeNumber &>(node).lexeme);
     case NodeType::STRING:
-        return this->do_string(os, static_cast<const NodeString &>(node), ctx);
+        return this->write_string(out, static_cast<const NodeString &>(node));
+    case NodeType::INT_ARRAY:
+        return this->do_compact_array(out, static_cast<const NodeIntArray &>(node));
+    case NodeType::FLOAT_ARRAY:
+        return this->do_compact_array(out, static_cast<const NodeFloatArray &>(node));
+    case NodeType::PAIR:
     case NodeType::LIST:
-        return this->do_list(os, static_cast<const NodeList &>(node), ctx);
+    case NodeType::OBJECT:
+        break;
+    }
+    assert(!"Unreachable");
+}
+
+
+template<class NodeArray>
+void Formatter::do_compact_array(Sink &out, const NodeArray &node) {
+    out.put('[');
+    for (size_t i = 0; i < node.value.size(); ++i) {
+        if (i > 0) {
+            out.put(',');
+        }
+        this->write_number(out, node.value[i]);
+    }
+    out.put(']');
+}
+
+
+// nodes without child nodes
+void Formatter::do_scalar(Sink &out, const Node &node, FormatContext &ctx) {
+    switch (node.type) {
+    case NodeType::NIL:
+        return this->do_null(out, static_cast<const NodeNull &>(node), ctx);
+    case NodeType::BOOL:
+        return this->do_bool(out, static_cast<const NodeBool &>(node), ctx);
+    case NodeType::INT:
+        return this->do_int(out, static_cast<const NodeInt &>(node), ctx);
+    case NodeType::FLOAT:
+        return this->do_float(out, static_cast<const NodeFloat &>(node), ctx);
+    case NodeType::STRING:
+        return this->do_string(out, static_cast<const NodeString &>(node), ctx);
     case NodeType::PAIR:
-        return this->do_pair(os, static_cast<const NodePair &>(node), ctx);
+        return this->do_pair(out, static_cast<const NodePair &>(node), ctx);
+    case NodeType::INT_ARRAY:
+        return this->do_number_array(out, static_cast<const NodeIntArray &>(node), ctx);
+    case NodeType::FLOAT_ARRAY:
+        return this->do_number_array(out, static_cast<const NodeFloatArray &>(node), ctx);
+    case NodeType::NUMBER:
+        return this->do_number(out, static_cast<const NodeNumber &>(node), ctx);
+    case NodeType::LIST:
     case NodeType::OBJECT:
-        return this->do_object(os, static_cast<const NodeObject &>(node), ctx);
+        break;
     }
     assert(!"Unreachable");
 }
 
 
-void Formatter::do_null(ostream &os, const NodeNull &node, FormatContext &ctx) {
-    this->do_indent(os, ctx);
-    os << "null";
+void Formatter::do_null(Sink &out, const NodeNull &node, FormatContext &ctx) {
+    this->do_indent(out, ctx);
+    out.write("null");
 }
 
 
-void Formatter::do_bool(ostream &os, const NodeBool &node, FormatContext &ctx) {
-    this->do_indent(os, ctx);
-    os << (node.value ? "true" : "false");
+void Formatter::do_bool(Sink &out, const NodeBool &node, FormatContext &ctx) {
+    this->do_indent(out, ctx);
+    out.write(node.value ? "true" : "false");
 }
 
 
-void Formatter::do_int(ostream &os, const NodeInt &node, FormatContext &ctx) {
-    this->do_indent(os, ctx);
-    os << to_string(node.value);    // TODO: handle overflow, precision
+void Formatter::do_int(Sink &out, const NodeInt &node, FormatContext &ctx) {
+    this->do_indent(out, ctx);
+    this->write_number(out, node.value);
 }
 
 
-void Formatter::do_float(ostream &os, const NodeFloat &node, FormatContext &ctx) {
-    this->do_indent(os, ctx);
-    os << to_string(node.value);    // TODO: handle overflow, precision
+void Formatter::do_float(Sink &out, const NodeFloat &node, FormatContext &ctx) {
+    this->do_indent(out, ctx);
+    this->write_number(out, node.value);
 }
 
 
-void Formatter::do_string(ostream &os, const NodeString &node, FormatContext &ctx) {
-    this->do_indent(os, ctx);
-    os << "\"";
-    for (unichar ch : node.value) {
-        os << Formatter::quote_char(ch, ctx.opt);
+void Formatter::do_number(Sink &out, const NodeNumber &node, FormatContext &ctx) {
+    this->do_indent(out, ctx);
+    out.write(node.lexeme);
+}
+
+
+void Formatter::write_number(Sink &out, int64_t value) {
+    if (this->opt.canonical()) {
+        // ECMAScript numbers are doubles, larger integers are rounded
+        return this->write_number(out, static_cast<double>(value));
+    }
+    char buf[INT_BUF_SIZE];
+    out.write(buf, static_cast<size_t>(write_int(buf, value) - buf));
+}
+
+
+void Formatter::write_number(Sink &out, double value) {
+    char buf[DOUBLE_BUF_SIZE];
+    char *end = buf;
+    int precision = this->opt.float_precision();
+    if (this->opt.canonical()) {
+        if (!isfinite(value)) {
+            throw out_of_range("no canonical JSON for " + string(buf, write_double(buf, value)));
+        }
+        end = write_double_canonical(buf, value);
+    } else if (precision > 0) {
+        end = write_double(buf, value, precision);
+    } else {
+        end = write_double(buf, value);
     }
-    os << "\"";
+    out.write(buf, static_cast<size_t>(end - buf));
+}
+
+
+void Formatter::do_string(Sink &out, const NodeString &node, FormatContext &ctx) {
+    this->do_indent(out, ctx);
+    this->write_string(out, node);
 }
 
 
-void Formatter::do_list(ostream &os, const NodeList &node, FormatContext &ctx) {
-    bool simple_child = (
-        node.value.size() <= 1
-        || all_of(node.value.begin(), node.value.end(), Formatter::is_simple_node<Node>)
-    );
-    this->do_list_like<Node>(os, node.value, ctx, "[", "]", simple_child);
+void Formatter::do_pair(Sink &out, const NodePair &node, FormatContext &ctx) {
+    this->do_pair(out, *node.key, *node.value, ctx);
 }
 
 
-void Formatter::do_pair(ostream &os, const NodePair &node, FormatContext &ctx) {
+void Formatter::do_pair(
+    Sink &out, const NodeString &key, const Node &value, FormatContext &ctx)
+{
     ctx.push();
-    this->do_indent(os, ctx);
+    this->do_indent(out, ctx);
 
     ctx.newline = false;
-    this->do_string(os, *node.key, ctx);
-    os << ": ";
-    this->do_node(os, *node.value, ctx);
+    this->do_string(out, key, ctx);
+    out.write(": ");
+    this->do_node(out, value, ctx);
 
     ctx.pop();
 }
 
 
-void Formatter::do_object(ostream &os, const NodeObject &node, FormatContext &ctx) {
-    bool simple_child = (
-        node.pairs.empty()
-        || all_of(node.pairs.begin(), node.pairs.end(), Formatter::is_simple_node<NodePair>)
-    );
-    this->do_list_like<NodePair>(os, node.pairs, ctx, "{", "}", simple_child);
+FormatFrame Formatter::open_container(Sink &out, const Node &node, FormatContext &ctx) {
+    FormatFrame frame{&node, child_count(node), 0, true, 0, nullptr, {}};
+    if (node.type == NodeType::LIST) {
+        const NodeList &list = static_cast<const NodeList &>(node);
+        frame.simple_child = list.value.size() <= 1
+            || all_of(list.value.begin(), list.value.end(), Formatter::is_simple_node<Node>);
+        this->open_list_like(out, ctx, "[", frame.simple_child);
+    } else {
+        // pairs.value() does not convert objects in shape mode
+        const PairVector &pairs = static_cast<const NodeObject &>(node).pairs;
+        for (size_t i = 0; i < pairs.size() && frame.simple_child; ++i) {
+            frame.simple_child = Formatter::is_simple_node(*pairs.value(i));
+        }
+        this->open_list_like(out, ctx, "{", frame.simple_child);
+    }
+    return frame;
 }
 
 
-template<class NodeClass>
+const Node &Formatter::begin_child(Sink &out, const FormatFrame &frame, FormatContext &ctx) {
+    if (frame.node->type == NodeType::LIST) {
+        return *static_cast<const NodeList &>(*frame.node).value[frame.next];
+    }
+
+    // the same as do_pair()
+    const PairVector &pairs = static_cast<const NodeObject &>(*frame.node).pairs;
+    ctx.push();
+    this->do_indent(out, ctx);
+    ctx.newline = false;
+    this->do_string(out, *pairs.key(frame.next), ctx);
+    out.write(": ");
+    return *pairs.value(frame.next);
+}
+
+
+void Formatter::end_child(Sink &out, const FormatFrame &frame, FormatContext &ctx) {
+    if (frame.node->type == NodeType::OBJECT) {
+        ctx.pop();
+    }
+    this->separate_child(out, frame.next - 1, frame.size, frame.simple_child);
+}
+
+
+// formatted the same as the NodeList of the numbers
+template<class NodeArray>
+void Formatter::do_number_array(Sink &out, const NodeArray &node, FormatContext &ctx) {
+    auto do_child = [this, &out, &node](size_t i) {
+        this->write_number(out, node.value[i]);
+    };
+    this->do_list_like(out, node.value.size(), do_child, ctx, "[", "]", true);
+}
+
+
+template<class DoChild>
 void Formatter::do_list_like(
-    ostream &os, const vector<typename NodeClass::Ptr> &children, FormatContext &ctx,
+    Sink &out, size_t size, DoChild do_child, FormatContext &ctx,
     const string &open, const string &close, bool simple_child)
+{
+    this->open_list_like(out, ctx, open, simple_child);
+    for (size_t i = 0; i < size; ++i) {
+        do_child(i);
+        this->separate_child(out, i, size, simple_child);
+    }
+    this->close_list_like(out, ctx, close);
+}
+
+
+void Formatter::open_list_like(
+    Sink &out, FormatContext &ctx, const string &open, bool simple_child)
 {
     ctx.push();
 
-    this->do_indent(os, ctx);
+    this->do_indent(out, ctx);
     if (simple_child) {
-        os << open;
+        out.write(open);
         ctx.newline = false;
     } else {
-        os << open << "\n";
+        out.write(open);
+        out.put('\n');
         ctx.newline = true;
         ctx.level++;
     }
+}
 
-    for (size_t i = 0; i < children.size(); ++i) {
-        this->do_node(os, *children[i], ctx);
-        if (i != children.size() - 1) {
-            if (simple_child) {
-                os << ", ";
-            } else {
-                os << ",\n";
-            }
+
+// after the i-th child
+void Formatter::separate_child(Sink &out, size_t i, size_t size, bool simple_child) {
+    if (i != size - 1) {
+        if (simple_child) {
+            out.write(", ");
         } else {
-            if (!simple_child) {
-                os << "\n";
-            }
+            out.write(",\n");
+        }
+    } else {
+        if (!simple_child) {
+            out.write("\n");
         }
     }
+}
+
 
+void Formatter::close_list_like(Sink &out, FormatContext &ctx, const string &close) {
     if (ctx.newline) {
         ctx.level--;
-        this->do_indent(os, ctx);
+        this->do_indent(out, ctx);
     }
-    os << close;
+    out.write(close);
 
     ctx.pop();
 }
 
 
-void Formatter::do_indent(ostream &os, FormatContext &ctx) {
+void Formatter::do_indent(Sink &out, FormatContext &ctx) {
     if (ctx.newline) {
         if (ctx.opt.use_tab()) {
-            os << string(ctx.level, '\t');
+            out.fill('\t', ctx.level);
         } else {
-            os << string(ctx.level * ctx.opt.indent(), ' ');
+            out.fill(' ', ctx.level * ctx.opt.indent());
         }
     }
 }
@@ -169,7 +626,7 @@ bool Formatter::is_simple_node(const Node &node) {
     if (
         node.type == NodeType::NIL || node.type == NodeType::BOOL
         || node.type == NodeType::INT || node.type == NodeType::FLOAT
-        || node.type == NodeType::STRING)
+        || node.type == NodeType::NUMBER || node.type == NodeType::STRING)
     {
         return true;
     } else if (node.type == NodeType::PAIR) {
@@ -181,43 +638,98 @@ bool Formatter::is_simple_node(const Node &node) {
     } else if (node.type == NodeType::OBJECT) {
         const auto &obj = static_cast<const NodeObject &>(node);
         return obj.pairs.empty();
+    } else if (node.type == NodeType::INT_ARRAY) {
+        return static_cast<const NodeIntArray &>(node).value.size() <= 1;
+    } else if (node.type == NodeType::FLOAT_ARRAY) {
+        return static_cast<const NodeFloatArray &>(node).value.size() <= 1;
     } else {
         return false;
     }
 }
 
 
+// Empty, or a single simple node. Nested single lists are followed in a loop.
 bool Formatter::is_simple_list(const NodeList &list) {
-    if (list.value.empty()) {
-        return true;
+    const NodeList *cur = &list;
+    while (cur->value.size() == 1 && cur->value[0]->type == NodeType::LIST) {
+        cur = static_cast<const NodeList *>(cur->value[0].get());
+    }
+    return cur->value.empty()
+        || (cur->value.size() == 1 && Formatter::is_simple_node(*cur->value[0]));
+}
+
+
+// Checks nothing per char if the flags allow.
+void Formatter::write_string(Sink &out, const NodeString &node) {
+    if (!node.is_escape_free() || (!node.is_ascii() && this->ensure_ascii())) {
+        return this->write_string(out, node.value());
     }
-    if (list.value.size() == 1) {
-        if (Formatter::is_simple_node(*list.value[0])) {
-            return true;
+    const unichar *data = node.value().data();
+    char buf[1024];
+    out.put('"');
+    for (size_t i = 0; i < node.value().size();) {
+        size_t n = min(node.value().size() - i, sizeof(buf) / 4);
+        char *end = encode_escape_free(data + i, n, node.is_ascii(), buf);
+        out.write(buf, static_cast<size_t>(end - buf));
+        i += n;
+    }
+    out.put('"');
+}
+
+
+void Formatter::write_string(Sink &out, const ustring &value) {
+    const unichar *data = value.data();
+    const size_t size = value.size();
+    char buf[256];
+    out.put('"');
+    for (size_t i = 0; i < size;) {
+        size_t n = narrow_plain(data + i, min(size - i, sizeof(buf)), buf);
+        if (n > 0) {
+            out.write(buf, n);
+            i += n;
+        } else if (data[i] >= 0x80 && this->ensure_ascii()) {
+            Formatter::write_ascii_char(out, data[i++]);
+        } else {
+            Formatter::write_char(out, data[i++]);
         }
     }
-    return false;
+    out.put('"');
 }
 
 
-string Formatter::quote_char(unichar ch, const FormatOption &opt) {
-    if (ch == '"') {
-        return "\\\"";
-    } else if (ch == '\\') {
-        return "\\\\";
-    } else if (ch == '/') {
-        return "/";     // no escape
-    } else if (ch == '\b') {
-        return "\\b";
-    } else if (ch == '\f') {
-        return "\\f";
-    } else if (ch == '\n') {
-        return "\\n";
-    } else if (ch == '\t') {
-        return "\\t";
-    } else if (ch < 0x20) {
-        return string_fmt("\\u%04x", ch);
+// '/' is not escaped
+void Formatter::write_char(Sink &out, unichar ch) {
+    char esc = ch < 256 ? ESCAPES[ch] : 'x';
+    if (esc == 0) {
+        out.put(static_cast<char>(ch));
+    } else if (esc == 'u') {
+        Formatter::write_u_escape(out, ch);
+    } else if (esc == 'x') {
+        char buf[4];
+        out.write(buf, static_cast<size_t>(u8_write_char(buf, ch) - buf));
     } else {
-        return u8_encode({ch});
+        char buf[2] = {'\\', esc};
+        out.write(buf, sizeof(buf));
+    }
+}
+
+
+// For FormatOption::ensure_ascii(), ch is not ASCII.
+void Formatter::write_ascii_char(Sink &out, unichar ch) {
+    if (ch < 0x10000) {
+        return Formatter::write_u_escape(out, ch);
     }
+    unichar hi = 0;
+    unichar lo = 0;
+    u16_split_surrogate(ch, hi, lo);
+    Formatter::write_u_escape(out, hi);
+    Formatter::write_u_escape(out, lo);
+}
+
+
+void Formatter::write_u_escape(Sink &out, unichar unit) {
+    const char *high = HEX_PAIRS + (unit >> 8) * 2;
+    const char *low = HEX_PAIRS + (unit & 0xff) * 2;
+    char buf[6] = {'\\', 'u', high[0], high[1], low[0], low[1]};
+    out.write(buf, sizeof(buf));
 }
@@ -7,6 +7,7 @@
 #include <vector>
 
 #include "node.h"
+#include "sink.h"
 #include "unicode.h"
 
 
@@ -32,6 +33,22 @@ private: \
 class FormatOption {
     DEFINE_FMT_OPT(unsigned int, indent, 4);
     DEFINE_FMT_OPT(bool, use_tab, false);
+    // no whitespace at all, indent and use_tab are ignored
+    DEFINE_FMT_OPT(bool, compact, false);
+    // significant digits of floats, 0 for the shortest digits that read back exactly
+    DEFINE_FMT_OPT(int, float_precision, 0);
+    // non-ASCII code points as \uXXXX, with surrogate pairs above the BMP
+    DEFINE_FMT_OPT(bool, ensure_ascii, false);
+    // RFC 8785: no whitespace, keys sorted by UTF-16 code units, numbers as ECMAScript
+    // writes them, the other options are ignored. Integers are written as doubles too,
+    // so those beyond 2^53 are rounded.
+    DEFINE_FMT_OPT(bool, canonical, false);
+    // For compact and canonical output: frozen lists and objects whose output is at most
+    // this many bytes keep a copy of it in their bodies. Versions from replace_path() share
+    // them outside of the copied path. Other trees are formatted in full, see freeze().
+    // The largest such subtrees are cached, so the copies take about the size of the output.
+    // 0 caches nothing.
+    DEFINE_FMT_OPT(size_t, fragment_size, 0);
     // DEFINE_FMT_OPT(bool, always_newline, false);
 };
 
@@ -63,36 +80,95 @@ private:
 };
 
 
+// A list or an object being formatted.
+struct FormatFrame {
+    const Node *node;
+    size_t size;
+    size_t next;    // index of the next child
+    bool simple_child;
+    size_t start;   // bytes counted before the open bracket, see Formatter::measure()
+    const size_t *order;    // canonical key order of an object, see PairVector::key_order()
+    vector<size_t> order_buffer;
+};
+
+
 class Formatter {
 public:
     explicit Formatter(const FormatOption &opt = FormatOption()) : opt(opt) {}
-    ostream &format(ostream &os, const Node &node);
+    // level indents the lines after the first one as if node were nested level deep.
+    ostream &format(ostream &os, const Node &node, unsigned int level = 0);
+    // The output stays buffered in out until out.flush().
+    void format(Sink &out, const Node &node, unsigned int level = 0);
+    // The size of the output of format(), without writing it. For compact and canonical
+    // output the sizes of frozen lists and objects are cached in their bodies, so measuring
+    // a frozen document again is O(1), and a version from replace_path() takes the copied
+    // path only, see freeze().
+    size_t measure(const Node &node, unsigned int level = 0);
+    static size_t measure(const Node &node, const FormatOption &opt);
+    // The output in a string. Its buffer is allocated once, with the size from measure(),
+    // if the size of node is cached, see measure().
+    string to_string(const Node &node, unsigned int level = 0);
+    // value as a string literal, like format() of a NodeString without the node
+    void write_string(Sink &out, const NodeString &node);
+    void write_string(Sink &out, const ustring &value);
 
 protected:
-    void do_node(ostream &os, const Node &node, FormatContext &ctx);
-    void do_null(ostream &os, const NodeNull &node, FormatContext &ctx);
-    void do_bool(ostream &os, const NodeBool &node, FormatContext &ctx);
-    void do_int(ostream &os, const NodeInt &node, FormatContext &ctx);
-    void do_float(ostream &os, const NodeFloat &node, FormatContext &ctx);
-    void do_string(ostream &os, const NodeString &node, FormatContext &ctx);
-    void do_list(ostream &os, const NodeList &node, FormatContext &ctx);
-    void do_pair(ostream &os, const NodePair &node, FormatContext &ctx);
-    void do_object(ostream &os, const NodeObject &node, FormatContext &ctx);
-
-    template<class NodeClass>
+    // Iterative, so the depth of the tree is bounded by the heap only.
+    void do_node(Sink &out, const Node &node, FormatContext &ctx);
+    // For FormatOption::compact(), without layout decisions.
+    // With counter, out is counter, and the sizes of containers are taken from and stored
+    // in their caches.
+    void do_compact(Sink &out, const Node &node, CountingSink *counter = nullptr);
+    // For FormatOption::fragment_size(), false if node is too large for a fragment.
+    bool write_fragment(Sink &out, const Node &node);
+    void do_compact_scalar(Sink &out, const Node &node);
+    template<class NodeArray>
+    void do_compact_array(Sink &out, const NodeArray &node);
+    void do_scalar(Sink &out, const Node &node, FormatContext &ctx);
+    void do_null(Sink &out, const NodeNull &node, FormatContext &ctx);
+    void do_bool(Sink &out, const NodeBool &node, FormatContext &ctx);
+    void do_int(Sink &out, const NodeInt &node, FormatContext &ctx);
+    void do_float(Sink &out, const NodeFloat &node, FormatContext &ctx);
+    void do_number(Sink &out, const NodeNumber &node, FormatContext &ctx);
+    void do_string(Sink &out, const NodeString &node, FormatContext &ctx);
+    void do_pair(Sink &out, const NodePair &node, FormatContext &ctx);
+    void do_pair(Sink &out, const NodeString &key, const Node &value, FormatContext &ctx);
+    FormatFrame open_container(Sink &out, const Node &node, FormatContext &ctx);
+    // Returns the child to format.
+    const Node &begin_child(Sink &out, const FormatFrame &frame, FormatContext &ctx);
+    void end_child(Sink &out, const FormatFrame &frame, FormatContext &ctx);
+    template<class NodeArray>
+    void do_number_array(Sink &out, const NodeArray &node, FormatContext &ctx);
+    void write_number(Sink &out, int64_t value);
+    void write_number(Sink &out, double value);
+
+    // do_child(i) formats the i-th child
+    template<class DoChild>
     void do_list_like(
-        ostream &os, const vector<typename NodeClass::Ptr> &children, FormatContext &ctx,
+        Sink &out, size_t size, DoChild do_child, FormatContext &ctx,
         const string &open, const string &close, bool simple_child
     );
-    void do_indent(ostream &os, FormatContext &ctx);
+    void open_list_like(Sink &out, FormatContext &ctx, const string &open, bool simple_child);
+    void separate_child(Sink &out, size_t i, size_t size, bool simple_child);
+    void close_list_like(Sink &out, FormatContext &ctx, const string &close);
+    void do_indent(Sink &out, FormatContext &ctx);
 
     template<class NodeClass>
     static bool is_simple_node(const typename NodeClass::Ptr &node);
     static bool is_simple_node(const Node &node);
     static bool is_simple_list(const NodeList &list);
-    static string quote_char(unichar ch, const FormatOption &opt);
+    static void write_char(Sink &out, unichar ch);
+    static void write_ascii_char(Sink &out, unichar ch);
+    static void write_u_escape(Sink &out, unichar unit);
 
 private:
+    bool ensure_ascii() const {
+        return this->opt.ensure_ascii() && !this->opt.canonical();
+    }
+
+    // Identifies the options for CachedSize, 0 if the sizes are not cached.
+    unsigned int size_key() const;
+
     FormatOption opt;
 };
 
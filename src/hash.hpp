@@ -0,0 +1,63 @@
+#ifndef JSON_CXX_HASH_HPP
+#define JSON_CXX_HASH_HPP
+
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "unicode.h"
+
+
+using std::memcpy;
+
+
+// FNV-1a over code points.
+inline size_t hash_ustring(const ustring &us) {
+    uint64_t h = 14695981039346656037ULL;
+    for (unichar ch : us) {
+        h = (h ^ ch) * 1099511628211ULL;
+    }
+    return static_cast<size_t>(h);
+}
+
+
+inline size_t hash_combine(size_t seed, size_t hash) {
+    return seed ^ (hash + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
+
+// splitmix64 finalizer
+inline size_t hash_value(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return static_cast<size_t>(x ^ (x >> 31));
+}
+
+
+inline size_t hash_value(int64_t x) {
+    return hash_value(static_cast<uint64_t>(x));
+}
+
+
+inline size_t hash_value(bool x) {
+    return hash_value(static_cast<uint64_t>(x));
+}
+
+
+// 0.0 and -0.0 compare equal, so they hash the same
+inline size_t hash_value(double x) {
+    uint64_t bits = 0;
+    if (x != 0) {
+        memcpy(&bits, &x, sizeof(bits));
+    }
+    return hash_value(bits);
+}
+
+
+inline size_t hash_value(const ustring &us) {
+    return hash_ustring(us);
+}
+
+
+#endif //JSON_CXX_HASH_HPP
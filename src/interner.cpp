@@ -0,0 +1,93 @@
+#include <cassert>
+
+#include "interner.h"
+
+
+using std::lock_guard;
+using std::memory_order_acquire;
+using std::memory_order_release;
+
+
+static const size_t INITIAL_CAPACITY = 16;
+
+
+KeyInterner::KeyInterner(size_t shard_count, size_t max_keys, size_t max_length)
+    : shard_count(shard_count), max_keys(max_keys), max_length(max_length),
+      shards(new Shard[shard_count])
+{
+    assert(shard_count > 0 && (shard_count & (shard_count - 1)) == 0);
+    for (size_t i = 0; i < shard_count; ++i) {
+        Shard &shard = this->shards[i];
+        shard.tables.emplace_back(new Table(INITIAL_CAPACITY));
+        shard.table.store(shard.tables.back().get(), memory_order_release);
+    }
+}
+
+
+NodePair::KeyPtr KeyInterner::intern(const ustring &key, size_t hash) {
+    if (key.size() > this->max_length) {
+        return NodePair::KeyPtr(new NodeKey(key, hash));
+    }
+    // probe uses the low bits
+    Shard &shard = this->shards[(hash >> (sizeof(size_t) * 4)) & (this->shard_count - 1)];
+
+    const NodePair::KeyPtr *entry = probe(*shard.table.load(memory_order_acquire), key, hash);
+    if (entry != nullptr) {
+        return *entry;
+    }
+
+    lock_guard<mutex> guard(shard.lock);
+    Table *table = shard.table.load(memory_order_acquire);
+    entry = probe(*table, key, hash);
+    if (entry != nullptr) {
+        return *entry;  // inserted by other thread
+    }
+    if (this->count.fetch_add(1) >= this->max_keys) {
+        this->count.fetch_sub(1);   // full, other shards may be inserting too
+        return NodePair::KeyPtr(new NodeKey(key, hash));
+    }
+
+    shard.keys.emplace_back(new NodeKey(key, hash));
+    entry = &shard.keys.back();
+
+    if (shard.keys.size() * 2 > table->slots.size()) {
+        shard.tables.emplace_back(new Table(table->slots.size() * 2));
+        table = shard.tables.back().get();
+        for (const NodePair::KeyPtr &old : shard.keys) {
+            insert(*table, &old);
+        }
+        shard.table.store(table, memory_order_release);
+    } else {
+        insert(*table, entry);
+    }
+    return *entry;
+}
+
+
+size_t KeyInterner::size() const {
+    return this->count.load();
+}
+
+
+const NodePair::KeyPtr *KeyInterner::probe(const Table &table, const ustring &key, size_t hash) {
+    size_t mask = table.slots.size() - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        const NodePair::KeyPtr *entry = table.slots[i].load(memory_order_acquire);
+        if (entry == nullptr) {
+            return nullptr;
+        }
+        if ((*entry)->key_hash == hash && (*entry)->value() == key) {
+            return entry;
+        }
+    }
+}
+
+
+void KeyInterner::insert(Table &table, const NodePair::KeyPtr *entry) {
+    size_t mask = table.slots.size() - 1;
+    size_t i = (*entry)->key_hash & mask;
+    while (table.slots[i].load(memory_order_acquire) != nullptr) {
+        i = (i + 1) & mask;
+    }
+    table.slots[i].store(entry, memory_order_release);
+}
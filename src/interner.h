@@ -0,0 +1,63 @@
+#ifndef JSON_CXX_INTERNER_H
+#define JSON_CXX_INTERNER_H
+
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "node.h"
+
+
+using std::atomic;
+using std::deque;
+using std::mutex;
+using std::unique_ptr;
+using std::vector;
+
+
+// Shares identical object keys between pairs and documents, see Parser::intern_keys().
+// Looking up an existing key is lock-free, inserting a new key locks one shard.
+// Keys are never removed, so the table is capped like ShapeTable: once it holds max_keys keys,
+// and for keys longer than max_length, intern() returns a new unshared key.
+class KeyInterner {
+public:
+    // shard_count must be a power of 2
+    explicit KeyInterner(
+        size_t shard_count = 16, size_t max_keys = 1 << 16, size_t max_length = 256);
+    KeyInterner(const KeyInterner &) = delete;
+    KeyInterner &operator=(const KeyInterner &) = delete;
+
+    NodePair::KeyPtr intern(const ustring &key) {
+        return this->intern(key, hash_ustring(key));
+    }
+    NodePair::KeyPtr intern(const ustring &key, size_t hash);
+    size_t size() const;
+
+private:
+    struct Table {
+        explicit Table(size_t capacity) : slots(capacity) {}
+        vector<atomic<const NodePair::KeyPtr *>> slots;
+    };
+
+    struct Shard {
+        mutable mutex lock;
+        atomic<Table *> table;
+        vector<unique_ptr<Table>> tables;   // outgrown tables are kept for concurrent readers
+        deque<NodePair::KeyPtr> keys;
+    };
+
+    static const NodePair::KeyPtr *probe(const Table &table, const ustring &key, size_t hash);
+    static void insert(Table &table, const NodePair::KeyPtr *entry);
+
+    size_t shard_count;
+    size_t max_keys;
+    size_t max_length;
+    atomic<size_t> count{0};
+    unique_ptr<Shard[]> shards;
+};
+
+
+#endif //JSON_CXX_INTERNER_H
@@ -0,0 +1,240 @@
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "memory.h"
+
+
+using std::max;
+using std::shared_ptr;
+using std::string;
+using std::unordered_set;
+using std::vector;
+
+
+// Iterative, trees may be nested deeper than the call stack allows.
+class MemoryCounter {
+public:
+    // owned_only: skip shared buffers instead of counting them once
+    explicit MemoryCounter(bool owned_only) : owned_only(owned_only) {}
+    void run(const Node &root);
+
+    MemoryUsage usage;
+
+private:
+    bool visit(const void *buffer, bool shared);
+    void add_block(size_t &field, size_t used, size_t size);
+    template<class S>
+    void add_string(size_t &field, const S &s);
+    template<class V>
+    void add_array(size_t &field, const V &v);
+    void add_fragment(const CachedFragment &cache);
+    void add_key(const NodePair::KeyPtr &key);
+    void add_pair(const NodePair::KeyPtr &key, const Node &value);
+    void add_list(const NodeList &list);
+    void add_object(const NodeObject &obj);
+    void add_node(const Node &node);
+
+    bool owned_only;
+    unordered_set<const void *> seen;
+    vector<const Node *> stack;
+};
+
+
+// Header and rounding of a block of size bytes as by glibc malloc: chunks are multiples
+// of two words with a one word header, and four words at least.
+static size_t malloc_slack(size_t size) {
+    const size_t word = sizeof(size_t);
+    size_t chunk = (size + word + 2 * word - 1) & ~(2 * word - 1);
+    return max(chunk, 4 * word) - size;
+}
+
+
+// Whether to count a buffer.
+bool MemoryCounter::visit(const void *buffer, bool shared) {
+    if (!shared) {
+        return true;
+    }
+    return !this->owned_only && this->seen.insert(buffer).second;
+}
+
+
+// one allocation of size bytes, used of them counted in field and the rest as unused
+void MemoryCounter::add_block(size_t &field, size_t used, size_t size) {
+    if (size == 0) {
+        return;
+    }
+    field += used;
+    this->usage.unused += size - used;
+    this->usage.slack += malloc_slack(size);
+    this->usage.blocks++;
+}
+
+
+template<class S>
+void MemoryCounter::add_string(size_t &field, const S &s) {
+    const char *data = reinterpret_cast<const char *>(s.data());
+    const char *begin = reinterpret_cast<const char *>(&s);
+    if (data < begin || data >= begin + sizeof(s)) {
+        // the terminator counts as unused
+        this->add_block(field, s.size() * sizeof(s[0]), (s.capacity() + 1) * sizeof(s[0]));
+    }
+}
+
+
+template<class V>
+void MemoryCounter::add_array(size_t &field, const V &v) {
+    this->add_block(field, v.size() * sizeof(v[0]), v.capacity() * sizeof(v[0]));
+}
+
+
+void MemoryCounter::add_fragment(const CachedFragment &cache) {
+    shared_ptr<const string> fragment = cache.peek();
+    if (fragment) {
+        size_t size = CachedFragment::block_size();
+        this->add_block(this->usage.caches, size, size);
+        this->add_string(this->usage.caches, *fragment);
+    }
+}
+
+
+// the key and the control block of its shared pointer
+void MemoryCounter::add_key(const NodePair::KeyPtr &key) {
+    if (this->visit(key.get(), key.use_count() > 1)) {
+        this->add_block(this->usage.nodes, sizeof(NodeKey), sizeof(NodeKey));
+        size_t control = control_block_size<NodeKey>();
+        this->add_block(this->usage.nodes, control, control);
+        this->add_string(this->usage.strings, key->value());
+    }
+}
+
+
+// a NodePair, of a plain object or standalone
+void MemoryCounter::add_pair(const NodePair::KeyPtr &key, const Node &value) {
+    this->add_block(this->usage.nodes, sizeof(NodePair), sizeof(NodePair));
+    this->add_key(key);
+    this->stack.push_back(&value);
+}
+
+
+// the body with its child array and caches, pushes the children
+void MemoryCounter::add_list(const NodeList &list) {
+    const ListCache *body = list.value.cache();
+    if (body == nullptr || !this->visit(body, list.value.shared())) {
+        return;
+    }
+    size_t size = decltype(list.value)::body_size();
+    this->add_block(this->usage.nodes, size, size);
+    this->add_array(this->usage.arrays, list.value);
+    this->add_fragment(body->fragment);
+    for (const Node::Ptr &child : list.value) {
+        this->stack.push_back(child.get());
+    }
+}
+
+
+// like add_list(), the pairs of a plain object are counted here
+void MemoryCounter::add_object(const NodeObject &obj) {
+    const PairVector &pairs = obj.pairs;
+    if (pairs.hash_cache() == nullptr || !this->visit(pairs.hash_cache(), pairs.shared())) {
+        return;
+    }
+    size_t size = PairVector::body_size();
+    this->add_block(this->usage.nodes, size, size);
+    // the same size for values of a shaped object
+    this->add_block(this->usage.arrays, pairs.size() * sizeof(NodePair::Ptr),
+        pairs.capacity() * sizeof(NodePair::Ptr));
+    if (const ObjectIndex *index = pairs.built_index()) {
+        this->add_block(this->usage.caches, sizeof(ObjectIndex), sizeof(ObjectIndex));
+        this->add_array(this->usage.caches, index->slots);
+    }
+    if (const vector<size_t> *order = pairs.built_order()) {
+        this->add_block(this->usage.caches, sizeof(vector<size_t>), sizeof(vector<size_t>));
+        this->add_array(this->usage.caches, *order);
+    }
+    this->add_fragment(*pairs.fragment_cache());
+    if (pairs.get_shape()) {
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            this->stack.push_back(pairs.value(i).get());
+        }
+    } else {
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            this->add_pair(pairs.key(i), *pairs.value(i));
+        }
+    }
+}
+
+
+// node itself and its own buffers, pushes its children
+void MemoryCounter::add_node(const Node &node) {
+    size_t &nodes = this->usage.nodes;
+    switch (node.type) {
+    case NodeType::NIL:
+        this->add_block(nodes, sizeof(NodeNull), sizeof(NodeNull));
+        break;
+    case NodeType::BOOL:
+        this->add_block(nodes, sizeof(NodeBool), sizeof(NodeBool));
+        break;
+    case NodeType::INT:
+        this->add_block(nodes, sizeof(NodeInt), sizeof(NodeInt));
+        break;
+    case NodeType::FLOAT:
+        this->add_block(nodes, sizeof(NodeFloat), sizeof(NodeFloat));
+        break;
+    case NodeType::STRING:
+        this->add_block(nodes, sizeof(NodeString), sizeof(NodeString));
+        this->add_string(this->usage.strings, static_cast<const NodeString &>(node).value());
+        break;
+    case NodeType::NUMBER:
+        this->add_block(nodes, sizeof(NodeNumber), sizeof(NodeNumber));
+        this->add_string(this->usage.strings, static_cast<const NodeNumber &>(node).lexeme);
+        break;
+    case NodeType::INT_ARRAY:
+        this->add_block(nodes, sizeof(NodeIntArray), sizeof(NodeIntArray));
+        this->add_array(this->usage.arrays, static_cast<const NodeIntArray &>(node).value);
+        break;
+    case NodeType::FLOAT_ARRAY:
+        this->add_block(nodes, sizeof(NodeFloatArray), sizeof(NodeFloatArray));
+        this->add_array(this->usage.arrays, static_cast<const NodeFloatArray &>(node).value);
+        break;
+    case NodeType::PAIR: {
+        const NodePair &pair = static_cast<const NodePair &>(node);
+        this->add_pair(pair.key, *pair.value);
+        break;
+    }
+    case NodeType::LIST:
+        this->add_block(nodes, sizeof(NodeList), sizeof(NodeList));
+        this->add_list(static_cast<const NodeList &>(node));
+        break;
+    case NodeType::OBJECT:
+        this->add_block(nodes, sizeof(NodeObject), sizeof(NodeObject));
+        this->add_object(static_cast<const NodeObject &>(node));
+        break;
+    }
+}
+
+
+void MemoryCounter::run(const Node &root) {
+    this->stack.push_back(&root);
+    while (!this->stack.empty()) {
+        const Node &node = *this->stack.back();
+        this->stack.pop_back();
+        this->add_node(node);
+    }
+}
+
+
+MemoryUsage memory_usage(const Node &root) {
+    MemoryCounter counter(false);
+    counter.run(root);
+    return counter.usage;
+}
+
+
+size_t tree_bytes(const Node &root) {
+    MemoryCounter counter(true);
+    counter.run(root);
+    return counter.usage.total();
+}
@@ -0,0 +1,38 @@
+#ifndef JSON_CXX_MEMORY_H
+#define JSON_CXX_MEMORY_H
+
+
+#include <cstddef>
+
+#include "node.h"
+
+
+// Heap bytes of a tree. Children and keys shared by several nodes are counted once,
+// object shapes are not counted.
+struct MemoryUsage {
+    size_t nodes = 0;       // node objects, pairs, keys and container bodies
+    size_t arrays = 0;      // used part of child arrays and packed number arrays
+    size_t strings = 0;     // used part of string buffers not stored inline
+    size_t caches = 0;      // key indexes, key orders and fragments built so far
+    size_t unused = 0;      // reserved but unused capacity of arrays and strings
+    size_t slack = 0;       // allocator headers and rounding, estimated as by glibc malloc
+    size_t blocks = 0;      // allocations, control blocks of shared pointers included
+
+    // the bytes requested from operator new, without the slack
+    size_t requested() const {
+        return this->nodes + this->arrays + this->strings + this->caches + this->unused;
+    }
+
+    size_t total() const {
+        return this->requested() + this->slack;
+    }
+};
+
+
+MemoryUsage memory_usage(const Node &root);
+// Estimated heap bytes freed with root, root included.
+// Children and keys shared with other trees are not counted.
+size_t tree_bytes(const Node &root);
+
+
+#endif //JSON_CXX_MEMORY_H
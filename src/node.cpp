@@ -1,10 +1,23 @@
-#include <sstream>
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <stdexcept>
 
 #include "node.h"
 #include "formatter.h"
+#include "hash.hpp"
+#include "number.h"
 
 
-using std::ostringstream;
+using std::isinf;
+using std::memory_order_acq_rel;
+using std::numeric_limits;
+using std::out_of_range;
+using std::pair;
+using std::stable_sort;
 
 
 bool Node::operator!=(const Node &other) const {
@@ -13,9 +26,22 @@ bool Node::operator!=(const Node &other) const {
 
 
 string Node::repr() const {
-    ostringstream os;
-    Formatter().format(os, *this);
-    return os.str();
+    StringSink out;
+    Formatter().format(out, *this);
+    return out.take();
+}
+
+
+// Without early exit, so the loop is vectorized.
+void NodeString::update_flags() {
+    unichar bits = 0;
+    bool escape_free = true;
+    for (unichar ch : this->chars) {
+        bits |= ch;
+        escape_free &= ch >= 0x20 && ch != '"' && ch != '\\';
+    }
+    this->ascii = bits < 0x80;
+    this->escape_free = escape_free;
 }
 
 
@@ -24,21 +50,287 @@ bool NodeNull::operator==(const Node &other) const {
 }
 
 
+size_t NodeNull::hash() const {
+    return hash_combine(static_cast<size_t>(NodeType::NIL), 0);
+}
+
+
 NodeNull *NodeNull::clone() const {
     return new NodeNull();
 }
 
 
-bool NodeList::operator==(const Node &other) const {
-    const NodeList *node = dynamic_cast<const NodeList *>(&other);
-    if (node == nullptr) {
-        return false;
+// value = (negative ? -1 : 1) * digits * 10^exp, digits has no leading or trailing zeros.
+// digits is empty for zero.
+struct Decimal {
+    bool negative = false;
+    string digits;
+    int64_t exp = 0;
+    // the written exponent has more than 18 digits, exp is not set and the value
+    // equals to no other Decimal
+    bool overflow = false;
+
+    explicit Decimal(const string &lexeme);
+    bool operator==(const Decimal &other) const {
+        return !this->overflow && !other.overflow && this->negative == other.negative
+            && this->digits == other.digits && this->exp == other.exp;
+    }
+};
+
+
+// lexeme is already validated by Scanner
+Decimal::Decimal(const string &lexeme) {
+    size_t i = 0;
+    if (lexeme[i] == '-') {
+        this->negative = true;
+        i++;
+    }
+
+    bool dotted = false;
+    for (; i < lexeme.size() && lexeme[i] != 'e' && lexeme[i] != 'E'; ++i) {
+        if (lexeme[i] == '.') {
+            dotted = true;
+        } else {
+            if (!(this->digits.empty() && lexeme[i] == '0')) {
+                this->digits.push_back(lexeme[i]);
+            }
+            if (dotted) {
+                this->exp--;
+            }
+        }
+    }
+
+    if (i < lexeme.size()) {
+        i++;    // e
+        int64_t sign = 1;
+        if (lexeme[i] == '+' || lexeme[i] == '-') {
+            sign = lexeme[i] == '-' ? -1 : 1;
+            i++;
+        }
+        while (i + 1 < lexeme.size() && lexeme[i] == '0') {
+            i++;
+        }
+        // up to 18 digits fit in int64_t with the adjustments below
+        this->overflow = lexeme.size() - i > 18;
+        int64_t exp = 0;
+        for (; i < lexeme.size() && !this->overflow; ++i) {
+            exp = exp * 10 + (lexeme[i] - '0');
+        }
+        this->exp += sign * exp;
+    }
+
+    while (!this->digits.empty() && this->digits.back() == '0') {
+        this->digits.pop_back();
+        this->exp++;
     }
-    if (this->value.size() != node->value.size()) {
+    if (this->digits.empty()) {
+        this->negative = false;
+        this->exp = 0;
+        this->overflow = false;
+    }
+}
+
+
+bool NodeNumber::operator==(const Node &other) const {
+    if (other.type != NodeType::NUMBER) {
         return false;
     }
-    for (size_t i = 0; i < this->value.size(); ++i) {
-        if (*this->value[i] != *node->value[i]) {
+    const NodeNumber &node = static_cast<const NodeNumber &>(other);
+    return this->lexeme == node.lexeme || Decimal(this->lexeme) == Decimal(node.lexeme);
+}
+
+
+// Overflowed numbers equal to the same lexeme only.
+size_t NodeNumber::hash() const {
+    Decimal dec(this->lexeme);
+    size_t ans = static_cast<size_t>(NodeType::NUMBER);
+    if (dec.overflow) {
+        return hash_combine(ans, std::hash<string>()(this->lexeme));
+    }
+    ans = hash_combine(ans, std::hash<string>()(dec.digits));
+    ans = hash_combine(ans, hash_value(dec.exp));
+    return hash_combine(ans, hash_value(dec.negative));
+}
+
+
+NodeNumber *NodeNumber::clone() const {
+    return new NodeNumber(this->lexeme);
+}
+
+
+// Magnitude as uint64_t, throws if it is not an integer or too large.
+static uint64_t decimal_to_uint64(const Decimal &dec, const string &lexeme) {
+    if (dec.overflow || dec.exp < 0 || static_cast<int64_t>(dec.digits.size()) + dec.exp > 20) {
+        throw out_of_range("not an integer in range: " + lexeme);
+    }
+    uint64_t ans = 0;
+    for (size_t i = 0; i < dec.digits.size() + static_cast<size_t>(dec.exp); ++i) {
+        uint64_t digit = i < dec.digits.size() ? static_cast<uint64_t>(dec.digits[i] - '0') : 0;
+        if (ans > (numeric_limits<uint64_t>::max() - digit) / 10) {
+            throw out_of_range("not an integer in range: " + lexeme);
+        }
+        ans = ans * 10 + digit;
+    }
+    return ans;
+}
+
+
+int64_t NodeNumber::as_int64() const {
+    Decimal dec(this->lexeme);
+    uint64_t magnitude = decimal_to_uint64(dec, this->lexeme);
+    uint64_t limit = static_cast<uint64_t>(numeric_limits<int64_t>::max()) + (dec.negative ? 1 : 0);
+    if (magnitude > limit) {
+        throw out_of_range("not an integer in range: " + this->lexeme);
+    }
+    if (dec.negative) {
+        return static_cast<int64_t>(0 - magnitude);
+    }
+    return static_cast<int64_t>(magnitude);
+}
+
+
+uint64_t NodeNumber::as_uint64() const {
+    Decimal dec(this->lexeme);
+    if (dec.negative) {
+        throw out_of_range("not an integer in range: " + this->lexeme);
+    }
+    return decimal_to_uint64(dec, this->lexeme);
+}
+
+
+double NodeNumber::as_double() const {
+    errno = 0;
+    double ans = c_strtod(this->lexeme.data());  // correctly rounded
+    if (errno == ERANGE && isinf(ans)) {
+        throw out_of_range("float overflow: " + this->lexeme);
+    }
+    return ans;     // underflow gives 0 or subnormal
+}
+
+
+string NodeNumber::decimal() const {
+    Decimal dec(this->lexeme);
+    if (dec.digits.empty()) {
+        return "0";
+    }
+    if (dec.overflow || dec.exp > 4096 || dec.exp < -4096) {
+        throw out_of_range("exponent too large: " + this->lexeme);
+    }
+
+    string ans = dec.negative ? "-" : "";
+    int64_t int_len = static_cast<int64_t>(dec.digits.size()) + dec.exp;
+    if (dec.exp >= 0) {
+        ans += dec.digits + string(static_cast<size_t>(dec.exp), '0');
+    } else if (int_len > 0) {
+        ans += dec.digits.substr(0, static_cast<size_t>(int_len)) + "."
+            + dec.digits.substr(static_cast<size_t>(int_len));
+    } else {
+        ans += "0." + string(static_cast<size_t>(-int_len), '0') + dec.digits;
+    }
+    return ans;
+}
+
+
+static bool is_container(const Node &node) {
+    return node.type == NodeType::LIST || node.type == NodeType::OBJECT;
+}
+
+
+// Only for frozen containers, the descendants of others may be modified without notice.
+static const CachedHash *hash_cache_of(const Node &container) {
+    if (container.type == NodeType::LIST) {
+        const NodeVector<Node::Ptr, ListCache> &value =
+            static_cast<const NodeList &>(container).value;
+        return value.frozen() ? &value.cache()->hash : nullptr;
+    }
+    const PairVector &pairs = static_cast<const NodeObject &>(container).pairs;
+    return pairs.frozen() ? pairs.hash_cache() : nullptr;
+}
+
+
+static bool cached_hash(const Node &container, size_t &hash) {
+    const CachedHash *cache = hash_cache_of(container);
+    return cache != nullptr && cache->get(hash);
+}
+
+
+static size_t mix_child_hash(const Node &container, size_t seed, size_t i, size_t child_hash) {
+    if (container.type == NodeType::OBJECT) {
+        seed = hash_combine(seed, static_cast<const NodeObject &>(container).pairs.key(i)->hash());
+    }
+    return hash_combine(seed, child_hash);
+}
+
+
+// Iterative post-order, caches the hash of every frozen container on the way.
+static size_t container_hash(const Node &root) {
+    struct Frame {
+        const Node *node;
+        size_t next;
+        size_t hash;
+    };
+
+    size_t ans = 0;
+    if (cached_hash(root, ans)) {
+        return ans;
+    }
+    vector<Frame> stack = {Frame{&root, 0, static_cast<size_t>(root.type)}};
+    while (true) {
+        Frame &frame = stack.back();
+        if (frame.next < child_count(*frame.node)) {
+            const Node &child = child_at(*frame.node, frame.next);
+            size_t child_hash = 0;
+            if (!is_container(child)) {
+                child_hash = child.hash();
+            } else if (!cached_hash(child, child_hash)) {
+                stack.push_back(Frame{&child, 0, static_cast<size_t>(child.type)});
+                continue;
+            }
+            frame.hash = mix_child_hash(*frame.node, frame.hash, frame.next, child_hash);
+            frame.next++;
+        } else {
+            ans = frame.hash;
+            const CachedHash *cache = hash_cache_of(*frame.node);
+            if (cache != nullptr) {
+                cache->set(ans);
+            }
+            stack.pop_back();
+            if (stack.empty()) {
+                return ans;
+            }
+            Frame &parent = stack.back();
+            parent.hash = mix_child_hash(*parent.node, parent.hash, parent.next, ans);
+            parent.next++;
+        }
+    }
+}
+
+
+static bool shares_children(const Node &lhs, const Node &rhs) {
+    if (lhs.type == NodeType::LIST) {
+        return static_cast<const NodeList &>(lhs).value.shares(
+            static_cast<const NodeList &>(rhs).value);
+    }
+    return static_cast<const NodeObject &>(lhs).pairs.shares(
+        static_cast<const NodeObject &>(rhs).pairs);
+}
+
+
+// Both hashes are cached, so both containers are frozen, and differ.
+static bool cached_hash_differs(const Node &lhs, const Node &rhs) {
+    size_t lhs_hash = 0;
+    size_t rhs_hash = 0;
+    return cached_hash(lhs, lhs_hash) && cached_hash(rhs, rhs_hash) && lhs_hash != rhs_hash;
+}
+
+
+static bool same_keys(const PairVector &lhs, const PairVector &rhs) {
+    for (size_t i = 0; i < lhs.size(); ++i) {
+        const NodePair::KeyPtr &key = lhs.key(i);
+        const NodePair::KeyPtr &other_key = rhs.key(i);
+        if (key != other_key
+            && (key->key_hash != other_key->key_hash || key->value() != other_key->value()))
+        {
             return false;
         }
     }
@@ -46,53 +338,488 @@ bool NodeList::operator==(const Node &other) const {
 }
 
 
-NodeList *NodeList::clone() const {
-    NodeList *list = new NodeList();
-    for (const Node::Ptr &child : this->value) {
-        list->value.emplace_back(child->clone());
+// Iterative, lhs and rhs are containers of the same type.
+static bool container_equal(const Node &lhs, const Node &rhs) {
+    vector<pair<const Node *, const Node *>> stack = {{&lhs, &rhs}};
+    while (!stack.empty()) {
+        const Node &a = *stack.back().first;
+        const Node &b = *stack.back().second;
+        stack.pop_back();
+        if (a.type != b.type || !is_container(a)) {
+            if (a != b) {   // does not recurse for these
+                return false;
+            }
+            continue;
+        }
+
+        if (shares_children(a, b)) {
+            continue;
+        }
+        size_t size = child_count(a);
+        if (size != child_count(b) || cached_hash_differs(a, b)) {
+            return false;
+        }
+        if (a.type == NodeType::OBJECT && !same_keys(
+            static_cast<const NodeObject &>(a).pairs, static_cast<const NodeObject &>(b).pairs))
+        {
+            return false;
+        }
+        for (size_t i = size; i-- > 0; ) {
+            stack.emplace_back(&child_at(a, i), &child_at(b, i));
+        }
+    }
+    return true;
+}
+
+
+bool NodeList::operator==(const Node &other) const {
+    if (other.type == NodeType::INT_ARRAY || other.type == NodeType::FLOAT_ARRAY) {
+        return other == *this;
     }
-    return list;
+    return other.type == NodeType::LIST && container_equal(*this, other);
+}
+
+
+size_t NodeList::hash() const {
+    return container_hash(*this);
+}
+
+
+// Containers share their children, which are copied on write, other nodes are cloned.
+// Only for originals the mutable API can not reach, e.g. frozen trees, see replace_path().
+Node *share_node(const Node &node) {
+    if (node.type == NodeType::LIST) {
+        NodeList *list = new NodeList();
+        list->value.share(static_cast<const NodeList &>(node).value);
+        return list;
+    } else if (node.type == NodeType::OBJECT) {
+        NodeObject *obj = new NodeObject();
+        obj->pairs.share(static_cast<const NodeObject &>(node).pairs);
+        return obj;
+    }
+    return node.clone();
+}
+
+
+// Iterative, containers are created empty and filled in from the stack.
+static Node *deep_clone(const Node &root) {
+    vector<pair<const Node *, Node *>> stack;
+    auto copy = [&stack](const Node &node) -> Node * {
+        Node *ans = nullptr;
+        if (node.type == NodeType::LIST) {
+            ans = new NodeList();
+        } else if (node.type == NodeType::OBJECT) {
+            ans = new NodeObject();
+        } else {
+            return node.clone();
+        }
+        stack.emplace_back(&node, ans);
+        return ans;
+    };
+
+    Node::Ptr ans(copy(root));
+    while (!stack.empty()) {
+        const Node &from = *stack.back().first;
+        Node &to = *stack.back().second;
+        stack.pop_back();
+        if (from.type == NodeType::LIST) {
+            NodeVector<Node::Ptr, ListCache> &children = static_cast<NodeList &>(to).value;
+            children.reserve(child_count(from));
+            for (const Node::Ptr &child : static_cast<const NodeList &>(from).value) {
+                children.emplace_back(copy(*child));
+            }
+            continue;
+        }
+
+        const PairVector &pairs = static_cast<const NodeObject &>(from).pairs;
+        PairVector &copied = static_cast<NodeObject &>(to).pairs;
+        if (pairs.get_shape()) {
+            vector<Node::Ptr> values;
+            values.reserve(pairs.size());
+            for (size_t i = 0; i < pairs.size(); ++i) {
+                values.emplace_back(copy(*pairs.value(i)));
+            }
+            copied.set_shape(pairs.get_shape(), move(values));
+        } else {
+            copied.reserve(pairs.size());
+            for (size_t i = 0; i < pairs.size(); ++i) {
+                copied.emplace_back(new NodePair(pairs.key(i), Node::Ptr(copy(*pairs.value(i)))));
+            }
+        }
+    }
+    return ans.release();
+}
+
+
+NodeList *NodeList::clone() const {
+    return static_cast<NodeList *>(deep_clone(*this));
 }
 
 
 bool NodePair::operator==(const Node &other) const {
-    const NodePair *node = dynamic_cast<const NodePair *>(&other);
-    if (node == nullptr) {
+    if (other.type != NodeType::PAIR) {
         return false;
     }
-    return *this->key == *node->key && *this->value == *node->value;
+    const NodePair &node = static_cast<const NodePair &>(other);
+    return (this->key == node.key || *this->key == *node.key) && *this->value == *node.value;
+}
+
+
+size_t NodePair::hash() const {
+    return hash_combine(this->key->hash(), this->value->hash());
 }
 
 
 NodePair *NodePair::clone() const {
-    return new NodePair(
-        NodeString::Ptr(this->key->clone()),
-        Node::Ptr(this->value->clone())
-    );
+    return new NodePair(this->key, Node::Ptr(this->value->clone()));  // keys are immutable
 }
 
 
 bool NodeObject::operator==(const Node &other) const {
-    const NodeObject *node = dynamic_cast<const NodeObject *>(&other);
+    return other.type == NodeType::OBJECT && container_equal(*this, other);
+}
+
+
+size_t NodeObject::hash() const {
+    return container_hash(*this);
+}
+
+
+NodeObject *NodeObject::clone() const {
+    return static_cast<NodeObject *>(deep_clone(*this));
+}
+
+
+// Non-const value access keeps the index but invalidates the hash.
+Node *NodeObject::find(const ustring &key) {
+    size_t pos = this->find_pos(key, hash_ustring(key), nullptr);
+    return pos < this->pairs.size() ? this->pairs.value(pos).get() : nullptr;
+}
+
+
+const Node *NodeObject::find(const ustring &key) const {
+    size_t pos = this->find_pos(key, hash_ustring(key), nullptr);
+    return pos < this->pairs.size() ? this->pairs.value(pos).get() : nullptr;
+}
+
+
+Node *NodeObject::find(const NodeKey &key) {
+    size_t pos = this->find_pos(key.value(), key.key_hash, &key);
+    return pos < this->pairs.size() ? this->pairs.value(pos).get() : nullptr;
+}
+
+
+const Node *NodeObject::find(const NodeKey &key) const {
+    size_t pos = this->find_pos(key.value(), key.key_hash, &key);
+    return pos < this->pairs.size() ? this->pairs.value(pos).get() : nullptr;
+}
+
+
+Node &NodeObject::operator[](const ustring &key) {
+    Node *node = this->find(key);
     if (node == nullptr) {
-        return false;
+        node = new NodeNull();
+        NodePair::KeyPtr node_key(new NodeKey(key));
+        this->pairs.emplace_back(new NodePair(move(node_key), Node::Ptr(node)));
     }
-    if (this->pairs.size() != node->pairs.size()) {
-        return false;
+    return *node;
+}
+
+
+const Node &NodeObject::operator[](const ustring &key) const {
+    const Node *node = this->find(key);
+    if (node == nullptr) {
+        throw out_of_range("key not found: " + u8_encode(key));
     }
-    for (size_t i = 0; i < this->pairs.size(); ++i) {
-        if (*this->pairs[i] != *node->pairs[i]) {
-            return false;
+    return *node;
+}
+
+
+size_t NodeObject::index_of(const ustring &key) const {
+    return this->find_pos(key, hash_ustring(key), nullptr);
+}
+
+
+// Returns pairs.size() if not found.
+size_t NodeObject::find_pos(const ustring &key, size_t hash, const NodeKey *interned) const {
+    const PairVector &pairs = this->pairs;
+    size_t size = pairs.size();
+    const ObjectShape *shape = pairs.get_shape().get();
+    if (shape != nullptr) {
+        return shape->index.find(
+            size, [shape](size_t i) -> const NodeKey & { return *shape->keys[i]; },
+            key, hash, interned
+        );
+    }
+
+    auto key_at = [&pairs](size_t i) -> const NodeKey & { return *pairs.key(i); };
+    if (size < NodeObject::INDEX_THRESHOLD || !pairs.frozen()) {
+        return ObjectIndex().find(size, key_at, key, hash, interned);
+    }
+    return pairs.index().find(size, key_at, key, hash, interned);
+}
+
+
+static bool key_equal(
+    const NodeKey &key, const ustring &value, size_t hash, const NodeKey *interned)
+{
+    return &key == interned || (key.key_hash == hash && key.value() == value);
+}
+
+
+template<class KeyAt>
+void ObjectIndex::build(size_t size, KeyAt key_at) {
+    size_t capacity = 1;
+    while (capacity < size * 2) {
+        capacity <<= 1;
+    }
+    this->slots.assign(capacity, Slot{0, 0});
+
+    size_t mask = capacity - 1;
+    for (size_t pos = 0; pos < size; ++pos) {
+        const NodeKey &key = key_at(pos);
+        size_t i = key.key_hash & mask;
+        for (; this->slots[i].pos != 0; i = (i + 1) & mask) {
+            if (this->slots[i].hash == key.key_hash
+                && key_equal(key_at(this->slots[i].pos - 1), key.value(), key.key_hash, &key))
+            {
+                break;  // duplicated key
+            }
+        }
+        if (this->slots[i].pos == 0) {
+            this->slots[i] = Slot{key.key_hash, pos + 1};
         }
     }
-    return true;
 }
 
 
-NodeObject *NodeObject::clone() const {
-    NodeObject *obj = new NodeObject();
-    for (const NodePair::Ptr &pair : this->pairs) {
-        obj->pairs.emplace_back(pair->clone());
+// Linear search if the index is not built.
+template<class KeyAt>
+size_t ObjectIndex::find(
+    size_t size, KeyAt key_at, const ustring &key, size_t hash, const NodeKey *interned) const
+{
+    if (this->slots.empty()) {
+        for (size_t i = 0; i < size; ++i) {
+            if (key_equal(key_at(i), key, hash, interned)) {
+                return i;
+            }
+        }
+        return size;
+    }
+
+    size_t mask = this->slots.size() - 1;
+    for (size_t i = hash & mask; this->slots[i].pos != 0; i = (i + 1) & mask) {
+        if (this->slots[i].hash == hash
+            && key_equal(key_at(this->slots[i].pos - 1), key, hash, interned))
+        {
+            return this->slots[i].pos - 1;
+        }
+    }
+    return size;
+}
+
+
+// Stable, so duplicated keys keep their order.
+template<class KeyAt>
+static vector<size_t> sort_keys(size_t size, KeyAt key_at) {
+    vector<size_t> order(size);
+    for (size_t i = 0; i < size; ++i) {
+        order[i] = i;
     }
-    return obj;
+    stable_sort(order.begin(), order.end(), [&key_at](size_t a, size_t b) {
+        return u16_less(key_at(a).value(), key_at(b).value());
+    });
+    return order;
+}
+
+
+ObjectShape::ObjectShape(vector<NodePair::KeyPtr> &&keys) : keys(move(keys)) {
+    const vector<NodePair::KeyPtr> &self_keys = this->keys;
+    auto key_at = [&self_keys](size_t i) -> const NodeKey & { return *self_keys[i]; };
+    this->index.build(self_keys.size(), key_at);
+    this->key_order = sort_keys(self_keys.size(), key_at);
+}
+
+
+// Nodes whose bodies are being destroyed by release_nodes() on this thread.
+static thread_local vector<Node::Ptr> *pending_nodes = nullptr;
+
+
+// Destroying a body destroys its children, which destroy their bodies and so on.
+// The outermost call destroys the nodes from a stack instead, and nested calls,
+// from the destructors of the bodies, push their nodes on that stack.
+void release_nodes(vector<Node::Ptr> &nodes) {
+    // others are destroyed with nodes
+    vector<Node::Ptr> stack;
+    vector<Node::Ptr> &out = pending_nodes != nullptr ? *pending_nodes : stack;
+    for (Node::Ptr &node : nodes) {
+        if (node && (is_container(*node) || node->type == NodeType::PAIR)) {
+            out.push_back(move(node));
+        }
+    }
+    if (pending_nodes != nullptr) {
+        return;
+    }
+
+    pending_nodes = &stack;
+    while (!stack.empty()) {
+        Node::Ptr node = move(stack.back());
+        stack.pop_back();
+        node.reset();
+    }
+    pending_nodes = nullptr;
+}
+
+
+static void release_pairs(vector<NodePair::Ptr> &pairs) {
+    vector<Node::Ptr> values;
+    values.reserve(pairs.size());
+    for (NodePair::Ptr &pair : pairs) {
+        if (pair && pair->value) {
+            values.push_back(move(pair->value));
+        }
+    }
+    release_nodes(values);
+}
+
+
+void PairVector::set_shape(const ShapePtr &shape, vector<Node::Ptr> &&values) {
+    assert(shape->keys.size() == values.size());
+    if (!this->body || this->shared()) {
+        this->body = make_shared<Body>();
+    }
+    this->_version++;
+    this->_key_version++;
+    this->body->reset();
+    this->body->items = vector<NodePair::Ptr>();
+    this->body->shape = shape;
+    this->body->values = move(values);
+}
+
+
+const ObjectIndex &PairVector::index() const {
+    assert(this->frozen());
+    const ObjectIndex *index = this->body->index.load(memory_order_acquire);
+    if (index != nullptr) {
+        return *index;
+    }
+
+    const vector<NodePair::Ptr> &items = this->body->items;
+    ObjectIndex *built = new ObjectIndex();
+    built->build(items.size(), [&items](size_t i) -> const NodeKey & { return *items[i]->key; });
+    if (!this->body->index.compare_exchange_strong(index, built, memory_order_acq_rel)) {
+        delete built;   // built by another reader
+        return *index;
+    }
+    return *built;
+}
+
+
+const vector<size_t> &PairVector::key_order(vector<size_t> &buffer) const {
+    static const vector<size_t> empty;
+    if (!this->body) {
+        return empty;
+    }
+    if (this->body->shape) {
+        return this->body->shape->key_order;
+    }
+    const vector<NodePair::Ptr> &items = this->body->items;
+    auto key_at = [&items](size_t i) -> const NodeKey & { return *items[i]->key; };
+    if (!this->frozen()) {
+        buffer = sort_keys(items.size(), key_at);
+        return buffer;
+    }
+    const vector<size_t> *order = this->body->order.load(memory_order_acquire);
+    if (order != nullptr) {
+        return *order;
+    }
+
+    vector<size_t> *built = new vector<size_t>(sort_keys(items.size(), key_at));
+    if (!this->body->order.compare_exchange_strong(order, built, memory_order_acq_rel)) {
+        delete built;   // built by another reader
+        return *order;
+    }
+    return *built;
+}
+
+
+size_t PairVector::body_size() {
+    return shared_block_size<Body>();
+}
+
+
+const ObjectIndex *PairVector::built_index() const {
+    return this->body ? this->body->index.load(memory_order_acquire) : nullptr;
+}
+
+
+const vector<size_t> *PairVector::built_order() const {
+    return this->body ? this->body->order.load(memory_order_acquire) : nullptr;
+}
+
+
+vector<NodePair::Ptr> &PairVector::mut() {
+    this->detach();
+    this->materialize();
+    this->_version++;
+    this->_key_version++;
+    this->body->reset();
+    return this->body->items;
+}
+
+
+void PairVector::detach() {
+    if (!this->body) {
+        this->body = make_shared<Body>();
+    } else if (this->shared()) {
+        shared_ptr<Body> copy = make_shared<Body>();
+        copy->shape = this->body->shape;
+        copy->items.reserve(this->body->items.size());
+        for (const NodePair::Ptr &pair : this->body->items) {
+            copy->items.emplace_back(new NodePair(pair->key, Node::Ptr(share_node(*pair->value))));
+        }
+        copy->values.reserve(this->body->values.size());
+        for (const Node::Ptr &value : this->body->values) {
+            copy->values.emplace_back(share_node(*value));
+        }
+        this->body = move(copy);
+    }
+}
+
+
+// The body must not be shared.
+void PairVector::materialize() {
+    if (!this->body->shape) {
+        return;
+    }
+    this->body->reset();
+    this->body->items.clear();
+    this->body->items.reserve(this->body->values.size());
+    for (size_t i = 0; i < this->body->values.size(); ++i) {
+        this->body->items.emplace_back(
+            new NodePair(this->body->shape->keys[i], move(this->body->values[i]))
+        );
+    }
+    this->body->values = vector<Node::Ptr>();
+    this->body->shape.reset();
+}
+
+
+PairVector::Body::~Body() {
+    release_pairs(this->items);
+    release_nodes(this->values);
+    delete this->index.load(memory_order_relaxed);
+    delete this->order.load(memory_order_relaxed);
+}
+
+
+// The body is no longer frozen, so everything derived from the pairs goes: keys too
+// may change through pairs handed out before, see index().
+void PairVector::Body::reset() {
+    this->frozen.store(false, memory_order_relaxed);
+    delete this->index.exchange(nullptr, memory_order_relaxed);
+    delete this->order.exchange(nullptr, memory_order_relaxed);
+    this->hash.reset();
+    this->size.reset();
+    this->fragment.reset();
 }
@@ -6,12 +6,15 @@
 #include <string>
 #include <vector>
 
+#include "hash.hpp"
+#include "node_ptr.hpp"
+#include "node_vector.hpp"
 #include "unicode.h"
 #include "utils.hpp"
 
 
+using std::shared_ptr;
 using std::string;
-using std::unique_ptr;
 using std::vector;
 
 
@@ -24,17 +27,24 @@ enum class NodeType {
     LIST,
     PAIR,
     OBJECT,
+    INT_ARRAY,
+    FLOAT_ARRAY,
+    NUMBER,
 };
 
 
 struct Node {
-    typedef unique_ptr<Node> Ptr;
+    typedef NodePtr<Node> Ptr;
 
     explicit Node(NodeType type) : type(type) {}
     virtual ~Node() {}
+    // Deep copy, only the immutable keys are shared.
     virtual Node *clone() const = 0;
     virtual bool operator==(const Node &other) const = 0;
     virtual bool operator!=(const Node &other) const;
+    // Structural hash, consistent with operator==. Cached by containers,
+    // the cache is invalidated by non-const access to their children.
+    virtual size_t hash() const = 0;
     string repr() const;
 
     NodeType type;
@@ -49,13 +59,18 @@ REPR(Node) {
 template<class ValueType, NodeType node_type>
 struct SimpleNode : Node {
     typedef  SimpleNode<ValueType, node_type> _SelfType;
-    typedef unique_ptr<_SelfType> Ptr;
+    typedef NodePtr<_SelfType> Ptr;
+    static const NodeType TYPE = node_type;
 
     explicit SimpleNode(ValueType value) : Node(node_type), value(value) {}
 
     virtual bool operator==(const Node &other) const {
-        const _SelfType *node = dynamic_cast<const _SelfType *>(&other);
-        return node != nullptr && this->value == node->value;
+        return other.type == node_type
+            && this->value == static_cast<const _SelfType &>(other).value;
+    }
+
+    virtual size_t hash() const {
+        return hash_combine(static_cast<size_t>(node_type), hash_value(this->value));
     }
 
     virtual _SelfType *clone() const {
@@ -66,6 +81,60 @@ struct SimpleNode : Node {
 };
 
 
+// Strings also record how the Formatter has to write them,
+// so the value is only changed through assign(), which updates the flags.
+template<>
+struct SimpleNode<ustring, NodeType::STRING> : Node {
+    typedef SimpleNode<ustring, NodeType::STRING> _SelfType;
+    typedef NodePtr<_SelfType> Ptr;
+    static const NodeType TYPE = NodeType::STRING;
+
+    explicit SimpleNode(ustring value) : Node(NodeType::STRING), chars(move(value)) {
+        this->update_flags();
+    }
+
+    virtual bool operator==(const Node &other) const {
+        return other.type == NodeType::STRING
+            && this->chars == static_cast<const _SelfType &>(other).chars;
+    }
+
+    virtual size_t hash() const {
+        return hash_combine(static_cast<size_t>(NodeType::STRING), hash_value(this->chars));
+    }
+
+    virtual _SelfType *clone() const {
+        return new _SelfType(*this);
+    }
+
+    const ustring &value() const {
+        return this->chars;
+    }
+    // reuses the buffer
+    void assign(const ustring &value) {
+        this->chars = value;
+        this->update_flags();
+    }
+    void assign(ustring &&value) {
+        this->chars = move(value);
+        this->update_flags();
+    }
+
+    bool is_ascii() const {
+        return this->ascii;
+    }
+    bool is_escape_free() const {
+        return this->escape_free;
+    }
+
+private:
+    void update_flags();
+
+    ustring chars;
+    bool ascii = true;          // all code points below 0x80
+    bool escape_free = true;    // no '"', '\\' or control chars
+};
+
+
 typedef SimpleNode<bool, NodeType::BOOL> NodeBool;
 typedef SimpleNode<int64_t, NodeType::INT> NodeInt;
 typedef SimpleNode<double, NodeType::FLOAT> NodeFloat;
@@ -73,8 +142,9 @@ typedef SimpleNode<ustring, NodeType::STRING> NodeString;
 
 
 #define NODE_COMMON_DECL(node_type) \
-    typedef unique_ptr<node_type> Ptr; \
+    typedef NodePtr<node_type> Ptr; \
     virtual bool operator==(const Node &other) const; \
+    virtual size_t hash() const; \
     virtual node_type *clone() const
 
 
@@ -84,36 +154,508 @@ struct NodeNull : Node {
 };
 
 
+// Number kept as the validated source lexeme, converted on demand.
+// Equals to other NodeNumber with the same value, e.g. 1.50e1 and 15.
+// See Scanner::lazy_numbers().
+struct NodeNumber : Node {
+    static const NodeType TYPE = NodeType::NUMBER;
+
+    explicit NodeNumber(string lexeme) : Node(NodeType::NUMBER), lexeme(move(lexeme)) {}
+    NODE_COMMON_DECL(NodeNumber);
+
+    // These throw std::out_of_range if the value is not representable.
+    int64_t as_int64() const;
+    uint64_t as_uint64() const;
+    double as_double() const;
+    // exact value in plain notation, e.g. "-0.0125" for -12.5e-3
+    string decimal() const;
+
+    string lexeme;
+};
+
+
+// Derived from the children of a list, see NodeVector.
+struct ListCache {
+    void reset() {
+        this->hash.reset();
+        this->size.reset();
+        this->fragment.reset();
+    }
+
+    CachedHash hash;
+    CachedSize size;
+    CachedFragment fragment;
+};
+
+
 struct NodeList : Node {
     NodeList() : Node(NodeType::LIST) {}
     NODE_COMMON_DECL(NodeList);
 
-    vector<Node::Ptr> value;
+    NodeVector<Node::Ptr, ListCache> value;
+};
+
+
+// Packed list of numbers, equals to the NodeList of the same numbers.
+// See Parser::pack_numbers().
+template<class ElementNode, NodeType node_type>
+struct NodeNumberArray : Node {
+    typedef NodeNumberArray<ElementNode, node_type> _SelfType;
+    typedef NodePtr<_SelfType> Ptr;
+    typedef decltype(ElementNode::value) ValueType;
+
+    NodeNumberArray() : Node(node_type) {}
+    explicit NodeNumberArray(const vector<ValueType> &value) : Node(node_type), value(value) {}
+
+    virtual bool operator==(const Node &other) const {
+        if (other.type == node_type) {
+            return this->value == static_cast<const _SelfType &>(other).value;
+        } else if (other.type == NodeType::LIST) {
+            const NodeList &list = static_cast<const NodeList &>(other);
+            if (list.value.size() != this->value.size()) {
+                return false;
+            }
+            for (size_t i = 0; i < this->value.size(); ++i) {
+                const Node &child = *list.value[i];
+                if (child.type != ElementNode::TYPE
+                    || static_cast<const ElementNode &>(child).value != this->value[i])
+                {
+                    return false;
+                }
+            }
+            return true;
+        } else if (other.type == NodeType::INT_ARRAY || other.type == NodeType::FLOAT_ARRAY) {
+            return this->value.empty() && other == NodeList();
+        } else {
+            return false;
+        }
+    }
+
+    // same as the NodeList, not cached since value is a plain vector
+    virtual size_t hash() const {
+        size_t ans = static_cast<size_t>(NodeType::LIST);
+        for (ValueType number : this->value) {
+            ans = hash_combine(ans, ElementNode(number).hash());
+        }
+        return ans;
+    }
+
+    virtual _SelfType *clone() const {
+        return new _SelfType(this->value);
+    }
+
+    // the generic representation
+    NodeList *to_list() const {
+        NodeList *list = new NodeList();
+        list->value.reserve(this->value.size());
+        for (ValueType number : this->value) {
+            list->value.emplace_back(new ElementNode(number));
+        }
+        return list;
+    }
+
+    vector<ValueType> value;
+};
+
+
+typedef NodeNumberArray<NodeInt, NodeType::INT_ARRAY> NodeIntArray;
+typedef NodeNumberArray<NodeFloat, NodeType::FLOAT_ARRAY> NodeFloatArray;
+
+
+// Immutable object key with precomputed hash. Keys are shared between pairs,
+// see KeyInterner.
+struct NodeKey : NodeString {
+    explicit NodeKey(ustring value)
+        : NodeString(move(value)), key_hash(hash_ustring(this->value())) {}
+    NodeKey(ustring value, size_t key_hash) : NodeString(move(value)), key_hash(key_hash) {}
+
+    virtual size_t hash() const {
+        return hash_combine(static_cast<size_t>(NodeType::STRING), this->key_hash);
+    }
+
+    const size_t key_hash;  // hash_ustring(value)
 };
 
 
 struct NodePair : Node {
+    typedef shared_ptr<const NodeKey> KeyPtr;
+
     NodePair(NodeString::Ptr &&key, Node::Ptr &&value)
+        : NodePair(KeyPtr(new NodeKey(key->value())), move(value))
+    {}
+    NodePair(KeyPtr key, Node::Ptr &&value)
         : Node(NodeType::PAIR), key(move(key)), value(move(value))
     {}
     NODE_COMMON_DECL(NodePair);
 
-    NodeString::Ptr key;
+    KeyPtr key;
     Node::Ptr value;
 };
 
 
+// Open addressing hash table from key to the position in NodeObject::pairs.
+struct ObjectIndex {
+    struct Slot {
+        size_t hash;
+        size_t pos;     // 1-based, 0 for empty slot
+    };
+
+    // key_at(i) returns the i-th const NodeKey &
+    template<class KeyAt>
+    void build(size_t size, KeyAt key_at);
+    // Returns size if not found.
+    template<class KeyAt>
+    size_t find(
+        size_t size, KeyAt key_at, const ustring &key, size_t hash, const NodeKey *interned
+    ) const;
+
+    vector<Slot> slots;
+};
+
+
+// Key layout shared by objects in shape mode, see ShapeTable.
+struct ObjectShape {
+    explicit ObjectShape(vector<NodePair::KeyPtr> &&keys);
+
+    vector<NodePair::KeyPtr> keys;
+    ObjectIndex index;      // built once for all objects of the shape
+    vector<size_t> key_order;   // see PairVector::key_order()
+};
+
+
+typedef shared_ptr<const ObjectShape> ShapePtr;
+
+
+// Const access to a pair of PairVector, refers to the stored key and value.
+struct PairRef {
+    // so that pairs[i]->key reads the same for const and non-const pairs
+    const PairRef *operator->() const {
+        return this;
+    }
+
+    const NodePair::KeyPtr &key;
+    const Node::Ptr &value;
+};
+
+
+// Pairs of a NodeObject, same interface and sharing as NodeVector.
+// In shape mode only values are stored, keys are taken from the shared shape.
+// Const access yields PairRef for plain and shaped objects alike, non-const access
+// converts the object to plain pairs.
+// key_version() is bumped only by accesses that may change the keys.
+class PairVector {
+public:
+    typedef vector<NodePair::Ptr>::iterator iterator;
+
+    class const_iterator {
+    public:
+        const_iterator(const PairVector &pairs, size_t pos) : pairs(&pairs), pos(pos) {}
+
+        PairRef operator*() const {
+            return (*this->pairs)[this->pos];
+        }
+
+        PairRef operator->() const {
+            return **this;
+        }
+
+        const_iterator &operator++() {
+            ++this->pos;
+            return *this;
+        }
+
+        bool operator==(const const_iterator &other) const {
+            return this->pos == other.pos;
+        }
+
+        bool operator!=(const const_iterator &other) const {
+            return this->pos != other.pos;
+        }
+
+    private:
+        const PairVector *pairs;
+        size_t pos;
+    };
+
+    size_t size() const {
+        if (!this->body) {
+            return 0;
+        }
+        return this->body->shape ? this->body->values.size() : this->body->items.size();
+    }
+
+    bool empty() const {
+        return this->size() == 0;
+    }
+
+    size_t capacity() const {
+        if (!this->body) {
+            return 0;
+        }
+        return this->body->shape ? this->body->values.capacity() : this->body->items.capacity();
+    }
+
+    size_t version() const {
+        return this->_version;
+    }
+
+    size_t key_version() const {
+        return this->_key_version;
+    }
+
+    // nullptr if nothing was added yet
+    const CachedHash *hash_cache() const {
+        return this->body ? &this->body->hash : nullptr;
+    }
+
+    const CachedSize *size_cache() const {
+        return this->body ? &this->body->size : nullptr;
+    }
+
+    const CachedFragment *fragment_cache() const {
+        return this->body ? &this->body->fragment : nullptr;
+    }
+
+    // see NodeVector::body_size()
+    static size_t body_size();
+    // The caches built so far, nullptr if not built, see memory_usage().
+    const ObjectIndex *built_index() const;
+    const vector<size_t> *built_order() const;
+
+    // Key index for plain pairs of a frozen body, built on first use and shared with it.
+    // Keys of other bodies may change through pairs handed out before, so find() searches
+    // them linearly.
+    const ObjectIndex &index() const;
+    // Positions of the pairs sorted by u16_less() on the keys, taken from the shape,
+    // or built on first use and shared with a frozen body like index(). Other bodies
+    // are sorted into buffer, which is returned.
+    const vector<size_t> &key_order(vector<size_t> &buffer) const;
+
+    // see NodeVector::frozen()
+    bool frozen() const {
+        return this->body && this->body->frozen.load(memory_order_acquire);
+    }
+
+    bool mark_frozen() const {
+        if (!this->body || this->frozen()) {
+            return false;
+        }
+        this->body->frozen.store(true, memory_order_release);
+        return true;
+    }
+
+    bool shared() const {
+        return this->body.use_count() > 1;
+    }
+
+    bool shares(const PairVector &other) const {
+        return this->body == other.body;
+    }
+
+    // see NodeVector::share()
+    void share(const PairVector &other) {
+        this->body = other.body;
+        this->_version++;
+        this->_key_version++;
+    }
+
+    const ShapePtr &get_shape() const {
+        static const ShapePtr none;
+        return this->body ? this->body->shape : none;
+    }
+
+    void set_shape(const ShapePtr &shape, vector<Node::Ptr> &&values);
+
+    const NodePair::KeyPtr &key(size_t i) const {
+        return this->body->shape ? this->body->shape->keys[i] : this->body->items[i]->key;
+    }
+
+    const Node::Ptr &value(size_t i) const {
+        return this->body->shape ? this->body->values[i] : this->body->items[i]->value;
+    }
+
+    // replacing a value keeps the shape
+    Node::Ptr &value(size_t i) {
+        this->detach();
+        this->_version++;
+        this->body->reset();
+        return this->body->shape ? this->body->values[i] : this->body->items[i]->value;
+    }
+
+    PairRef operator[](size_t i) const {
+        return PairRef{this->key(i), this->value(i)};
+    }
+
+    NodePair::Ptr &operator[](size_t i) {
+        return this->mut()[i];
+    }
+
+    PairRef back() const {
+        return (*this)[this->size() - 1];
+    }
+
+    NodePair::Ptr &back() {
+        return this->mut().back();
+    }
+
+    const_iterator begin() const {
+        return const_iterator(*this, 0);
+    }
+
+    const_iterator end() const {
+        return const_iterator(*this, this->size());
+    }
+
+    iterator begin() {
+        return this->mut().begin();
+    }
+
+    iterator end() {
+        return this->mut().end();
+    }
+
+    void reserve(size_t n) {
+        this->detach();
+        this->materialize();
+        this->body->items.reserve(n);
+    }
+
+    void push_back(NodePair::Ptr &&value) {
+        this->mut().push_back(move(value));
+    }
+
+    template<class ...Args>
+    void emplace_back(Args &&...args) {
+        this->mut().emplace_back(forward<Args>(args)...);
+    }
+
+    void pop_back() {
+        this->mut().pop_back();
+    }
+
+    // pos comes from non-const access, the body is already detached and plain
+    iterator insert(iterator pos, NodePair::Ptr &&value) {
+        return this->mut().insert(pos, move(value));
+    }
+
+    iterator erase(iterator pos) {
+        return this->mut().erase(pos);
+    }
+
+    void clear() {
+        this->mut().clear();
+    }
+
+private:
+    struct Body {
+        Body() {}
+        ~Body();
+        void reset();
+
+        vector<NodePair::Ptr> items;
+        ShapePtr shape;
+        vector<Node::Ptr> values;
+
+        // caches, filled in by concurrent readers
+        mutable atomic<const ObjectIndex *> index{nullptr};
+        mutable atomic<const vector<size_t> *> order{nullptr};
+        CachedHash hash;
+        CachedSize size;
+        CachedFragment fragment;
+        atomic<bool> frozen{false};
+    };
+
+    vector<NodePair::Ptr> &mut();
+    void detach();
+    void materialize();
+
+    shared_ptr<Body> body;
+    size_t _version = 0;
+    size_t _key_version = 0;
+};
+
+
 struct NodeObject : Node {
     NodeObject() : Node(NodeType::OBJECT) {}
     NODE_COMMON_DECL(NodeObject);
 
-    vector<NodePair::Ptr> pairs;
+    // The first pair with the key wins if keys are duplicated.
+    Node *find(const ustring &key);
+    const Node *find(const ustring &key) const;
+    // Faster for interned keys, which are compared by pointer first.
+    Node *find(const NodeKey &key);
+    const Node *find(const NodeKey &key) const;
+    // The non-const version appends a null value if key is not found,
+    // the const version throws std::out_of_range.
+    Node &operator[](const ustring &key);
+    const Node &operator[](const ustring &key) const;
+    // position in pairs, or pairs.size() if not found
+    size_t index_of(const ustring &key) const;
+
+    PairVector pairs;
+
+    // objects smaller than this, or not frozen, are searched linearly
+    static const size_t INDEX_THRESHOLD = 16;
+
+private:
+    size_t find_pos(const ustring &key, size_t hash, const NodeKey *interned) const;
 };
 
 
 #undef NODE_COMMON_DECL
 
 
+inline size_t hash_node(const Node &node) {
+    return node.hash();
+}
+
+
+// For unordered containers of node pointers compared by value.
+struct NodePtrHash {
+    template<class P>
+    size_t operator()(const P &node) const {
+        return node->hash();
+    }
+};
+
+
+struct NodePtrEqual {
+    template<class P>
+    bool operator()(const P &lhs, const P &rhs) const {
+        return *lhs == *rhs;
+    }
+};
+
+
+namespace std {
+    template<>
+    struct hash<Node> {
+        size_t operator()(const Node &node) const {
+            return node.hash();
+        }
+    };
+}
+
+
+// For iterative traversals: the children of a list or an object, none for other nodes.
+inline size_t child_count(const Node &node) {
+    if (node.type == NodeType::LIST) {
+        return static_cast<const NodeList &>(node).value.size();
+    } else if (node.type == NodeType::OBJECT) {
+        return static_cast<const NodeObject &>(node).pairs.size();
+    }
+    return 0;
+}
+
+
+inline const Node &child_at(const Node &node, size_t i) {
+    if (node.type == NodeType::LIST) {
+        return *static_cast<const NodeList &>(node).value[i];
+    }
+    return *static_cast<const NodeObject &>(node).pairs.value(i);
+}
+
+
 template<class NodeClass>
 typename NodeClass::Ptr clone_node(const Node &node) {
     NodeClass *cloned = dynamic_cast<NodeClass *>(node.clone());
@@ -0,0 +1,137 @@
+#ifndef JSON_CXX_NODE_PTR_HPP
+#define JSON_CXX_NODE_PTR_HPP
+
+
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+
+
+using std::enable_if;
+using std::is_convertible;
+using std::nullptr_t;
+using std::unique_ptr;
+
+
+// Owning pointer like unique_ptr, but the pointee of a const NodePtr is const,
+// so the children of a const node can not be modified through it.
+template<class T>
+class NodePtr {
+public:
+    template<class U>
+    using EnableConvert = typename enable_if<is_convertible<U *, T *>::value>::type;
+
+    NodePtr() noexcept {}
+    NodePtr(nullptr_t) noexcept {}
+    explicit NodePtr(T *ptr) noexcept : ptr(ptr) {}
+    NodePtr(NodePtr &&other) noexcept : ptr(other.release()) {}
+    template<class U, class = EnableConvert<U>>
+    NodePtr(NodePtr<U> &&other) noexcept : ptr(other.release()) {}
+    template<class U, class = EnableConvert<U>>
+    NodePtr(unique_ptr<U> &&other) noexcept : ptr(other.release()) {}
+    NodePtr(const NodePtr &) = delete;
+    NodePtr &operator=(const NodePtr &) = delete;
+
+    ~NodePtr() {
+        delete this->ptr;
+    }
+
+    NodePtr &operator=(NodePtr &&other) noexcept {
+        this->reset(other.release());
+        return *this;
+    }
+
+    template<class U, class = EnableConvert<U>>
+    NodePtr &operator=(NodePtr<U> &&other) noexcept {
+        this->reset(other.release());
+        return *this;
+    }
+
+    NodePtr &operator=(nullptr_t) noexcept {
+        this->reset();
+        return *this;
+    }
+
+    T *get() noexcept {
+        return this->ptr;
+    }
+
+    const T *get() const noexcept {
+        return this->ptr;
+    }
+
+    T &operator*() {
+        return *this->ptr;
+    }
+
+    const T &operator*() const {
+        return *this->ptr;
+    }
+
+    T *operator->() noexcept {
+        return this->ptr;
+    }
+
+    const T *operator->() const noexcept {
+        return this->ptr;
+    }
+
+    explicit operator bool() const noexcept {
+        return this->ptr != nullptr;
+    }
+
+    T *release() noexcept {
+        T *ans = this->ptr;
+        this->ptr = nullptr;
+        return ans;
+    }
+
+    // like unique_ptr, the old pointee is deleted after value is stored
+    void reset(T *value = nullptr) noexcept {
+        T *old = this->ptr;
+        this->ptr = value;
+        delete old;
+    }
+
+private:
+    T *ptr = nullptr;
+};
+
+
+template<class T, class U>
+bool operator==(const NodePtr<T> &lhs, const NodePtr<U> &rhs) {
+    return lhs.get() == rhs.get();
+}
+
+
+template<class T, class U>
+bool operator!=(const NodePtr<T> &lhs, const NodePtr<U> &rhs) {
+    return lhs.get() != rhs.get();
+}
+
+
+template<class T>
+bool operator==(const NodePtr<T> &ptr, nullptr_t) {
+    return !ptr;
+}
+
+
+template<class T>
+bool operator==(nullptr_t, const NodePtr<T> &ptr) {
+    return !ptr;
+}
+
+
+template<class T>
+bool operator!=(const NodePtr<T> &ptr, nullptr_t) {
+    return static_cast<bool>(ptr);
+}
+
+
+template<class T>
+bool operator!=(nullptr_t, const NodePtr<T> &ptr) {
+    return static_cast<bool>(ptr);
+}
+
+
+#endif //JSON_CXX_NODE_PTR_HPP
@@ -0,0 +1,381 @@
+#ifndef JSON_CXX_NODE_VECTOR_HPP
+#define JSON_CXX_NODE_VECTOR_HPP
+
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "node_ptr.hpp"
+
+
+using std::allocate_shared;
+using std::atomic;
+using std::atomic_load;
+using std::atomic_store;
+using std::default_delete;
+using std::forward;
+using std::make_shared;
+using std::memory_order_acquire;
+using std::memory_order_relaxed;
+using std::memory_order_release;
+using std::move;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+
+struct Node;
+// Destroys the nodes without recursing into their children, see node.cpp.
+void release_nodes(vector<NodePtr<Node>> &nodes);
+// A copy of node sharing its children with it, see node.cpp.
+Node *share_node(const Node &node);
+
+
+// Size of the last allocation by a RecordingAllocator in this thread, whatever its type.
+inline size_t &recorded_allocation() {
+    static thread_local size_t size = 0;
+    return size;
+}
+
+
+// Allocator recording the size of its allocations, for the block sizes below.
+// Stateless like std::allocator, so that the control blocks have the same layout.
+template<class T>
+struct RecordingAllocator {
+    typedef T value_type;
+
+    RecordingAllocator() {}
+    template<class U>
+    RecordingAllocator(const RecordingAllocator<U> &) {}
+
+    T *allocate(size_t n) {
+        recorded_allocation() = n * sizeof(T);
+        return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T *ptr, size_t) {
+        ::operator delete(ptr);
+    }
+
+    template<class U>
+    bool operator==(const RecordingAllocator<U> &) const {
+        return true;
+    }
+
+    template<class U>
+    bool operator!=(const RecordingAllocator<U> &) const {
+        return false;
+    }
+};
+
+
+// Bytes allocated by make_shared<T>(), T and its control block in one block.
+template<class T>
+size_t shared_block_size() {
+    static const size_t size = [] {
+        allocate_shared<T>(RecordingAllocator<T>());
+        return recorded_allocation();
+    }();
+    return size;
+}
+
+
+// Bytes of the control block allocated by shared_ptr<T>(new T), apart from T.
+template<class T>
+size_t control_block_size() {
+    static const size_t size = [] {
+        shared_ptr<T>(static_cast<T *>(nullptr), default_delete<T>(), RecordingAllocator<T>());
+        return recorded_allocation();
+    }();
+    return size;
+}
+
+
+// Hash filled in lazily, safe for concurrent readers.
+class CachedHash {
+public:
+    bool get(size_t &hash) const {
+        if (!this->valid.load(memory_order_acquire)) {
+            return false;
+        }
+        hash = this->value.load(memory_order_relaxed);
+        return true;
+    }
+
+    void set(size_t hash) const {
+        this->value.store(hash, memory_order_relaxed);
+        this->valid.store(true, memory_order_release);
+    }
+
+    void reset() {
+        this->valid.store(false, memory_order_relaxed);
+    }
+
+private:
+    mutable atomic<size_t> value{0};
+    mutable atomic<bool> valid{false};
+};
+
+
+// Formatted size of a container for one set of format options, filled in like CachedHash,
+// see Formatter::measure(). key identifies the options, it is below 2^KEY_BITS and not 0.
+class CachedSize {
+public:
+    static const unsigned KEY_BITS = 10;
+
+    bool get(unsigned key, size_t &size) const {
+        uint64_t packed = this->value.load(memory_order_acquire);
+        if ((packed & KEY_MASK) != key) {
+            return false;
+        }
+        size = static_cast<size_t>(packed >> KEY_BITS);
+        return true;
+    }
+
+    void set(unsigned key, size_t size) const {
+        if (static_cast<uint64_t>(size) >> (64 - KEY_BITS) == 0) {
+            this->value.store(static_cast<uint64_t>(size) << KEY_BITS | key, memory_order_release);
+        }
+    }
+
+    void reset() {
+        this->value.store(0, memory_order_relaxed);
+    }
+
+private:
+    static const uint64_t KEY_MASK = (1u << KEY_BITS) - 1;
+
+    // size and key in one word, so that readers never see the size of another key
+    mutable atomic<uint64_t> value{0};
+};
+
+
+// Formatted output of a container for one key of CachedSize,
+// see FormatOption::fragment_size(). Used for frozen bodies only. Safe for concurrent readers.
+class CachedFragment {
+public:
+    // nullptr if there is none for key
+    shared_ptr<const string> get(unsigned key) const {
+        shared_ptr<const Fragment> fragment = atomic_load(&this->value);
+        if (!fragment || fragment->key != key) {
+            return nullptr;
+        }
+        return shared_ptr<const string>(fragment, &fragment->data);
+    }
+
+    shared_ptr<const string> set(unsigned key, string &&data) const {
+        shared_ptr<const Fragment> fragment = make_shared<Fragment>(Fragment{key, move(data)});
+        atomic_store(&this->value, fragment);
+        return shared_ptr<const string>(fragment, &fragment->data);
+    }
+
+    // not concurrent with readers, like the other resets
+    void reset() {
+        this->value.reset();
+    }
+
+    // the fragment of any key, nullptr if there is none, see memory_usage()
+    shared_ptr<const string> peek() const {
+        shared_ptr<const Fragment> fragment = atomic_load(&this->value);
+        return fragment ? shared_ptr<const string>(fragment, &fragment->data) : nullptr;
+    }
+
+    // bytes of the block holding a fragment, its string buffer apart
+    static size_t block_size() {
+        return shared_block_size<Fragment>();
+    }
+
+private:
+    struct Fragment {
+        unsigned key;
+        string data;
+    };
+
+    mutable shared_ptr<const Fragment> value;
+};
+
+
+// A vector of child nodes, T is Node::Ptr.
+// The body may be shared by several vectors, see share_node(), and is detached on the first
+// non-const access, which copies the children with share_node() in turn,
+// so a modification copies only the path to the modified node.
+// Every non-const access bumps version(), unfreezes the body and resets Cache, the data
+// derived from the children which lives in the body and is shared with it.
+template<class T, class Cache>
+class NodeVector {
+public:
+    typedef typename vector<T>::iterator iterator;
+    typedef typename vector<T>::const_iterator const_iterator;
+
+    size_t size() const {
+        return this->items().size();
+    }
+
+    bool empty() const {
+        return this->items().empty();
+    }
+
+    size_t capacity() const {
+        return this->items().capacity();
+    }
+
+    size_t version() const {
+        return this->_version;
+    }
+
+    // nullptr if nothing was added yet
+    const Cache *cache() const {
+        return this->body ? &this->body->cache : nullptr;
+    }
+
+    // Heap bytes of a body with its control block, the child array apart.
+    static size_t body_size() {
+        return shared_block_size<Body>();
+    }
+
+    // Whether the children can no longer change, see freeze(). Before that they may be
+    // modified through references held elsewhere, so the caches derived from them are
+    // only valid for frozen bodies.
+    bool frozen() const {
+        return this->body && this->body->frozen.load(memory_order_acquire);
+    }
+
+    // Returns false if the body was frozen before, or if there is none.
+    bool mark_frozen() const {
+        if (!this->body || this->frozen()) {
+            return false;
+        }
+        this->body->frozen.store(true, memory_order_release);
+        return true;
+    }
+
+    bool shared() const {
+        return this->body.use_count() > 1;
+    }
+
+    bool shares(const NodeVector &other) const {
+        return this->body == other.body;
+    }
+
+    // Takes the children of other in O(1). Writes through references to the children
+    // would change both, so both must be frozen before they are handed out, see share_node().
+    void share(const NodeVector &other) {
+        this->body = other.body;
+        this->_version++;
+    }
+
+    const T &operator[](size_t i) const {
+        return this->items()[i];
+    }
+
+    T &operator[](size_t i) {
+        return this->mut()[i];
+    }
+
+    const T &back() const {
+        return this->items().back();
+    }
+
+    T &back() {
+        return this->mut().back();
+    }
+
+    const_iterator begin() const {
+        return this->items().begin();
+    }
+
+    const_iterator end() const {
+        return this->items().end();
+    }
+
+    iterator begin() {
+        return this->mut().begin();
+    }
+
+    iterator end() {
+        return this->mut().end();
+    }
+
+    void reserve(size_t n) {
+        this->detach();
+        this->body->items.reserve(n);
+    }
+
+    void push_back(T &&value) {
+        this->mut().push_back(move(value));
+    }
+
+    template<class ...Args>
+    void emplace_back(Args &&...args) {
+        this->mut().emplace_back(forward<Args>(args)...);
+    }
+
+    void pop_back() {
+        this->mut().pop_back();
+    }
+
+    // pos may come from const access before the body is detached
+    iterator insert(const_iterator pos, T &&value) {
+        size_t i = static_cast<size_t>(pos - this->items().begin());
+        vector<T> &items = this->mut();
+        return items.insert(items.begin() + i, move(value));
+    }
+
+    iterator erase(const_iterator pos) {
+        size_t i = static_cast<size_t>(pos - this->items().begin());
+        vector<T> &items = this->mut();
+        return items.erase(items.begin() + i);
+    }
+
+    void clear() {
+        this->mut().clear();
+    }
+
+private:
+    struct Body {
+        ~Body() {
+            release_nodes(this->items);
+        }
+
+        vector<T> items;
+        Cache cache;
+        atomic<bool> frozen{false};
+    };
+
+    const vector<T> &items() const {
+        static const vector<T> empty;
+        return this->body ? this->body->items : empty;
+    }
+
+    void detach() {
+        if (!this->body) {
+            this->body = make_shared<Body>();
+        } else if (this->body.use_count() > 1) {
+            shared_ptr<Body> copy = make_shared<Body>();
+            copy->items.reserve(this->body->items.size());
+            for (const T &item : this->body->items) {
+                copy->items.emplace_back(share_node(*item));
+            }
+            this->body = move(copy);
+        }
+    }
+
+    vector<T> &mut() {
+        this->detach();
+        this->_version++;
+        this->body->frozen.store(false, memory_order_relaxed);
+        this->body->cache.reset();
+        return this->body->items;
+    }
+
+    shared_ptr<Body> body;
+    size_t _version = 0;
+};
+
+
+#endif //JSON_CXX_NODE_VECTOR_HPP
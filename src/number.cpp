@@ -0,0 +1,531 @@
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <locale.h>
+#ifdef __APPLE__
+#include <xlocale.h>
+#endif
+
+#include "number.h"
+
+
+using std::atoi;
+using std::isfinite;
+using std::isinf;
+using std::isnan;
+using std::memchr;
+using std::memcpy;
+using std::memmove;
+using std::memset;
+using std::signbit;
+
+
+static const char DIGIT_PAIRS[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+
+// Grisu2 from "Printing Floating-Point Numbers Quickly and Accurately with Integers"
+// by Florian Loitsch. The digits always read back as the input and are the shortest
+// such digits for all but about 0.1% of the doubles, which get one digit more.
+
+
+static const uint64_t DP_HIDDEN_BIT = 1ULL << 52;
+static const uint64_t DP_SIGNIFICAND_MASK = DP_HIDDEN_BIT - 1;
+static const int DP_EXPONENT_BIAS = 0x3ff + 52;
+
+
+// f * 2^e
+struct DiyFp {
+    uint64_t f;
+    int e;
+
+    static DiyFp from_double(double value) {
+        uint64_t bits = 0;
+        memcpy(&bits, &value, sizeof(bits));
+        int biased_e = static_cast<int>((bits >> 52) & 0x7ff);
+        uint64_t significand = bits & DP_SIGNIFICAND_MASK;
+        if (biased_e != 0) {
+            return DiyFp{significand + DP_HIDDEN_BIT, biased_e - DP_EXPONENT_BIAS};
+        } else {
+            return DiyFp{significand, 1 - DP_EXPONENT_BIAS};    // subnormal
+        }
+    }
+
+    DiyFp operator-(const DiyFp &rhs) const {
+        return DiyFp{this->f - rhs.f, this->e};
+    }
+
+    // the upper 64 bits of the product, rounded
+    DiyFp operator*(const DiyFp &rhs) const {
+        const uint64_t M32 = 0xffffffffULL;
+        uint64_t a = this->f >> 32;
+        uint64_t b = this->f & M32;
+        uint64_t c = rhs.f >> 32;
+        uint64_t d = rhs.f & M32;
+        uint64_t ac = a * c;
+        uint64_t bc = b * c;
+        uint64_t ad = a * d;
+        uint64_t bd = b * d;
+        uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32);
+        tmp += 1ULL << 31;
+        return DiyFp{ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), this->e + rhs.e + 64};
+    }
+
+    DiyFp normalize() const {
+        DiyFp ans = *this;
+        while (!(ans.f & (1ULL << 63))) {
+            ans.f <<= 1;
+            ans.e--;
+        }
+        return ans;
+    }
+
+    // the boundaries of the interval rounding to this, with the same exponent
+    void boundaries(DiyFp &minus, DiyFp &plus) const {
+        plus = DiyFp{(this->f << 1) + 1, this->e - 1};
+        while (!(plus.f & (DP_HIDDEN_BIT << 1))) {
+            plus.f <<= 1;
+            plus.e--;
+        }
+        plus.f <<= 64 - 52 - 2;
+        plus.e -= 64 - 52 - 2;
+
+        // the lower boundary is closer at powers of 2
+        if (this->f == DP_HIDDEN_BIT) {
+            minus = DiyFp{(this->f << 2) - 1, this->e - 2};
+        } else {
+            minus = DiyFp{(this->f << 1) - 1, this->e - 1};
+        }
+        minus.f <<= minus.e - plus.e;
+        minus.e = plus.e;
+    }
+};
+
+
+// normalized 10^k for k = -348, -340, ..., 340
+static const DiyFp CACHED_POWERS[] = {
+    {0xfa8fd5a0081c0288ULL, -1220},   // 1e-348
+    {0xbaaee17fa23ebf76ULL, -1193},   // 1e-340
+    {0x8b16fb203055ac76ULL, -1166},   // 1e-332
+    {0xcf42894a5dce35eaULL, -1140},   // 1e-324
+    {0x9a6bb0aa55653b2dULL, -1113},   // 1e-316
+    {0xe61acf033d1a45dfULL, -1087},   // 1e-308
+    {0xab70fe17c79ac6caULL, -1060},   // 1e-300
+    {0xff77b1fcbebcdc4fULL, -1034},   // 1e-292
+    {0xbe5691ef416bd60cULL, -1007},   // 1e-284
+    {0x8dd01fad907ffc3cULL, -980},   // 1e-276
+    {0xd3515c2831559a83ULL, -954},   // 1e-268
+    {0x9d71ac8fada6c9b5ULL, -927},   // 1e-260
+    {0xea9c227723ee8bcbULL, -901},   // 1e-252
+    {0xaecc49914078536dULL, -874},   // 1e-244
+    {0x823c12795db6ce57ULL, -847},   // 1e-236
+    {0xc21094364dfb5637ULL, -821},   // 1e-228
+    {0x9096ea6f3848984fULL, -794},   // 1e-220
+    {0xd77485cb25823ac7ULL, -768},   // 1e-212
+    {0xa086cfcd97bf97f4ULL, -741},   // 1e-204
+    {0xef340a98172aace5ULL, -715},   // 1e-196
+    {0xb23867fb2a35b28eULL, -688},   // 1e-188
+    {0x84c8d4dfd2c63f3bULL, -661},   // 1e-180
+    {0xc5dd44271ad3cdbaULL, -635},   // 1e-172
+    {0x936b9fcebb25c996ULL, -608},   // 1e-164
+    {0xdbac6c247d62a584ULL, -582},   // 1e-156
+    {0xa3ab66580d5fdaf6ULL, -555},   // 1e-148
+    {0xf3e2f893dec3f126ULL, -529},   // 1e-140
+    {0xb5b5ada8aaff80b8ULL, -502},   // 1e-132
+    {0x87625f056c7c4a8bULL, -475},   // 1e-124
+    {0xc9bcff6034c13053ULL, -449},   // 1e-116
+    {0x964e858c91ba2655ULL, -422},   // 1e-108
+    {0xdff9772470297ebdULL, -396},   // 1e-100
+    {0xa6dfbd9fb8e5b88fULL, -369},   // 1e-92
+    {0xf8a95fcf88747d94ULL, -343},   // 1e-84
+    {0xb94470938fa89bcfULL, -316},   // 1e-76
+    {0x8a08f0f8bf0f156bULL, -289},   // 1e-68
+    {0xcdb02555653131b6ULL, -263},   // 1e-60
+    {0x993fe2c6d07b7facULL, -236},   // 1e-52
+    {0xe45c10c42a2b3b06ULL, -210},   // 1e-44
+    {0xaa242499697392d3ULL, -183},   // 1e-36
+    {0xfd87b5f28300ca0eULL, -157},   // 1e-28
+    {0xbce5086492111aebULL, -130},   // 1e-20
+    {0x8cbccc096f5088ccULL, -103},   // 1e-12
+    {0xd1b71758e219652cULL, -77},   // 1e-4
+    {0x9c40000000000000ULL, -50},   // 1e4
+    {0xe8d4a51000000000ULL, -24},   // 1e12
+    {0xad78ebc5ac620000ULL, 3},   // 1e20
+    {0x813f3978f8940984ULL, 30},   // 1e28
+    {0xc097ce7bc90715b3ULL, 56},   // 1e36
+    {0x8f7e32ce7bea5c70ULL, 83},   // 1e44
+    {0xd5d238a4abe98068ULL, 109},   // 1e52
+    {0x9f4f2726179a2245ULL, 136},   // 1e60
+    {0xed63a231d4c4fb27ULL, 162},   // 1e68
+    {0xb0de65388cc8ada8ULL, 189},   // 1e76
+    {0x83c7088e1aab65dbULL, 216},   // 1e84
+    {0xc45d1df942711d9aULL, 242},   // 1e92
+    {0x924d692ca61be758ULL, 269},   // 1e100
+    {0xda01ee641a708deaULL, 295},   // 1e108
+    {0xa26da3999aef774aULL, 322},   // 1e116
+    {0xf209787bb47d6b85ULL, 348},   // 1e124
+    {0xb454e4a179dd1877ULL, 375},   // 1e132
+    {0x865b86925b9bc5c2ULL, 402},   // 1e140
+    {0xc83553c5c8965d3dULL, 428},   // 1e148
+    {0x952ab45cfa97a0b3ULL, 455},   // 1e156
+    {0xde469fbd99a05fe3ULL, 481},   // 1e164
+    {0xa59bc234db398c25ULL, 508},   // 1e172
+    {0xf6c69a72a3989f5cULL, 534},   // 1e180
+    {0xb7dcbf5354e9beceULL, 561},   // 1e188
+    {0x88fcf317f22241e2ULL, 588},   // 1e196
+    {0xcc20ce9bd35c78a5ULL, 614},   // 1e204
+    {0x98165af37b2153dfULL, 641},   // 1e212
+    {0xe2a0b5dc971f303aULL, 667},   // 1e220
+    {0xa8d9d1535ce3b396ULL, 694},   // 1e228
+    {0xfb9b7cd9a4a7443cULL, 720},   // 1e236
+    {0xbb764c4ca7a44410ULL, 747},   // 1e244
+    {0x8bab8eefb6409c1aULL, 774},   // 1e252
+    {0xd01fef10a657842cULL, 800},   // 1e260
+    {0x9b10a4e5e9913129ULL, 827},   // 1e268
+    {0xe7109bfba19c0c9dULL, 853},   // 1e276
+    {0xac2820d9623bf429ULL, 880},   // 1e284
+    {0x80444b5e7aa7cf85ULL, 907},   // 1e292
+    {0xbf21e44003acdd2dULL, 933},   // 1e300
+    {0x8e679c2f5e44ff8fULL, 960},   // 1e308
+    {0xd433179d9c8cb841ULL, 986},   // 1e316
+    {0x9e19db92b4e31ba9ULL, 1013},   // 1e324
+    {0xeb96bf6ebadf77d9ULL, 1039},   // 1e332
+    {0xaf87023b9bf0ee6bULL, 1066},   // 1e340
+};
+
+
+static const uint64_t POW10[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL,
+    1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+    1000000000000000000ULL, 10000000000000000000ULL,
+};
+
+
+// A power c = 10^-k such that the exponent of c * 2^e lies in [-60, -32].
+static DiyFp cached_power(int e, int &k) {
+    double dk = (-61 - e) * 0.30102999566398114 + 347;    // log10(2)
+    int index = static_cast<int>(dk);
+    if (dk - index > 0.0) {
+        index++;
+    }
+    index = (index >> 3) + 1;
+    k = -(-348 + index * 8);
+    return CACHED_POWERS[index];
+}
+
+
+// one division per 4 digits
+static int count_digits(uint64_t n) {
+    int ans = 1;
+    while (true) {
+        if (n < 10) {
+            return ans;
+        }
+        if (n < 100) {
+            return ans + 1;
+        }
+        if (n < 1000) {
+            return ans + 2;
+        }
+        if (n < 10000) {
+            return ans + 3;
+        }
+        n /= 10000;
+        ans += 4;
+    }
+}
+
+
+// Moves the last digit towards w while the result stays in the rounding interval.
+static void grisu_round(
+    char *buf, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w)
+{
+    while (rest < wp_w && delta - rest >= ten_kappa
+           && (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w))
+    {
+        buf[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+
+// Generates the digits of mp, stopping as soon as they are within delta of it.
+static int digit_gen(const DiyFp &w, const DiyFp &mp, uint64_t delta, char *buf, int &k) {
+    const DiyFp one{1ULL << -mp.e, mp.e};
+    const DiyFp wp_w = mp - w;
+    uint32_t p1 = static_cast<uint32_t>(mp.f >> -one.e);
+    uint64_t p2 = mp.f & (one.f - 1);
+    int kappa = count_digits(p1);
+    int len = 0;
+
+    // the integral part
+    while (kappa > 0) {
+        uint32_t div = static_cast<uint32_t>(POW10[kappa - 1]);
+        uint32_t d = p1 / div;
+        p1 %= div;
+        if (d || len) {
+            buf[len++] = static_cast<char>('0' + d);
+        }
+        kappa--;
+        uint64_t rest = (static_cast<uint64_t>(p1) << -one.e) + p2;
+        if (rest <= delta) {
+            k += kappa;
+            grisu_round(buf, len, delta, rest, POW10[kappa] << -one.e, wp_w.f);
+            return len;
+        }
+    }
+
+    // the fractional part
+    while (true) {
+        p2 *= 10;
+        delta *= 10;
+        char d = static_cast<char>(p2 >> -one.e);
+        if (d || len) {
+            buf[len++] = static_cast<char>('0' + d);
+        }
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta) {
+            k += kappa;
+            int index = -kappa;
+            grisu_round(buf, len, delta, p2, one.f, wp_w.f * (index < 20 ? POW10[index] : 0));
+            return len;
+        }
+    }
+}
+
+
+// value is positive and finite, value = buf[0, len) * 10^k
+static int grisu2(double value, char *buf, int &k) {
+    const DiyFp v = DiyFp::from_double(value);
+    DiyFp w_m, w_p;
+    v.boundaries(w_m, w_p);
+
+    const DiyFp c_mk = cached_power(w_p.e, k);
+    const DiyFp w = v.normalize() * c_mk;
+    DiyFp wp = w_p * c_mk;
+    DiyFp wm = w_m * c_mk;
+    // stay inside the interval despite the rounding of the multiplications
+    wm.f++;
+    wp.f--;
+    return digit_gen(w, wp, wp.f - wm.f, buf, k);
+}
+
+
+static char *write_exponent(char *buf, int exp, bool canonical) {
+    if (exp < 0) {
+        *buf++ = '-';
+        exp = -exp;
+    } else if (canonical) {
+        *buf++ = '+';
+    }
+    if (exp >= 100) {
+        *buf++ = static_cast<char>('0' + exp / 100);
+        exp %= 100;
+        *buf++ = static_cast<char>('0' + exp / 10);
+    } else if (exp >= 10) {
+        *buf++ = static_cast<char>('0' + exp / 10);
+    }
+    *buf++ = static_cast<char>('0' + exp % 10);
+    return buf;
+}
+
+
+// Lays out buf[0, len) * 10^k like JavaScript does, but keeps the output a float
+// unless canonical, which is exactly the JavaScript layout.
+static char *prettify(char *buf, int len, int k, bool canonical) {
+    const int kk = len + k;     // 10^(kk - 1) <= v < 10^kk
+    if (0 <= k && kk <= 21) {
+        // 1234e7 -> 12340000000.0
+        memset(buf + len, '0', static_cast<size_t>(k));
+        if (canonical) {
+            return buf + kk;
+        }
+        buf[kk] = '.';
+        buf[kk + 1] = '0';
+        return buf + kk + 2;
+    } else if (0 < kk && kk <= 21) {
+        // 1234e-2 -> 12.34
+        memmove(buf + kk + 1, buf + kk, static_cast<size_t>(len - kk));
+        buf[kk] = '.';
+        return buf + len + 1;
+    } else if (-6 < kk && kk <= 0) {
+        // 1234e-6 -> 0.001234
+        int offset = 2 - kk;
+        memmove(buf + offset, buf, static_cast<size_t>(len));
+        buf[0] = '0';
+        buf[1] = '.';
+        memset(buf + 2, '0', static_cast<size_t>(offset - 2));
+        return buf + len + offset;
+    } else if (len == 1) {
+        // 1e30
+        buf[1] = 'e';
+        return write_exponent(buf + 2, kk - 1, canonical);
+    } else {
+        // 1234e30 -> 1.234e33
+        memmove(buf + 2, buf + 1, static_cast<size_t>(len - 1));
+        buf[1] = '.';
+        buf[len + 1] = 'e';
+        return write_exponent(buf + len + 2, kk - 1, canonical);
+    }
+}
+
+
+char *write_double(char *buf, double value) {
+    if (isnan(value)) {
+        memcpy(buf, "nan", 3);
+        return buf + 3;
+    }
+    if (signbit(value)) {
+        *buf++ = '-';
+        value = -value;
+    }
+    if (isinf(value)) {
+        memcpy(buf, "inf", 3);
+        return buf + 3;
+    }
+    if (value == 0) {
+        memcpy(buf, "0.0", 3);
+        return buf + 3;
+    }
+    int k = 0;
+    int len = grisu2(value, buf, k);
+    return prettify(buf, len, k, false);
+}
+
+
+// Created on first use, never freed.
+static locale_t c_locale() {
+    static const locale_t locale = newlocale(LC_ALL_MASK, "C", static_cast<locale_t>(0));
+    return locale;
+}
+
+
+double c_strtod(const char *str, char **end) {
+    return strtod_l(str, end, c_locale());
+}
+
+
+// Switches the calling thread to the "C" locale, for snprintf().
+class CLocaleScope {
+public:
+    CLocaleScope() : saved(uselocale(c_locale())) {}
+    ~CLocaleScope() {
+        uselocale(this->saved);
+    }
+
+private:
+    locale_t saved;
+};
+
+
+static bool round_trips(double value, int precision) {
+    char buf[DOUBLE_BUF_SIZE];
+    snprintf(buf, sizeof(buf), "%.*e", precision - 1, value);
+    return c_strtod(buf) == value;
+}
+
+
+// The closest of the shortest digits that read back as value. Grisu2 may give a digit
+// more or a farther neighbour, so its length is only the starting point. Round trips are
+// monotonic in the precision, and "%e" gives the closest digits of a precision.
+static int closest_shortest(double value, char *buf, int &k) {
+    CLocaleScope scope;
+    int precision = grisu2(value, buf, k);
+    while (precision > 1 && round_trips(value, precision - 1)) {
+        precision--;
+    }
+
+    char digits[DOUBLE_BUF_SIZE];
+    snprintf(digits, sizeof(digits), "%.*e", precision - 1, value);  // d.ddde-xx
+    int len = 0;
+    const char *pos = digits;
+    for (; *pos != 'e'; ++pos) {
+        if ('0' <= *pos && *pos <= '9') {
+            buf[len++] = *pos;
+        }
+    }
+    k = atoi(pos + 1) - (len - 1);
+    return len;
+}
+
+
+char *write_double_canonical(char *buf, double value) {
+    assert(isfinite(value));
+    if (value == 0) {
+        *buf = '0';
+        return buf + 1;
+    }
+    if (value < 0) {
+        *buf++ = '-';
+        value = -value;
+    }
+    int k = 0;
+    int len = closest_shortest(value, buf, k);
+    return prettify(buf, len, k, true);
+}
+
+
+// Falls back to the shortest digits if the output and ".0" do not fit in DOUBLE_BUF_SIZE.
+char *write_double(char *buf, double value, int precision) {
+    int len = 0;
+    {
+        CLocaleScope scope;
+        len = snprintf(buf, DOUBLE_BUF_SIZE, "%.*g", precision, value);
+    }
+    if (len < 0 || static_cast<size_t>(len) + 2 > DOUBLE_BUF_SIZE) {
+        return write_double(buf, value);
+    }
+    size_t size = static_cast<size_t>(len);
+    char *end = buf + size;
+    if (!isinf(value) && !isnan(value) && !memchr(buf, '.', size) && !memchr(buf, 'e', size)) {
+        memcpy(end, ".0", 2);
+        end += 2;
+    }
+    return end;
+}
+
+
+// Two digits per division, from the end.
+char *write_uint(char *buf, uint64_t value) {
+    char *end = buf + count_digits(value);
+    char *pos = end;
+    while (value >= 100) {
+        size_t i = static_cast<size_t>(value % 100) * 2;
+        value /= 100;
+        pos -= 2;
+        pos[0] = DIGIT_PAIRS[i];
+        pos[1] = DIGIT_PAIRS[i + 1];
+    }
+    if (value >= 10) {
+        size_t i = static_cast<size_t>(value) * 2;
+        buf[0] = DIGIT_PAIRS[i];
+        buf[1] = DIGIT_PAIRS[i + 1];
+    } else {
+        buf[0] = static_cast<char>('0' + value);
+    }
+    return end;
+}
+
+
+char *write_int(char *buf, int64_t value) {
+    uint64_t magnitude = static_cast<uint64_t>(value);
+    if (value < 0) {
+        *buf++ = '-';
+        magnitude = 0 - magnitude;  // INT64_MIN has no positive int64
+    }
+    return write_uint(buf, magnitude);
+}
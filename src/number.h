@@ -0,0 +1,34 @@
+#ifndef JSON_CXX_NUMBER_H
+#define JSON_CXX_NUMBER_H
+
+
+#include <cstddef>
+#include <cstdint>
+
+
+// Enough for any double written by write_double().
+const size_t DOUBLE_BUF_SIZE = 32;
+// Enough for INT64_MIN.
+const size_t INT_BUF_SIZE = 20;
+
+
+// strtod() in the "C" locale, so the decimal point is '.' whatever the current locale is.
+double c_strtod(const char *str, char **end = nullptr);
+
+// Returns the end of the output, which is not null-terminated.
+char *write_int(char *buf, int64_t value);
+char *write_uint(char *buf, uint64_t value);
+
+
+// Writes the shortest digits that read back as value (Grisu2), returns the end of the output.
+// The output always reads back as a float: 1.0, 1e-7, 1.5e300, -0.0.
+// inf and nan have no JSON form and are written as inf, -inf and nan.
+char *write_double(char *buf, double value);
+// Number::toString() of ECMAScript as RFC 8785 requires: the closest of the shortest digits,
+// 1, 1e+21, 1.5e-7. value must be finite.
+char *write_double_canonical(char *buf, double value);
+// Like printf("%.*g"), with ".0" appended if the output looks like an integer.
+char *write_double(char *buf, double value, int precision);
+
+
+#endif //JSON_CXX_NUMBER_H
@@ -3,13 +3,21 @@
 #include <utility>
 
 #include "exceptions.h"
+#include "interner.h"
 #include "parser.h"
+#include "shape.h"
 
 
 using std::move;
 using std::to_string;
 
 
+// see MemoryUsage::nodes
+static size_t list_body_size() {
+    return decltype(NodeList::value)::body_size();
+}
+
+
 Node::Ptr Parser::pop_result() {
     assert(this->is_finished());
     Node::Ptr node = move(this->nodes.back());
@@ -26,6 +34,12 @@ bool Parser::is_finished() const {
 void Parser::reset() {
     this->states = {&Parser::st_json};
     this->nodes.clear();
+    this->keys.clear();
+    this->objects.clear();
+    this->used = 0;
+    this->reusing = false;
+    this->old_root.reset();
+    this->recycled.clear();
 }
 
 
@@ -41,6 +55,21 @@ void Parser::feed(const Token &tok) {
     } else {
         (this->*this->states.back())(tok);
     }
+    if (this->used > this->budget) {
+        throw BudgetExceeded(this->budget, tok.start, tok.end);
+    }
+}
+
+
+void Parser::feed(Token &&tok) {
+    this->movable = &tok;
+    try {
+        this->feed(static_cast<const Token &>(tok));
+    } catch (...) {
+        this->movable = nullptr;
+        throw;
+    }
+    this->movable = nullptr;
 }
 
 
@@ -56,7 +85,11 @@ void Parser::enter_list() {
 
 void Parser::enter_list_item() {
     this->states.back() = &Parser::st_list_end;
-    this->enter_json();
+    if (this->pack) {
+        this->states.push_back(&Parser::st_list_item);
+    } else {
+        this->enter_json();
+    }
 }
 
 
@@ -97,21 +130,30 @@ void Parser::st_json(const Token &tok) {
         return this->enter_list();
     case TokenType::LCURLY:
         return this->enter_object();
-    case TokenType::NIL:
-        this->nodes.emplace_back(new NodeNull());
+    case TokenType::NIL: {
+        Node::Ptr old = this->take_old();
+        if (old && old->type == NodeType::NIL) {
+            this->nodes.push_back(move(old));
+        } else {
+            this->nodes.emplace_back(new NodeNull());
+        }
+        this->used += sizeof(NodeNull);
         return this->leave();
+    }
     case TokenType::BOOL:
         return this->handle_simple_token<TokenBool, NodeBool>(tok);
     case TokenType::INT:
         return this->handle_simple_token<TokenInt, NodeInt>(tok);
     case TokenType::FLOAT:
         return this->handle_simple_token<TokenFloat, NodeFloat>(tok);
+    case TokenType::NUMBER:
+        return this->handle_simple_token<TokenNumber, NodeNumber>(tok);
     case TokenType::STRING:
         return this->handle_simple_token<TokenString, NodeString>(tok);
     default:
         return this->unexpected_token(tok, {
             TokenType::LSQUARE, TokenType::LCURLY, TokenType ::NIL, TokenType::BOOL,
-            TokenType::INT, TokenType::FLOAT, TokenType::STRING,
+            TokenType::INT, TokenType::FLOAT, TokenType::NUMBER, TokenType::STRING,
         });
     }
 }
@@ -125,8 +167,18 @@ void Parser::st_json_end(const Token &tok) {
 
 void Parser::st_string(const Token &tok) {
     if (tok.type == TokenType::STRING) {
-        NodeString *node = new NodeString(static_cast<const TokenString&>(tok).value);
-        this->nodes.emplace_back(node);
+        const ustring &value = static_cast<const TokenString&>(tok).value;
+        if (this->interner == nullptr) {
+            this->used += sizeof(NodeKey) + control_block_size<NodeKey>() + payload_bytes(value);
+        }
+        const NodePair::KeyPtr *old = this->old_key();
+        if (old != nullptr && (*old)->value() == value) {
+            this->keys.push_back(*old);
+        } else if (this->interner != nullptr) {
+            this->keys.push_back(this->interner->intern(value));
+        } else {
+            this->keys.emplace_back(new NodeKey(this->take_value<TokenString>(tok)));
+        }
         this->leave();
     } else {
         this->unexpected_token(tok, {TokenType::STRING});
@@ -135,25 +187,66 @@ void Parser::st_string(const Token &tok) {
 
 
 void Parser::st_list(const Token &tok) {
-    NodeList *node = new NodeList();
-    this->nodes.emplace_back(node);
-    if (tok.type == TokenType::RSQUARE) {
+    Node::Ptr old = this->take_old();
+    bool empty = tok.type == TokenType::RSQUARE;
+    if (!empty && this->pack && old
+        && (old->type == NodeType::INT_ARRAY || old->type == NodeType::FLOAT_ARRAY))
+    {
+        // takes the numbers as an emptied list would, see pack_number()
+        if (old->type == NodeType::INT_ARRAY) {
+            static_cast<NodeIntArray &>(*old).value.clear();
+            this->used += sizeof(NodeIntArray);
+        } else {
+            static_cast<NodeFloatArray &>(*old).value.clear();
+            this->used += sizeof(NodeFloatArray);
+        }
+        this->nodes.push_back(move(old));
+    } else {
+        if (this->reusable(old, NodeType::LIST) && (!empty || child_count(*old) == 0)) {
+            this->nodes.push_back(move(old));
+        } else {
+            this->nodes.emplace_back(new NodeList());
+        }
+        this->used += sizeof(NodeList);
+        if (!empty || static_cast<NodeList &>(*this->nodes.back()).value.cache() != nullptr) {
+            this->used += list_body_size();
+        }
+    }
+
+    if (empty) {
         this->leave();
     } else {
+        this->enter_recycled();
         this->enter_list_item();
         this->feed(tok);
     }
 }
 
 
+// Numbers are appended to packed list directly, without creating nodes.
+void Parser::st_list_item(const Token &tok) {
+    if (this->pack_number(tok)) {
+        this->states.pop_back();
+        this->states.back() = &Parser::st_list_next;
+    } else {
+        this->states.back() = &Parser::st_json;
+        this->st_json(tok);
+    }
+}
+
+
 void Parser::st_list_end(const Token &tok) {
     Node::Ptr node = move(this->nodes.back());
     this->nodes.pop_back();
-    NodeList &list = static_cast<NodeList &>(*this->nodes.back());
-    list.value.push_back(move(node));
+    this->append_list_item(move(node));
+    this->st_list_next(tok);
+}
 
+
+void Parser::st_list_next(const Token &tok) {
     switch (tok.type) {
     case TokenType::RSQUARE:
+        this->leave_recycled();
         return this->leave();
     case TokenType::COMMA:
         return this->enter_list_item();
@@ -164,11 +257,25 @@ void Parser::st_list_end(const Token &tok) {
 
 
 void Parser::st_object(const Token &tok) {
-    NodeObject *node = new NodeObject();
-    this->nodes.emplace_back(node);
-    if (tok.type == TokenType::RCURLY) {
+    Node::Ptr old = this->take_old();
+    bool empty = tok.type == TokenType::RCURLY;
+    if (this->reusable(old, NodeType::OBJECT) && (!empty || child_count(*old) == 0)) {
+        this->nodes.push_back(move(old));
+    } else {
+        this->nodes.emplace_back(new NodeObject());
+    }
+    this->used += sizeof(NodeObject);
+    if (!empty || static_cast<NodeObject &>(*this->nodes.back()).pairs.hash_cache() != nullptr) {
+        this->used += PairVector::body_size();
+    }
+
+    if (empty) {
         this->leave();
     } else {
+        if (this->shapes != nullptr) {
+            this->objects.push_back(this->nodes.size() - 1);
+        }
+        this->enter_recycled();
         this->enter_object_item();
         this->feed(tok);
     }
@@ -178,6 +285,10 @@ void Parser::st_object(const Token &tok) {
 void Parser::st_object_end(const Token &tok) {
     switch (tok.type) {
     case TokenType::RCURLY:
+        if (this->shapes != nullptr) {
+            this->finish_object();
+        }
+        this->leave_recycled();
         return this->leave();
     case TokenType::COMMA:
         return this->enter_object_item();
@@ -198,16 +309,213 @@ void Parser::st_pair(const Token &tok) {
 
 
 void Parser::st_pair_end(const Token &tok) {
-    Node *value = this->nodes.back().release();
-    this->nodes.pop_back();
-    NodeString *key = static_cast<NodeString *>(this->nodes.back().release());
+    Recycled *frame = this->reusing ? &this->recycled.back() : nullptr;
+    if (this->shapes != nullptr) {
+        // keys and values are kept on stack until finish_object()
+        if (frame != nullptr) {
+            frame->next++;
+        }
+        this->leave();
+        return this->feed(tok);
+    }
+
+    Node::Ptr value = move(this->nodes.back());
     this->nodes.pop_back();
-    assert(key->type == NodeType::STRING);
 
     NodeObject &obj = static_cast<NodeObject &>(*this->nodes.back());
-    NodePair *pair = new NodePair(NodeString::Ptr(key), Node::Ptr(value));
-    obj.pairs.emplace_back(pair);
+    if (frame != nullptr && frame->next < frame->size) {
+        NodePair &pair = *obj.pairs[frame->next];
+        pair.key = move(this->keys.back());
+        pair.value = move(value);
+    } else {
+        obj.pairs.emplace_back(new NodePair(move(this->keys.back()), move(value)));
+    }
+    this->keys.pop_back();
+    if (frame != nullptr) {
+        frame->next++;
+    }
+    this->used += sizeof(NodePair) + sizeof(NodePair::Ptr);
 
     this->leave();
     this->feed(tok);
 }
+
+
+void Parser::finish_object() {
+    size_t pos = this->objects.back();
+    this->objects.pop_back();
+    size_t count = this->nodes.size() - pos - 1;
+    const NodePair::KeyPtr *keys = &this->keys[this->keys.size() - count];
+
+    NodeObject &obj = static_cast<NodeObject &>(*this->nodes[pos]);
+    ShapePtr shape = this->shapes->get(keys, count);
+    if (shape) {
+        vector<Node::Ptr> values;
+        values.reserve(count);
+        for (size_t i = pos + 1; i < this->nodes.size(); ++i) {
+            values.push_back(move(this->nodes[i]));
+        }
+        obj.pairs.set_shape(shape, move(values));
+        this->used += count * sizeof(Node::Ptr);
+    } else {
+        obj.pairs.clear();      // a reused object
+        obj.pairs.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            obj.pairs.emplace_back(new NodePair(move(keys[i]), move(this->nodes[pos + 1 + i])));
+        }
+        this->used += count * (sizeof(NodePair) + sizeof(NodePair::Ptr));
+    }
+
+    this->nodes.resize(pos + 1);
+    this->keys.resize(this->keys.size() - count);
+}
+
+
+bool Parser::pack_number(const Token &tok) {
+    Node::Ptr &list = this->nodes.back();
+    bool empty = list->type == NodeType::LIST && (this->reusing
+        ? this->recycled.back().next == 0 : static_cast<NodeList &>(*list).value.empty());
+    if (tok.type == TokenType::INT) {
+        if (empty) {
+            list.reset(new NodeIntArray());
+            this->used += sizeof(NodeIntArray);
+            this->used -= sizeof(NodeList) + list_body_size();
+            this->drop_recycled();
+        }
+        if (list->type == NodeType::INT_ARRAY) {
+            static_cast<NodeIntArray &>(*list).value.push_back(
+                static_cast<const TokenInt &>(tok).value);
+            this->used += sizeof(int64_t);
+            return true;
+        }
+    } else if (tok.type == TokenType::FLOAT) {
+        if (empty) {
+            list.reset(new NodeFloatArray());
+            this->used += sizeof(NodeFloatArray);
+            this->used -= sizeof(NodeList) + list_body_size();
+            this->drop_recycled();
+        }
+        if (list->type == NodeType::FLOAT_ARRAY) {
+            static_cast<NodeFloatArray &>(*list).value.push_back(
+                static_cast<const TokenFloat &>(tok).value);
+            this->used += sizeof(double);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// Packed list is converted to NodeList if item is not packable.
+// The numbers become pointers of the same size to new nodes.
+void Parser::append_list_item(Node::Ptr &&item) {
+    Node::Ptr &list = this->nodes.back();
+    if (list->type == NodeType::INT_ARRAY) {
+        const NodeIntArray &array = static_cast<NodeIntArray &>(*list);
+        this->used += sizeof(NodeList) + list_body_size() + array.value.size() * sizeof(NodeInt);
+        this->used -= sizeof(NodeIntArray);
+        list.reset(array.to_list());
+    } else if (list->type == NodeType::FLOAT_ARRAY) {
+        const NodeFloatArray &array = static_cast<NodeFloatArray &>(*list);
+        this->used += sizeof(NodeList) + list_body_size()
+            + array.value.size() * sizeof(NodeFloat);
+        this->used -= sizeof(NodeFloatArray);
+        list.reset(array.to_list());
+    }
+    NodeList &node = static_cast<NodeList &>(*list);
+    Recycled *frame = this->reusing ? &this->recycled.back() : nullptr;
+    if (frame != nullptr && frame->size == 0) {
+        frame->next = node.value.size();    // packed numbers
+    }
+    if (frame != nullptr && frame->next < frame->size) {
+        node.value[frame->next] = move(item);
+    } else {
+        node.value.push_back(move(item));
+    }
+    if (frame != nullptr) {
+        frame->next++;
+    }
+    this->used += sizeof(Node::Ptr);
+}
+
+
+// The old node for the next value, nullptr if there is none.
+Node::Ptr Parser::take_old() {
+    if (this->recycled.empty()) {
+        return move(this->old_root);
+    }
+    Recycled &frame = this->recycled.back();
+    if (frame.next >= frame.size) {
+        return Node::Ptr();
+    }
+    Node &node = *this->nodes[frame.pos];
+    if (node.type == NodeType::LIST) {
+        return move(static_cast<NodeList &>(node).value[frame.next]);
+    }
+    return move(static_cast<NodeObject &>(node).pairs.value(frame.next));
+}
+
+
+// The old key for the next pair.
+const NodePair::KeyPtr *Parser::old_key() const {
+    if (!this->reusing) {
+        return nullptr;
+    }
+    const Recycled &frame = this->recycled.back();
+    if (frame.next >= frame.size) {
+        return nullptr;
+    }
+    return &static_cast<const NodeObject &>(*this->nodes[frame.pos]).pairs.key(frame.next);
+}
+
+
+// Shared children would be copied on write, and the shape of an object is dropped
+// by converting it to pairs.
+bool Parser::reusable(const Node::Ptr &old, NodeType type) const {
+    if (!old || old->type != type) {
+        return false;
+    } else if (type == NodeType::LIST) {
+        return !static_cast<const NodeList &>(*old).value.shared();
+    }
+    const PairVector &pairs = static_cast<const NodeObject &>(*old).pairs;
+    return !pairs.shared() && (this->shapes != nullptr || !pairs.get_shape());
+}
+
+
+// For the container on top of nodes.
+void Parser::enter_recycled() {
+    if (this->reusing) {
+        size_t pos = this->nodes.size() - 1;
+        this->recycled.push_back(Recycled{pos, child_count(*this->nodes[pos]), 0});
+    }
+}
+
+
+// The old list on top of nodes was replaced.
+void Parser::drop_recycled() {
+    if (this->reusing) {
+        this->recycled.back().size = 0;
+    }
+}
+
+
+// Drops the old children left.
+void Parser::leave_recycled() {
+    if (!this->reusing) {
+        return;
+    }
+    Recycled &frame = this->recycled.back();
+    Node &node = *this->nodes[frame.pos];
+    if (node.type == NodeType::LIST) {
+        NodeList &list = static_cast<NodeList &>(node);
+        while (list.value.size() > frame.next) {
+            list.value.pop_back();
+        }
+    } else if (node.type == NodeType::OBJECT && this->shapes == nullptr) {
+        PairVector &pairs = static_cast<NodeObject &>(node).pairs;
+        while (pairs.size() > frame.next) {
+            pairs.pop_back();
+        }
+    }
+    this->recycled.pop_back();
+}
@@ -1,6 +1,9 @@
 #ifndef JSON_CXX_PARSER_H
 #define JSON_CXX_PARSER_H
 
+#include <cstddef>
+#include <cstdint>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -8,14 +11,21 @@
 #include "scanner.h"
 
 
+using std::basic_string;
 using std::move;
 using std::vector;
 
 
+class KeyInterner;
+class ShapeTable;
+
+
 class Parser {
 public:
     Parser() : states({&Parser::st_json}) {}
     void feed(const Token &tok);
+    // Same, but string values are moved out of the token instead of copied.
+    void feed(Token &&tok);
     Node::Ptr pop_result();
     bool is_finished() const;
     void reset();
@@ -25,10 +35,69 @@ public:
         return *this;
     }
 
+    // Share object keys through the interner, which must outlive the parser.
+    // Can be shared by parsers in different threads.
+    Parser &intern_keys(KeyInterner *value) {
+        this->interner = value;
+        return *this;
+    }
+
+    // Store objects with the same key layout as (shared shape, values),
+    // the table must outlive the parser.
+    Parser &use_shapes(ShapeTable *value) {
+        this->shapes = value;
+        return *this;
+    }
+
+    // Store lists of only integers or only floats as NodeIntArray or NodeFloatArray.
+    Parser &pack_numbers(bool value) {
+        this->pack = value;
+        return *this;
+    }
+
+    // Build the next documents into old, the result of a previous parse: its nodes,
+    // child arrays, pairs, keys and string buffers are reused where the structure
+    // is the same, new nodes are allocated only where it differs. Until reset().
+    Parser &reuse(Node::Ptr &&old) {
+        this->old_root = move(old);
+        this->reusing = true;
+        return *this;
+    }
+
+    // Throws BudgetExceeded once bytes_used() exceeds value.
+    Parser &byte_budget(size_t value) {
+        this->budget = value;
+        return *this;
+    }
+
+    // Heap bytes of the nodes built so far, like MemoryUsage::requested() without the unused
+    // capacity. Keys dropped for a shape are counted too.
+    size_t bytes_used() const {
+        return this->used;
+    }
+
 private:
+    // A container built in place of an old one, see reuse().
+    struct Recycled {
+        size_t pos;     // in nodes
+        size_t size;    // old children left in place
+        size_t next;    // children built
+    };
+
     vector<void (Parser::*)(const Token &)> states;
     vector<Node::Ptr> nodes;
+    vector<NodePair::KeyPtr> keys;
+    vector<size_t> objects;     // positions of unfinished objects in nodes, for shapes
     bool comment = false;
+    bool pack = false;
+    KeyInterner *interner = nullptr;
+    ShapeTable *shapes = nullptr;
+    size_t used = 0;
+    size_t budget = SIZE_MAX;
+    bool reusing = false;
+    Node::Ptr old_root;
+    vector<Recycled> recycled;
+    const Token *movable = nullptr;     // the token passed to feed(Token &&)
 
     void unexpected_token(const Token &tok, const vector<TokenType> &expected);
     void enter_json();
@@ -38,21 +107,74 @@ private:
     void enter_object_item();
     void enter_pair();
     void leave();
+    void finish_object();
+    bool pack_number(const Token &tok);
+    void append_list_item(Node::Ptr &&item);
+    Node::Ptr take_old();
+    const NodePair::KeyPtr *old_key() const;
+    bool reusable(const Node::Ptr &old, NodeType type) const;
+    void enter_recycled();
+    void drop_recycled();
+    void leave_recycled();
+
+    template<class ValueType, NodeType node_type>
+    static void assign(SimpleNode<ValueType, node_type> &node, const ValueType &value) {
+        node.value = value;
+    }
+
+    static void assign(NodeString &node, const ustring &value) {
+        node.assign(value);
+    }
+
+    static void assign(NodeNumber &node, const string &lexeme) {
+        node.lexeme = lexeme;
+    }
+
+    template<class T>
+    static size_t payload_bytes(const T &) {
+        return 0;
+    }
+
+    // strings short enough to be stored inline have none
+    template<class C>
+    static size_t payload_bytes(const basic_string<C> &value) {
+        const char *data = reinterpret_cast<const char *>(value.data());
+        const char *begin = reinterpret_cast<const char *>(&value);
+        return data >= begin && data < begin + sizeof(value) ? 0 : value.size() * sizeof(C);
+    }
 
     void st_json(const Token &tok);
     void st_json_end(const Token &tok);
     void st_string(const Token &tok);
     void st_list(const Token &tok);
+    void st_list_item(const Token &tok);
     void st_list_end(const Token &tok);
+    void st_list_next(const Token &tok);
     void st_pair(const Token &tok);
     void st_pair_end(const Token &tok);
     void st_object(const Token &tok);
     void st_object_end(const Token &tok);
 
+    // The value of tok, moved out if tok was passed to feed(Token &&).
+    template<class Tokenclass>
+    decltype(Tokenclass::value) take_value(const Token &tok) const {
+        if (&tok == this->movable) {
+            return move(const_cast<Tokenclass &>(static_cast<const Tokenclass &>(tok)).value);
+        }
+        return static_cast<const Tokenclass &>(tok).value;
+    }
+
     template<class Tokenclass, class NodeClass>
     void handle_simple_token(const Token &tok) {
-        NodeClass *node = new NodeClass(static_cast<const Tokenclass &>(tok).value);
-        this->nodes.emplace_back(node);
+        const auto &value = static_cast<const Tokenclass &>(tok).value;
+        this->used += sizeof(NodeClass) + payload_bytes(value);
+        Node::Ptr old = this->take_old();
+        if (old && old->type == NodeClass::TYPE) {
+            assign(static_cast<NodeClass &>(*old), value);     // keeps the string buffer
+            this->nodes.push_back(move(old));
+        } else {
+            this->nodes.emplace_back(new NodeClass(this->take_value<Tokenclass>(tok)));
+        }
         this->states.pop_back();
     }
 };
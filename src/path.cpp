@@ -0,0 +1,100 @@
+#include <stdexcept>
+
+#include "path.h"
+
+
+using std::out_of_range;
+
+
+string path_repr(const NodePath &path) {
+    string ans;
+    for (const PathStep &step : path) {
+        if (step.is_key) {
+            ans += "[\"" + u8_encode(step.key) + "\"]";
+        } else {
+            ans += "[" + to_string(step.index) + "]";
+        }
+    }
+    return ans;
+}
+
+
+const Node *find_path(const Node &root, const NodePath &path) {
+    const Node *node = &root;
+    for (const PathStep &step : path) {
+        if (step.is_key && node->type == NodeType::OBJECT) {
+            node = static_cast<const NodeObject *>(node)->find(step.key);
+        } else if (!step.is_key && node->type == NodeType::LIST) {
+            const NodeList *list = static_cast<const NodeList *>(node);
+            node = step.index < list->value.size() ? list->value[step.index].get() : nullptr;
+        } else {
+            node = nullptr;
+        }
+        if (node == nullptr) {
+            return nullptr;
+        }
+    }
+    return node;
+}
+
+
+// Replaces a packed number array by the equal NodeList.
+static void unpack(Node::Ptr &slot) {
+    if (slot->type == NodeType::INT_ARRAY) {
+        slot.reset(static_cast<const NodeIntArray &>(*slot).to_list());
+    } else if (slot->type == NodeType::FLOAT_ARRAY) {
+        slot.reset(static_cast<const NodeFloatArray &>(*slot).to_list());
+    }
+}
+
+
+// The child of node at step, nullptr if not found.
+// Non-const access to the children detaches them if shared.
+static Node::Ptr *child_slot(Node &node, const PathStep &step, bool append) {
+    if (step.is_key && node.type == NodeType::OBJECT) {
+        NodeObject &obj = static_cast<NodeObject &>(node);
+        size_t pos = obj.index_of(step.key);
+        if (pos == obj.pairs.size()) {
+            if (!append) {
+                return nullptr;
+            }
+            obj.pairs.emplace_back(new NodePair(NodePair::KeyPtr(new NodeKey(step.key)), nullptr));
+        }
+        return &obj.pairs.value(pos);
+    } else if (!step.is_key && node.type == NodeType::LIST) {
+        NodeList &list = static_cast<NodeList &>(node);
+        return step.index < list.value.size() ? &list.value[step.index] : nullptr;
+    }
+    return nullptr;
+}
+
+
+// Walks path[from:] from slot, nullptr if not found.
+static Node::Ptr *find_slot(Node::Ptr *slot, const NodePath &path, size_t from, bool append) {
+    for (size_t i = from; i < path.size() && slot != nullptr; ++i) {
+        unpack(*slot);
+        slot = child_slot(**slot, path[i], append && i + 1 == path.size());
+    }
+    return slot;
+}
+
+
+Node *find_path(Node &root, const NodePath &path) {
+    if (path.empty()) {
+        return &root;
+    }
+    // root is not owned by a slot here, so it is not unpacked
+    Node::Ptr *slot = find_slot(child_slot(root, path[0], false), path, 1, false);
+    return slot == nullptr ? nullptr : slot->get();
+}
+
+
+Node::Ptr replace_path(const FrozenNode &root, const NodePath &path, Node::Ptr &&value) {
+    Node::Ptr ans(share_node(*root));
+    Node::Ptr *slot = find_slot(&ans, path, 0, true);
+    if (slot == nullptr) {
+        throw out_of_range("path not found: " + path_repr(path));
+    }
+    *slot = move(value);
+    return ans;
+}
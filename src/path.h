@@ -0,0 +1,47 @@
+#ifndef JSON_CXX_PATH_H
+#define JSON_CXX_PATH_H
+
+
+#include <string>
+#include <vector>
+
+#include "document.h"
+#include "node.h"
+
+
+using std::string;
+using std::vector;
+
+
+// Object key or list index.
+struct PathStep {
+    PathStep(const ustring &key) : key(key), index(0), is_key(true) {}
+    PathStep(size_t index) : index(index), is_key(false) {}
+
+    ustring key;
+    size_t index;
+    bool is_key;
+};
+
+
+typedef vector<PathStep> NodePath;
+
+
+// e.g. ["a"][0]
+string path_repr(const NodePath &path);
+
+// Returns nullptr if not found. The const version does not step into packed
+// number arrays, the non-const version unpacks them and detaches shared
+// children along the path, so the result can be modified.
+const Node *find_path(const Node &root, const NodePath &path);
+Node *find_path(Node &root, const NodePath &path);
+
+// A new version of root with the node at path replaced by value.
+// Only the path is copied, the rest is shared with root, see NodeVector.
+// root is frozen, so the shared children can only be modified through the result,
+// which copies them first.
+// A missing key at the last step is appended, other missing steps throw std::out_of_range.
+Node::Ptr replace_path(const FrozenNode &root, const NodePath &path, Node::Ptr &&value);
+
+
+#endif //JSON_CXX_PATH_H
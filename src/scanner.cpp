@@ -1,5 +1,6 @@
 #include <cassert>
 #include <cmath>
+#include <cstdlib>
 #include <limits>
 #include <memory>
 #include <string>
@@ -8,6 +9,7 @@
 #include "exceptions.h"
 #include "scanner.h"
 #include "node.h"
+#include "number.h"
 #include "utils.hpp"
 
 
@@ -99,6 +101,18 @@ string TokenFloat::repr_value() const {
 }
 
 
+template<>
+string TokenNumber::name() const {
+    return "Number";
+}
+
+
+template<>
+string TokenNumber::repr_value() const {
+    return this->value;
+}
+
+
 template<>
 string TokenString::name() const {
     return "Str";
@@ -162,7 +176,9 @@ Token::Ptr Scanner::pop() {
 
 
 void Scanner::reset() {
+    bool lazy = this->lazy;
     *this = Scanner();
+    this->lazy = lazy;
 }
 
 
@@ -236,9 +252,14 @@ void Scanner::st_id(CharConf::CharType ch) {
 void Scanner::st_number(CharConf::CharType ch) {
     // TODO: limit length
     NumberState &ns = this->num_state;
+    if (ns.state != NumberSubState::INIT) {
+        ns.lexeme.push_back(static_cast<char>(ch));     // popped by finish_num()
+    }
+
     if (ns.state == NumberSubState::INIT) {
         ns.state = NumberSubState::SIGNED;
         if (ch == '-') {
+            ns.lexeme.push_back('-');
             ns.num_sign = -1;
         } else {
             this->st_number(ch);
@@ -327,7 +348,7 @@ void Scanner::st_string(CharConf::CharType ch) {
         }
     } else if (ss.state == StringSubState::NORMAL) {
         if (ch == '"') {
-            Token *tok = new TokenString(ss.value);
+            Token *tok = new TokenString(move(ss.value));
             tok->start = this->start_pos;
             tok->end = this->cur_pos;
             this->buffer.emplace_back(tok);
@@ -500,7 +521,8 @@ void Scanner::unknown_char(CharConf::CharType ch, const string &additional) {
 
 
 void Scanner::finish_num(CharConf::CharType ch) {
-    Token *tok = this->num_state.to_token();
+    this->num_state.lexeme.pop_back();
+    Token *tok = this->lazy ? new TokenNumber(this->num_state.lexeme) : this->num_state.to_token();
     tok->start = this->start_pos;
     tok->end = this->prev_pos;
     this->buffer.emplace_back(tok);
@@ -523,25 +545,16 @@ static T string_to_number(const string &digits) {
 
 
 Token *NumberState::to_token() const {
-    int64_t iv = string_to_number<int64_t>(this->int_digits);
-    double fv = string_to_number<double>(this->int_digits);
-
-    fv += string_to_number<double>(this->dot_digits) \
-        * pow(10, -static_cast<double>(this->dot_digits.size()));
-
-    if (!this->exp_digits.empty()) {
-        double exp = string_to_number<double>(this->exp_digits) * this->exp_sign;   // inf
-        fv *= pow(10, exp);     // inf
-        iv *= pow(10, exp);
-    }
-
-    iv *= this->num_sign;
-    fv *= this->num_sign;
+    double fv = c_strtod(this->lexeme.data());   // correctly rounded
 
     if (this->dot_digits.empty() && this->exp_sign > 0
         && numeric_limits<int64_t>::min() < fv && fv < numeric_limits<int64_t>::max())
     {
-        return new TokenInt(iv);
+        int64_t iv = string_to_number<int64_t>(this->int_digits);
+        if (!this->exp_digits.empty()) {
+            iv *= pow(10, string_to_number<double>(this->exp_digits));
+        }
+        return new TokenInt(iv * this->num_sign);
     } else {
         return new TokenFloat(fv);  // TODO: handle inf
     }
@@ -7,6 +7,7 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <utility>
 
 #include "sourcepos.h"
 #include "unicode.h"
@@ -14,6 +15,7 @@
 
 using std::deque;
 using std::map;
+using std::move;
 using std::string;
 using std::unique_ptr;
 
@@ -29,6 +31,7 @@ enum class TokenType : char {
     BOOL    = 'b',
     INT     = 'i',
     FLOAT   = 'f',
+    NUMBER  = 'N',
     STRING  = 's',
     LSQUARE = '[',
     RSQUARE = ']',
@@ -72,7 +75,7 @@ public:
     typedef ExtendedToken<ValueType, tok_type> _SelfType;
     typedef unique_ptr<_SelfType> Ptr;
 
-    explicit ExtendedToken(const ValueType &value) : Token(tok_type), value(value) {}
+    explicit ExtendedToken(ValueType value) : Token(tok_type), value(move(value)) {}
 
     virtual string name() const;
     virtual string repr_value() const;
@@ -100,6 +103,7 @@ public:
 typedef ExtendedToken<bool, TokenType::BOOL> TokenBool;
 typedef ExtendedToken<int64_t, TokenType::INT> TokenInt;
 typedef ExtendedToken<double, TokenType::FLOAT> TokenFloat;
+typedef ExtendedToken<string, TokenType::NUMBER> TokenNumber;  // unconverted lexeme
 typedef ExtendedToken<CharConf::StringType, TokenType::STRING> TokenString;
 typedef ExtendedToken<CharConf::StringType, TokenType::COMMENT> TokenComment;
 
@@ -130,6 +134,7 @@ enum class NumberSubState {
 struct NumberState {
     NumberSubState state = NumberSubState::INIT;
 
+    string lexeme;
     string int_digits;
     string dot_digits;
     string exp_digits;
@@ -186,6 +191,12 @@ public:
         return this->state == ScannerState::INIT;
     }
 
+    // Emit TokenNumber with the validated lexeme instead of TokenInt or TokenFloat.
+    Scanner &lazy_numbers(bool value) {
+        this->lazy = value;
+        return *this;
+    }
+
 private:
     void refeed(CharConf::CharType ch);
     void st_init(CharConf::CharType ch);
@@ -202,6 +213,7 @@ private:
     void unknown_char(CharConf::CharType ch, const string &additional = "");
 
     ScannerState state = ScannerState::INIT;
+    bool lazy = false;
     deque<Token::Ptr> buffer;
     SourcePos start_pos;
     SourcePos prev_pos;
@@ -0,0 +1,46 @@
+#include "shape.h"
+
+
+static bool same_keys(const ObjectShape &shape, const NodePair::KeyPtr *keys, size_t count) {
+    if (shape.keys.size() != count) {
+        return false;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        const NodePair::KeyPtr &key = shape.keys[i];
+        if (key != keys[i]
+            && (key->key_hash != keys[i]->key_hash || key->value() != keys[i]->value()))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+ShapePtr ShapeTable::get(const NodePair::KeyPtr *keys, size_t count) {
+    if (count == 0 || count > this->max_keys) {
+        return ShapePtr();
+    }
+
+    size_t hash = count;
+    for (size_t i = 0; i < count; ++i) {
+        hash = hash_combine(hash, keys[i]->key_hash);
+    }
+
+    auto it = this->shapes.find(hash);
+    if (it != this->shapes.end()) {
+        for (const ShapePtr &shape : it->second) {
+            if (same_keys(*shape, keys, count)) {
+                return shape;
+            }
+        }
+    }
+
+    if (this->count >= this->max_shapes) {
+        return ShapePtr();
+    }
+    this->count++;
+    vector<ShapePtr> &bucket = this->shapes[hash];
+    bucket.emplace_back(new ObjectShape(vector<NodePair::KeyPtr>(keys, keys + count)));
+    return bucket.back();
+}
@@ -0,0 +1,37 @@
+#ifndef JSON_CXX_SHAPE_H
+#define JSON_CXX_SHAPE_H
+
+
+#include <unordered_map>
+#include <vector>
+
+#include "node.h"
+
+
+using std::unordered_map;
+using std::vector;
+
+
+// Shares key layouts between objects, see Parser::use_shapes().
+// Not thread safe, use one table per parser thread.
+class ShapeTable {
+public:
+    explicit ShapeTable(size_t max_shapes = 4096, size_t max_keys = 256)
+        : max_shapes(max_shapes), max_keys(max_keys)
+    {}
+
+    // Returns an empty pointer if the layout should not be shared.
+    ShapePtr get(const NodePair::KeyPtr *keys, size_t count);
+    size_t size() const {
+        return this->count;
+    }
+
+private:
+    size_t max_shapes;
+    size_t max_keys;
+    size_t count = 0;
+    unordered_map<size_t, vector<ShapePtr>> shapes;
+};
+
+
+#endif //JSON_CXX_SHAPE_H
@@ -0,0 +1,156 @@
+#include <algorithm>
+#include <cerrno>
+#include <system_error>
+#include <unistd.h>
+
+#include "sink.h"
+
+
+using std::generic_category;
+using std::max;
+using std::min;
+using std::system_error;
+
+
+void Sink::fill(char ch, size_t count) {
+    while (count > 0) {
+        if (this->pos == this->end) {
+            this->make_room(count);
+        }
+        size_t n = min(count, static_cast<size_t>(this->end - this->pos));
+        memset(this->pos, ch, n);
+        this->pos += n;
+        count -= n;
+    }
+}
+
+
+// in chunks if size is larger than the buffer
+void Sink::write_slow(const char *data, size_t size) {
+    while (size > 0) {
+        if (this->pos == this->end) {
+            this->make_room(size);
+        }
+        size_t n = min(size, static_cast<size_t>(this->end - this->pos));
+        memcpy(this->pos, data, n);
+        this->pos += n;
+        data += n;
+        size -= n;
+    }
+}
+
+
+StringSink::StringSink(size_t capacity) {
+    this->reserve(capacity);
+}
+
+
+string StringSink::take() {
+    this->buffer.resize(this->size());
+    string ans = move(this->buffer);
+    this->buffer = string();
+    this->begin = this->pos = this->end = nullptr;
+    return ans;
+}
+
+
+void StringSink::reserve(size_t capacity) {
+    if (capacity > this->buffer.capacity()) {
+        size_t used = this->size();
+        this->buffer.reserve(capacity);
+        this->set_buffer(used);
+    }
+}
+
+
+// The string can only be written within its size, which grows by a chunk at a time,
+// so the capacity is not filled with zeros long before it is written.
+static const size_t STRING_CHUNK = 4096;
+
+
+void StringSink::make_room(size_t size) {
+    size_t used = this->size();
+    if (used + size > this->buffer.capacity()) {
+        this->buffer.reserve(max(used + size, max<size_t>(2 * this->buffer.capacity(), 256)));
+    }
+    this->buffer.resize(min(this->buffer.capacity(), used + max(size, STRING_CHUNK)));
+    this->set_buffer(used);
+}
+
+
+void StringSink::set_buffer(size_t used) {
+    this->begin = &this->buffer[0];
+    this->pos = this->begin + used;
+    this->end = this->begin + this->buffer.size();
+}
+
+
+CountingSink::CountingSink() {
+    this->begin = this->pos = this->buffer;
+    this->end = this->buffer + sizeof(this->buffer);
+}
+
+
+void CountingSink::make_room(size_t) {
+    this->counted += static_cast<size_t>(this->pos - this->begin);
+    this->pos = this->begin;
+}
+
+
+BufferedSink::BufferedSink(char *buffer, size_t size, Callback callback)
+    : callback(move(callback))
+{
+    this->set_buffer(buffer, size);
+}
+
+
+void BufferedSink::flush() {
+    if (this->pos != this->begin) {
+        this->callback(this->begin, static_cast<size_t>(this->pos - this->begin));
+        this->pos = this->begin;
+    }
+}
+
+
+void BufferedSink::set_buffer(char *buffer, size_t size) {
+    this->begin = this->pos = buffer;
+    this->end = buffer + size;
+}
+
+
+void BufferedSink::make_room(size_t) {
+    this->flush();
+}
+
+
+static void write_fd(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = ::write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw system_error(errno, generic_category(), "write");
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+}
+
+
+FdSink::FdSink(int fd)
+    : BufferedSink([fd](const char *data, size_t size) { write_fd(fd, data, size); })
+{
+    const size_t size = 64 * 1024;
+    this->buffer.reset(new char[size]);
+    this->set_buffer(this->buffer.get(), size);
+}
+
+
+OstreamSink::OstreamSink(ostream &os)
+    : BufferedSink([&os](const char *data, size_t size) {
+        os.write(data, static_cast<std::streamsize>(size));
+    })
+{
+    this->set_buffer(this->buffer, sizeof(this->buffer));
+}
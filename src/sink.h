@@ -0,0 +1,168 @@
+#ifndef JSON_CXX_SINK_H
+#define JSON_CXX_SINK_H
+
+
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <utility>
+
+
+using std::function;
+using std::memcpy;
+using std::move;
+using std::ostream;
+using std::string;
+using std::strlen;
+using std::unique_ptr;
+
+
+// Output of the Formatter. Writes go to a contiguous buffer,
+// make_room() is called only when the buffer is full.
+class Sink {
+public:
+    Sink() {}
+    Sink(const Sink &) = delete;
+    Sink &operator=(const Sink &) = delete;
+    virtual ~Sink() {}
+
+    void put(char ch) {
+        if (this->pos == this->end) {
+            this->make_room(1);
+        }
+        *this->pos++ = ch;
+    }
+
+    void write(const char *data, size_t size) {
+        if (size <= static_cast<size_t>(this->end - this->pos)) {
+            memcpy(this->pos, data, size);
+            this->pos += size;
+        } else {
+            this->write_slow(data, size);
+        }
+    }
+
+    void write(const char *str) {
+        this->write(str, strlen(str));
+    }
+
+    void write(const string &str) {
+        this->write(str.data(), str.size());
+    }
+
+    void fill(char ch, size_t count);
+
+    // Passes the buffered output on, to be called once done writing.
+    virtual void flush() {}
+
+protected:
+    // Flushes the buffer, or grows it to hold at least size more bytes.
+    virtual void make_room(size_t size) = 0;
+
+    char *begin = nullptr;
+    char *pos = nullptr;
+    char *end = nullptr;
+
+private:
+    void write_slow(const char *data, size_t size);
+};
+
+
+// Growable contiguous buffer.
+class StringSink : public Sink {
+public:
+    explicit StringSink(size_t capacity = 0);
+
+    size_t size() const {
+        return static_cast<size_t>(this->pos - this->begin);
+    }
+
+    const char *data() const {
+        return this->begin;
+    }
+
+    string str() const {
+        return string(this->begin, this->pos);
+    }
+
+    // The output so far, the sink is empty afterwards.
+    string take();
+    void reserve(size_t capacity);
+
+protected:
+    virtual void make_room(size_t size);
+
+private:
+    void set_buffer(size_t used);
+
+    string buffer;
+};
+
+
+// Counts the bytes written and drops them, see Formatter::measure().
+class CountingSink : public Sink {
+public:
+    CountingSink();
+
+    size_t count() const {
+        return this->counted + static_cast<size_t>(this->pos - this->begin);
+    }
+
+    // Counts size bytes without writing them.
+    void skip(size_t size) {
+        this->counted += size;
+    }
+
+protected:
+    virtual void make_room(size_t size);
+
+private:
+    size_t counted = 0;
+    char buffer[256];
+};
+
+
+// Buffer of a fixed size, passed to a callback when full and on flush().
+class BufferedSink : public Sink {
+public:
+    typedef function<void (const char *data, size_t size)> Callback;
+
+    BufferedSink(char *buffer, size_t size, Callback callback);
+
+    virtual void flush();
+
+protected:
+    explicit BufferedSink(Callback callback) : callback(move(callback)) {}
+    void set_buffer(char *buffer, size_t size);
+    virtual void make_room(size_t size);
+
+private:
+    Callback callback;
+};
+
+
+// Writes to a file descriptor in chunks of 64 KiB, throws std::system_error.
+class FdSink : public BufferedSink {
+public:
+    // Unflushed output is lost on destruction.
+    explicit FdSink(int fd);
+
+private:
+    unique_ptr<char[]> buffer;
+};
+
+
+// For the ostream overloads.
+class OstreamSink : public BufferedSink {
+public:
+    explicit OstreamSink(ostream &os);
+
+private:
+    char buffer[4096];
+};
+
+
+#endif //JSON_CXX_SINK_H
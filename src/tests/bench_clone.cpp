@@ -0,0 +1,65 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "helper.h"
+#include "../path.h"
+
+
+using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::move;
+using std::string;
+using std::to_string;
+
+
+// about 500 bytes per section
+static string make_config(size_t sections) {
+    string ans = "{";
+    for (size_t i = 0; i < sections; ++i) {
+        string n = to_string(i);
+        ans += i == 0 ? "" : ", ";
+        ans += "\"service" + n + "\": {"
+            "\"name\": \"service-" + n + "\", \"enabled\": true, \"port\": " + to_string(8000 + i)
+            + ", \"timeouts\": {\"connect\": 1.5, \"read\": 30, \"write\": 30},"
+            " \"hosts\": [\"a" + n + ".example.com\", \"b" + n + ".example.com\"],"
+            " \"limits\": {\"rps\": 1000, \"burst\": 200, \"queue\": 64},"
+            " \"tags\": [\"prod\", \"http\", \"internal\"],"
+            " \"retry\": {\"attempts\": 3, \"backoff\": [0.1, 0.2, 0.4, 0.8]},"
+            " \"owner\": {\"team\": \"platform\", \"email\": \"platform@example.com\"}}";
+    }
+    return ans + "}";
+}
+
+
+template<class Func>
+static double ns_per_op(size_t count, Func func) {
+    steady_clock::time_point start = steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        func(i);
+    }
+    duration<double, std::nano> elapsed = steady_clock::now() - start;
+    return elapsed.count() / count;
+}
+
+
+int main() {
+    string input = make_config(4000);
+    Node::Ptr config = parse_string(input);
+    printf("config: %zu bytes\n", input.size());
+
+    size_t sink = 0;
+    printf("clone:        %12.0f ns\n", ns_per_op(20, [&](size_t) {
+        Node::Ptr cloned(config->clone());
+        sink += cloned->type == NodeType::OBJECT;
+    }));
+    FrozenNode frozen = freeze(move(config));
+    printf("replace_path: %12.0f ns\n", ns_per_op(1000, [&](size_t i) {
+        NodePath path = {
+            u8_decode(("service" + to_string(i % 4000)).data()), USTRING("limits"), USTRING("rps")
+        };
+        Node::Ptr updated = replace_path(frozen, path, Node::Ptr(new NodeInt(i)));
+        sink += updated->type == NodeType::OBJECT;
+    }));
+    return sink == 0;
+}
@@ -0,0 +1,87 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "helper.h"
+#include "../document.h"
+
+
+using std::atomic;
+using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::string;
+using std::thread;
+using std::to_string;
+using std::vector;
+
+
+static const size_t N_KEYS = 10000;
+static const size_t LOOKUPS = 2000000;  // per thread
+
+
+static string make_doc(size_t version) {
+    string ans = "{\"version\": " + to_string(version);
+    for (size_t i = 0; i < N_KEYS; ++i) {
+        ans += ", \"key" + to_string(i) + "\": {\"id\": " + to_string(i)
+            + ", \"name\": \"item" + to_string(i) + "\", \"tags\": [\"a\", \"b\"]}";
+    }
+    return ans + "}";
+}
+
+
+// Lookups per second over all threads, with a writer reloading the document.
+static double run(DocumentHolder &holder, size_t n_threads) {
+    vector<ustring> keys;
+    for (size_t i = 0; i < N_KEYS; ++i) {
+        keys.push_back(u8_decode(("key" + to_string(i)).data()));
+    }
+    atomic<size_t> sink(0);
+    atomic<bool> done(false);
+    FrozenNode next = freeze(parse_string(make_doc(1)));
+    thread writer([&holder, &done, &next]() {
+        while (!done.load()) {
+            next = holder.reload(next);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    steady_clock::time_point start = steady_clock::now();
+    vector<thread> readers;
+    for (size_t t = 0; t < n_threads; ++t) {
+        readers.emplace_back([&holder, &keys, &sink, t]() {
+            size_t found = 0;
+            FrozenNode doc = holder.get();
+            for (size_t i = 0; i < LOOKUPS; ++i) {
+                if (i % 1024 == 0) {
+                    doc = holder.get();     // a snapshot per batch of requests
+                }
+                const NodeObject &obj = static_cast<const NodeObject &>(*doc);
+                const Node *item = obj.find(keys[(i * 7919 + t) % N_KEYS]);
+                if (item != nullptr) {
+                    found += static_cast<const NodeObject &>(*item).find(USTRING("id")) != nullptr;
+                }
+            }
+            sink += found;
+        });
+    }
+    for (thread &th : readers) {
+        th.join();
+    }
+    duration<double> elapsed = steady_clock::now() - start;
+    done.store(true);
+    writer.join();
+    return sink.load() / elapsed.count();
+}
+
+
+int main() {
+    DocumentHolder holder(freeze(parse_string(make_doc(0))));
+    size_t max_threads = thread::hardware_concurrency();
+    for (size_t n = 1; n <= max_threads; n *= 2) {
+        printf("%3zu threads: %8.1f M lookups/s\n", n, run(holder, n) / 1e6);
+    }
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+#include <string>
+
+#include "helper.h"
+#include "../document.h"
+
+
+using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::ostringstream;
+using std::string;
+using std::to_string;
+
+
+template<class Func>
+static double ms(Func func) {
+    steady_clock::time_point start = steady_clock::now();
+    func();
+    duration<double, std::milli> elapsed = steady_clock::now() - start;
+    return elapsed.count();
+}
+
+
+static void run(const char *name, const string &input, Reclaimer &reclaimer) {
+    Node::Ptr node;
+    Node::Ptr other;
+    printf("%s, %zu bytes\n", name, input.size());
+    printf("  parse:   %10.1f ms\n", ms([&]() { node = parse_string(input); }));
+    other = parse_string(input);
+    size_t sink = 0;
+    printf("  hash:    %10.1f ms\n", ms([&]() { sink += node->hash(); }));
+    printf("  equal:   %10.1f ms\n", ms([&]() { sink += *node == *other; }));
+    printf("  format:  %10.1f ms\n", ms([&]() {
+        ostringstream os;
+        Formatter(FormatOption().indent(0)).format(os, *node);
+        sink += os.str().size();
+    }));
+    printf("  clone:   %10.1f ms\n", ms([&]() { sink += clone_node<Node>(*node)->hash(); }));
+    printf("  destroy: %10.1f ms\n", ms([&]() { node.reset(); }));
+    size_t bytes = reclaimer.reclaimed_bytes();
+    printf("  retire:  %10.1f ms\n", ms([&]() { reclaimer.retire(move(other)); }));
+    double drain = ms([&]() { reclaimer.drain(); });
+    printf("  drain:   %10.1f ms, %zu bytes\n", drain, reclaimer.reclaimed_bytes() - bytes);
+    if (sink == 0) {
+        printf("\n");
+    }
+}
+
+
+int main() {
+    const size_t n = 1000000;
+    Reclaimer reclaimer;
+    run("deep lists", string(n, '[') + string(n, ']'), reclaimer);
+
+    string objects;
+    for (size_t i = 0; i < n; ++i) {
+        objects += "{\"k\": [" + to_string(i) + ", ";
+    }
+    objects += "null";
+    for (size_t i = 0; i < n; ++i) {
+        objects += "]}";
+    }
+    run("deep objects", objects, reclaimer);
+
+    string wide = "[";
+    for (size_t i = 0; i < n; ++i) {
+        wide += (i == 0 ? "{\"id\": " : ", {\"id\": ") + to_string(i) + ", \"tags\": [\"a\"]}";
+    }
+    run("wide list", wide + "]", reclaimer);
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+
+#include "helper.h"
+#include "../number.h"
+
+
+using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::pow;
+using std::mt19937_64;
+using std::string;
+using std::to_string;
+using std::uniform_real_distribution;
+using std::uniform_int_distribution;
+
+
+// coordinates, prices and measurements over many magnitudes
+static vector<double> make_floats(size_t n) {
+    mt19937_64 rng(1);
+    uniform_real_distribution<double> unit(-1, 1);
+    uniform_int_distribution<int> exp(-12, 12);
+    vector<double> ans;
+    for (size_t i = 0; i < n; ++i) {
+        switch (i % 3) {
+        case 0:
+            ans.push_back(unit(rng) * 180);
+            break;
+        case 1:
+            ans.push_back(static_cast<double>(rng() % 100000) / 100);
+            break;
+        default:
+            ans.push_back(unit(rng) * pow(10, exp(rng)));
+        }
+    }
+    return ans;
+}
+
+
+template<class Func>
+static void run(const char *name, const vector<double> &values, Func func) {
+    string output;
+    steady_clock::time_point start = steady_clock::now();
+    for (double value : values) {
+        func(output, value);
+        output += ',';
+    }
+    duration<double> elapsed = steady_clock::now() - start;
+    printf("%-12s %6.1f ns/float %9zu bytes\n",
+           name, elapsed.count() * 1e9 / values.size(), output.size());
+}
+
+
+int main() {
+    vector<double> values = make_floats(1000000);
+
+    run("to_string:", values, [](string &output, double value) {
+        output += to_string(value);
+    });
+    run("%.17g:", values, [](string &output, double value) {
+        char buf[DOUBLE_BUF_SIZE];
+        output.append(buf, static_cast<size_t>(snprintf(buf, sizeof(buf), "%.17g", value)));
+    });
+    run("precision 6:", values, [](string &output, double value) {
+        char buf[DOUBLE_BUF_SIZE];
+        output.append(buf, write_double(buf, value, 6));
+    });
+    run("shortest:", values, [](string &output, double value) {
+        char buf[DOUBLE_BUF_SIZE];
+        output.append(buf, write_double(buf, value));
+    });
+
+    // parse(format(x)) == x
+    NodeList list;
+    for (double value : values) {
+        list.value.emplace_back(new NodeFloat(value));
+    }
+    Node::Ptr parsed = parse_string(format_node(list));
+    printf("round trip: %s\n", *parsed == list ? "ok" : "FAILED");
+    return *parsed == list ? 0 : 1;
+}
@@ -0,0 +1,139 @@
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+
+#include "helper.h"
+#include "../document.h"
+#include "../path.h"
+
+
+using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::ostringstream;
+using std::string;
+using std::to_string;
+
+
+static string make_records(size_t n) {
+    string ans = "[";
+    for (size_t i = 0; i < n; ++i) {
+        string k = to_string(i);
+        ans += i == 0 ? "" : ", ";
+        ans += "{\"id\": " + k + ", \"name\": \"user " + k + "\", \"score\": " + k + ".25,"
+            " \"active\": true, \"email\": \"user" + k + "@example.com\", \"tags\": [\"a\", \"b\"],"
+            " \"bio\": \"line one\\nline \\\"two\\\" \\u00e9t\\u00e9\", \"parent\": null}";
+    }
+    return ans + "]";
+}
+
+
+template<class Func>
+static void run(const char *name, size_t bytes, Func func) {
+    const int rounds = 10;
+    steady_clock::time_point start = steady_clock::now();
+    for (int i = 0; i < rounds; ++i) {
+        func();
+    }
+    duration<double> elapsed = steady_clock::now() - start;
+    printf("%-10s %8.1f MB/s\n", name, bytes * rounds / elapsed.count() / 1e6);
+}
+
+
+int main() {
+    Node::Ptr node = parse_string(make_records(50000));
+    string output = node->repr();
+    size_t bytes = output.size();
+    printf("%zu bytes\n", bytes);
+
+    run("ostream:", bytes, [&]() {
+        ostringstream os;
+        Formatter().format(os, *node);
+        output = os.str();
+    });
+    run("string:", bytes, [&]() {
+        StringSink out;
+        Formatter().format(out, *node);
+        output = out.take();
+    });
+    int fd = open("/dev/null", O_WRONLY);
+    run("fd:", bytes, [&]() {
+        FdSink out(fd);
+        Formatter().format(out, *node);
+        out.flush();
+    });
+    close(fd);
+
+    FormatOption ascii = FormatOption().ensure_ascii(true);
+    run("ascii:", bytes, [&]() {
+        StringSink out;
+        Formatter(ascii).format(out, *node);
+        output = out.take();
+    });
+
+    FormatOption compact = FormatOption().compact(true);
+    string minified = format_node(*node, compact);
+    printf("%zu bytes compact\n", minified.size());
+    run("compact:", minified.size(), [&]() {
+        StringSink out;
+        Formatter(compact).format(out, *node);
+        minified = out.take();
+    });
+    FormatOption canonical = FormatOption().canonical(true);
+    run("canonical:", minified.size(), [&]() {
+        StringSink out;
+        Formatter(canonical).format(out, *node);
+        minified = out.take();
+    });
+    // with the sizes of a frozen tree cached, the buffer is allocated once
+    FrozenNode frozen = freeze(clone_node<Node>(*node));
+    Formatter::measure(*frozen, compact);
+    run("measured:", minified.size(), [&]() {
+        minified = Formatter(compact).to_string(*frozen);
+    });
+
+    // a field changed per response, the other records are copied from their fragments
+    FormatOption fragments = FormatOption().compact(true).fragment_size(4096);
+    size_t records = static_cast<const NodeList &>(*frozen).value.size();
+    size_t changes = 0;
+    format_node(*frozen, fragments);
+    run("fragments:", minified.size(), [&]() {
+        NodePath path = {changes++ * 7919 % records, USTRING("score")};
+        Node::Ptr updated = replace_path(frozen, path, Node::Ptr(new NodeInt(-1)));
+        minified = Formatter(fragments).to_string(*updated);
+    });
+
+    // metrics exports are mostly integers
+    NodeList ints;
+    for (int64_t i = 0; i < 2000000; ++i) {
+        ints.value.emplace_back(new NodeInt(i * i * (i % 2 ? -1 : 1)));
+    }
+    minified = format_node(ints, compact);
+    printf("%zu bytes ints\n", minified.size());
+    run("ints:", minified.size(), [&]() {
+        StringSink out;
+        Formatter(compact).format(out, ints);
+        minified = out.take();
+    });
+
+    // long, mostly plain strings
+    NodeList texts;
+    for (size_t i = 0; i < 20000; ++i) {
+        string text;
+        while (text.size() < 1000) {
+            text += "The quick brown fox jumps over the lazy dog " + to_string(i) + ". ";
+        }
+        text += i % 10 ? "" : "\"quoted\"\n";
+        texts.value.emplace_back(new NodeString(u8_decode(text.data(), text.size())));
+    }
+    minified = format_node(texts, compact);
+    printf("%zu bytes strings\n", minified.size());
+    run("strings:", minified.size(), [&]() {
+        StringSink out;
+        Formatter(compact).format(out, texts);
+        minified = out.take();
+    });
+    return 0;
+}
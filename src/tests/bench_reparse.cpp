@@ -0,0 +1,54 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "helper.h"
+
+
+using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::string;
+using std::to_string;
+
+
+// the same structure for every version
+static string make_status(size_t version, size_t services) {
+    string ans = "{\"version\": " + to_string(version) + ", \"services\": [";
+    for (size_t i = 0; i < services; ++i) {
+        string n = to_string(i * version);
+        ans += i == 0 ? "" : ", ";
+        ans += "{\"name\": \"service-" + to_string(i) + "\", \"healthy\": "
+            + (version % 2 == 0 ? "true" : "false") + ", \"latency\": [" + n + ".5, 1.25],"
+            " \"requests\": " + n + ", \"status\": \"state " + n + "\"}";
+    }
+    return ans + "]}";
+}
+
+
+int main() {
+    const size_t rounds = 2000;
+    vector<Token::Ptr> versions[2] = {
+        get_tokens(u8_decode(make_status(1, 200).data())),
+        get_tokens(u8_decode(make_status(2, 200).data())),
+    };
+
+    for (bool reuse : {false, true}) {
+        Parser parser;
+        Node::Ptr node;
+        steady_clock::time_point start = steady_clock::now();
+        for (size_t i = 0; i < rounds; ++i) {
+            parser.reset();
+            if (reuse) {
+                parser.reuse(move(node));
+            }
+            for (const Token::Ptr &tok : versions[i % 2]) {
+                parser.feed(*tok);
+            }
+            node = parser.pop_result();
+        }
+        duration<double, std::micro> elapsed = steady_clock::now() - start;
+        printf("%-8s %8.1f us per document\n", reuse ? "reuse:" : "fresh:",
+            elapsed.count() / rounds);
+    }
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include <atomic>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "catch.hpp"
+
+#include "helper.h"
+#include "../document.h"
+
+
+using std::atomic;
+using std::is_same;
+using std::string;
+using std::thread;
+using std::to_string;
+using std::vector;
+
+
+static string make_doc(int version, int size) {
+    string ans = "{\"version\": " + to_string(version);
+    for (int i = 0; i < size; ++i) {
+        ans += ", \"k" + to_string(i) + "\": [" + to_string(i)
+            + ", {\"v\": " + to_string(version) + "}]";
+    }
+    return ans + "}";
+}
+
+
+TEST_CASE("Test freeze") {
+    FrozenNode doc = freeze(parse_string(make_doc(1, 50)));
+    const NodeObject &obj = static_cast<const NodeObject &>(*doc);
+    size_t hash = 0;
+    REQUIRE(obj.pairs.hash_cache() != nullptr);
+    CHECK(obj.pairs.hash_cache()->get(hash));
+    CHECK(hash == parse_string(make_doc(1, 50))->hash());
+    const NodeList &list = static_cast<const NodeList &>(obj[USTRING("k7")]);
+    CHECK(list.value.cache()->hash.get(hash));
+    CHECK(*list.value[0] == NodeInt(7));
+    // const all the way down
+    static_assert(is_same<decltype(*list.value[1]), const Node &>::value, "mutable child");
+    static_assert(is_same<decltype(obj.pairs.value(0).get()), const Node *>::value,
+        "mutable value");
+
+    DocumentHolder holder(doc);
+    CHECK(holder.get() == doc);
+    FrozenNode next = freeze(parse_string(make_doc(2, 50)));
+    CHECK(holder.reload(next) == doc);
+    CHECK(holder.get() == next);
+    CHECK(obj[USTRING("version")] == NodeInt(1));     // old version stays valid
+}
+
+
+TEST_CASE("Test DocumentHolder concurrent") {
+    const int n_threads = 8;
+    const int n_keys = 100;
+    DocumentHolder holder(freeze(parse_string(make_doc(0, n_keys))));
+    atomic<bool> stop(false);
+    atomic<int> errors(0);
+
+    vector<thread> readers;
+    for (int t = 0; t < n_threads; ++t) {
+        readers.emplace_back([&holder, &stop, &errors, t]() {
+            for (int i = 0; !stop.load() || i < 1000; ++i) {
+                FrozenNode doc = holder.get();
+                const NodeObject &obj = static_cast<const NodeObject &>(*doc);
+                int64_t version = static_cast<const NodeInt &>(obj[USTRING("version")]).value;
+                string key = "k" + to_string((i + t) % n_keys);
+                const NodeList &list = static_cast<const NodeList &>(obj[u8_decode(key.data())]);
+                const NodeObject &item = static_cast<const NodeObject &>(*list.value[1]);
+                if (item[USTRING("v")] != NodeInt(version) || doc->hash() == 0) {
+                    errors++;
+                }
+            }
+        });
+    }
+    for (int version = 1; version <= 20; ++version) {
+        holder.reload(freeze(parse_string(make_doc(version, n_keys))));
+    }
+    stop.store(true);
+    for (thread &th : readers) {
+        th.join();
+    }
+    CHECK(errors.load() == 0);
+}
+
+
+TEST_CASE("Test Reclaimer") {
+    Reclaimer reclaimer;
+    DocumentHolder holder(freeze(parse_string(make_doc(1, 100)), reclaimer));
+    FrozenNode reader = holder.get();
+    holder.reload(freeze(parse_string(make_doc(2, 100)), reclaimer));
+    reclaimer.drain();
+    CHECK(reclaimer.reclaimed_trees() == 0);    // still read
+
+    reader.reset();
+    reclaimer.drain();
+    CHECK(reclaimer.queue_depth() == 0);
+    CHECK(reclaimer.reclaimed_trees() == 1);
+    CHECK(reclaimer.reclaimed_bytes() > 100 * (sizeof(NodePair) + sizeof(NodeList)));
+
+    reclaimer.retire(parse_string("[1, [2, [3]]]"));
+    reclaimer.retire(Node::Ptr());
+    reclaimer.drain();
+    CHECK(reclaimer.reclaimed_trees() == 2);
+    holder.reload(FrozenNode());
+    reclaimer.drain();
+    CHECK(reclaimer.reclaimed_trees() == 3);
+}
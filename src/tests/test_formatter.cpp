@@ -1,7 +1,39 @@
+#include <algorithm>
+#include <clocale>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <vector>
 #include "catch.hpp"
 
 #include "helper.h"
+#include "../builder.h"
 #include "../formatter.h"
+#include "../number.h"
+#include "../path.h"
+#include "../shape.h"
+
+
+using std::all_of;
+using std::invalid_argument;
+using std::memcpy;
+using std::move;
+using std::mt19937_64;
+using std::numeric_limits;
+using std::ostringstream;
+using std::out_of_range;
+using std::pair;
+using std::runtime_error;
+using std::shared_ptr;
+using std::string;
+using std::to_string;
+using std::vector;
 
 
 void check_fmt(const string &input, const string &output, FormatOption opt = FormatOption())
@@ -20,6 +52,127 @@ TEST_CASE("Test Formatter simple value") {
 }
 
 
+string int_str(int64_t value) {
+    char buf[INT_BUF_SIZE];
+    return string(buf, write_int(buf, value));
+}
+
+
+TEST_CASE("Test Formatter int") {
+    const int64_t min = numeric_limits<int64_t>::min();
+    const int64_t max = numeric_limits<int64_t>::max();
+    CHECK(int_str(0) == "0");
+    CHECK(int_str(-1) == "-1");
+    CHECK(int_str(max) == "9223372036854775807");
+    CHECK(int_str(min) == "-9223372036854775808");
+    CHECK(int_str(min + 1) == "-9223372036854775807");
+    char buf[INT_BUF_SIZE];
+    uint64_t umax = numeric_limits<uint64_t>::max();
+    CHECK(string(buf, write_uint(buf, umax)) == "18446744073709551615");
+
+    // every digit count and the boundaries around it
+    int64_t pow10 = 1;
+    for (int digits = 1; digits <= 18; ++digits, pow10 *= 10) {
+        for (int64_t value : {pow10 - 1, pow10, pow10 + 1, pow10 * 9 + 7}) {
+            CHECK(int_str(value) == to_string(value));
+            CHECK(int_str(-value) == to_string(-value));
+        }
+    }
+
+    NodeList list;
+    for (int64_t value : {min, max, int64_t(0), int64_t(-42)}) {
+        list.value.emplace_back(new NodeInt(value));
+    }
+    CHECK(format_node(list, FormatOption().compact(true))
+        == "[-9223372036854775808,9223372036854775807,0,-42]");
+}
+
+
+string double_str(double value, int precision = 0) {
+    char buf[DOUBLE_BUF_SIZE];
+    char *end = precision > 0 ? write_double(buf, value, precision) : write_double(buf, value);
+    return string(buf, end);
+}
+
+
+TEST_CASE("Test Formatter float") {
+    check_fmt("1.5", "1.5");
+    check_fmt("[-0.0, 1e-9, 2.5E+3, 1e21, 1e22]", "[-0.0, 1e-9, 2500.0, 1e21, 1e22]");
+    CHECK(double_str(0.1) == "0.1");
+    CHECK(double_str(1.0 / 3) == "0.3333333333333333");
+    CHECK(double_str(123456.789) == "123456.789");
+    CHECK(double_str(1e-6) == "0.000001");
+    CHECK(double_str(1e-7) == "1e-7");
+    CHECK(double_str(1.5e300) == "1.5e300");
+    CHECK(double_str(5e-324) == "5e-324");
+    CHECK(double_str(1.7976931348623157e308) == "1.7976931348623157e308");
+    CHECK(double_str(9007199254740992.0) == "9007199254740992.0");
+    CHECK(double_str(-1e21) == "-1e21");
+
+    CHECK(double_str(0.1, 3) == "0.1");
+    CHECK(double_str(1.0 / 3, 3) == "0.333");
+    CHECK(double_str(100, 3) == "100.0");
+    CHECK(double_str(1e-9, 3) == "1e-09");
+    check_fmt("[3.14159, 2.0]", "[3.14, 2.0]", FormatOption().float_precision(3));
+    // no room for ".0" after 31 chars, falls back to the shortest digits
+    char buf[DOUBLE_BUF_SIZE];
+    CHECK(string(buf, write_double(buf, -1.5e29, 30)) == "-1.5e29");
+    CHECK(format_node(NodeFloat(-1.5e29), FormatOption().float_precision(30)) == "-1.5e29");
+
+    // random bit patterns read back the same through the parser
+    mt19937_64 rng(42);
+    for (int i = 0; i < 20000; ++i) {
+        uint64_t bits = rng();
+        double value = 0;
+        memcpy(&value, &bits, sizeof(value));
+        if (value != value || value - value != 0) {
+            continue;   // nan or inf
+        }
+        string str = double_str(value);
+        REQUIRE(strtod(str.data(), nullptr) == value);
+        Node::Ptr node = parse_string(str);
+        REQUIRE(node->type == NodeType::FLOAT);
+        REQUIRE(static_cast<NodeFloat &>(*node).value == value);
+    }
+}
+
+
+// Numbers are read and written with '.' whatever the locale is.
+TEST_CASE("Test Formatter locale") {
+    const char *names[] = {"de_DE.UTF-8", "de_DE.utf8", "fr_FR.UTF-8", "fr_FR.utf8"};
+    const char *found = nullptr;
+    for (const char *name : names) {
+        if (found == nullptr && setlocale(LC_NUMERIC, name) != nullptr) {
+            found = name;
+        }
+    }
+    if (found == nullptr) {
+        WARN("no locale with a decimal comma, skipped");
+        return;
+    }
+    Node::Ptr node = parse_string("[1.5, 2.5e-3, 0.1]");
+    string shortest = format_node(*node, FormatOption().compact(true));
+    string precision = format_node(*node, FormatOption().compact(true).float_precision(3));
+    string canonical = format_node(*node, FormatOption().canonical(true));
+    double lazy = NodeNumber("2.5").as_double();
+    setlocale(LC_NUMERIC, "C");
+
+    CHECK(shortest == "[1.5,0.0025,0.1]");
+    CHECK(precision == "[1.5,0.0025,0.1]");
+    CHECK(canonical == "[1.5,0.0025,0.1]");
+    CHECK(lazy == 2.5);
+}
+
+
+TEST_CASE("Test Formatter lazy number") {
+    NodeList list;
+    for (const char *lexeme : {"1.50E+2", "-0", "123456789012345678901234567890"}) {
+        list.value.emplace_back(new NodeNumber(lexeme));
+    }
+    CHECK(format_node(list) == "[1.50E+2, -0, 123456789012345678901234567890]");
+}
+
+
 void check_string_fmt(const string &input, const char *expect = nullptr) {
     string quoted = "\"" + input + "\"";
     string expected_str = expect ? ("\"" + string(expect) + "\"") : quoted;
@@ -38,6 +191,202 @@ TEST_CASE("Test Formatter string") {
 }
 
 
+// every position in and around the vectorized blocks
+TEST_CASE("Test Formatter string escapes") {
+    const vector<pair<unichar, string>> specials = {
+        {'"', "\\\""}, {'\\', "\\\\"}, {'\n', "\\n"}, {'\r', "\\r"}, {0x1f, "\\u001f"},
+        {0, "\\u0000"}, {0x7f, "\x7f"}, {0xe9, "\xc3\xa9"}, {0x1f600, "\xf0\x9f\x98\x80"},
+    };
+    for (const auto &special : specials) {
+        for (size_t pos = 0; pos < 21; ++pos) {
+            ustring value(21, 'a');
+            value[pos] = special.first;
+            string expected = string(pos, 'a') + special.second + string(20 - pos, 'a');
+            CHECK(NodeString(value).repr() == "\"" + expected + "\"");
+        }
+    }
+
+    ustring all;
+    string expected = "\"\\u0000\\u0001";
+    for (unichar ch = 0; ch < 0x300; ++ch) {
+        all.push_back(ch);
+    }
+    CHECK(NodeString(all).repr().substr(0, expected.size()) == expected);
+    CHECK(*parse_string(NodeString(all).repr()) == NodeString(all));
+    ustring longer(1000, 'b');
+    CHECK(NodeString(longer).repr() == "\"" + string(1000, 'b') + "\"");
+}
+
+
+TEST_CASE("Test Formatter ensure_ascii") {
+    FormatOption ascii = FormatOption().ensure_ascii(true);
+    check_fmt("\"a\u554a\"", "\"a\\u554a\"", ascii);
+    check_fmt("\"\\u00e9\\n\"", "\"\\u00e9\\n\"", ascii);
+    check_fmt("\"\xf0\xa4\xad\xa2\"", "\"\\ud852\\udf62\"", ascii);
+    check_fmt("{\"\\uffff\": \"\\u0080\"}", "{\"\\uffff\": \"\\u0080\"}", ascii);
+    check_fmt("[\"\u554a\"]", "[\"\u554a\"]");
+
+    ustring all;
+    for (unichar ch = 0; ch < 0x11000; ch += ch < 0x300 ? 1 : 0x3f) {
+        if (!is_surrogate(ch)) {
+            all.push_back(ch);
+        }
+    }
+    all.push_back(0x10ffff);
+    string output = format_node(NodeString(all), ascii);
+    bool is_ascii = all_of(output.begin(), output.end(), [](char ch) { return (ch & 0x80) == 0; });
+    CHECK(is_ascii);
+    CHECK(*parse_string(output) == NodeString(all));
+    CHECK(output.find("\\u00ff\\u0100") != string::npos);
+    CHECK(output.find("\\udbff\\udfff") != string::npos);
+}
+
+
+// The examples of RFC 8785.
+TEST_CASE("Test Formatter canonical") {
+    FormatOption canonical = FormatOption().canonical(true).indent(2).ensure_ascii(true);
+    check_fmt(
+        "{\"numbers\": [333333333.33333329, 1E30, 4.50, 2e-3, 0.000000000000000000000000001],"
+        " \"string\": \"\\u20ac$\\u000F\\u000aA'\\u0042\\u0022\\u005c\\\\\\\"\\/\","
+        " \"literals\": [null, true, false]}",
+        "{\"literals\":[null,true,false],\"numbers\":[333333333.3333333,1e+30,4.5,0.002,1e-27],"
+        "\"string\":\"\xe2\x82\xac$\\u000f\\nA'B\\\"\\\\\\\\\\\"/\"}",
+        canonical);
+
+    string sorted = format_node(*parse_string(
+        "{\"\\u20ac\": 1, \"\\r\": 2, \"\\ufb33\": 3, \"1\": 4, \"\\ud83d\\ude00\": 5,"
+        " \"\\u0080\": 6, \"\\u00f6\": 7}"), canonical);
+    CHECK(sorted == format_node(*parse_string(
+        "{\"\\r\": 2, \"1\": 4, \"\\u0080\": 6, \"\\u00f6\": 7, \"\\u20ac\": 1,"
+        " \"\\ud83d\\ude00\": 5, \"\\ufb33\": 3}"), FormatOption().compact(true)));
+    CHECK(sorted.substr(0, 10) == "{\"\\r\":2,\"1");
+
+    vector<pair<uint64_t, string>> numbers = {
+        {0x0000000000000000, "0"},
+        {0x8000000000000000, "0"},
+        {0x0000000000000001, "5e-324"},
+        {0x8000000000000001, "-5e-324"},
+        {0x7fefffffffffffff, "1.7976931348623157e+308"},
+        {0xffefffffffffffff, "-1.7976931348623157e+308"},
+        {0x4340000000000000, "9007199254740992"},
+        {0xc340000000000000, "-9007199254740992"},
+        {0x4430000000000000, "295147905179352830000"},
+        {0x44b52d02c7e14af5, "9.999999999999997e+22"},
+        {0x44b52d02c7e14af6, "1e+23"},
+        {0x44b52d02c7e14af7, "1.0000000000000001e+23"},
+        {0x444b1ae4d6e2ef4e, "999999999999999700000"},
+        {0x444b1ae4d6e2ef4f, "999999999999999900000"},
+        {0x444b1ae4d6e2ef50, "1e+21"},
+        {0x3eb0c6f7a0b5ed8c, "9.999999999999997e-7"},
+        {0x3eb0c6f7a0b5ed8d, "0.000001"},
+        {0x41b3de4355555553, "333333333.3333332"},
+        {0x41b3de4355555554, "333333333.33333325"},
+        {0x41b3de4355555555, "333333333.3333333"},
+        {0x41b3de4355555556, "333333333.3333334"},
+        {0x41b3de4355555557, "333333333.33333343"},
+        {0xbecbf647612f3696, "-0.0000033333333333333333"},
+        {0x43143ff3c1cb0959, "1424953923781206.2"},
+    };
+    for (const auto &number : numbers) {
+        double value = 0;
+        memcpy(&value, &number.first, sizeof(value));
+        CHECK(format_node(NodeFloat(value), canonical) == number.second);
+    }
+    CHECK(format_node(NodeInt(-9007199254740992), canonical) == "-9007199254740992");
+    CHECK(format_node(NodeInt(-9007199254740993), canonical) == "-9007199254740992");
+    CHECK(format_node(NodeInt(INT64_MAX), canonical) == "9223372036854776000");
+    CHECK(format_node(NodeIntArray({1, INT64_MIN}), canonical) == "[1,-9223372036854776000]");
+    CHECK(format_node(NodeNumber("1.50E+2"), canonical) == "150");
+    CHECK(format_node(NodeNumber("18446744073709551617"), canonical) == "18446744073709552000");
+    CHECK(format_node(NodeNumber("1000000000000000000000"), canonical) == "1e+21");
+    CHECK_THROWS_AS(format_node(NodeFloat(1.0 / 0.0), canonical), out_of_range);
+
+    // the sort order is cached in frozen bodies, or shared by the shape
+    Node::Ptr node = parse_string("{\"b\": 1, \"a\": [{\"d\": 1, \"c\": 2}]}");
+    NodeObject &obj = static_cast<NodeObject &>(*node);
+    CHECK(format_node(obj, canonical) == "{\"a\":[{\"c\":2,\"d\":1}],\"b\":1}");
+    obj.pairs.value(0).reset(new NodeInt(3));
+    obj.pairs.emplace_back(new NodePair(
+        NodeString::Ptr(new NodeString(USTRING("0"))), Node::Ptr(new NodeNull())));
+    CHECK(format_node(obj, canonical) == "{\"0\":null,\"a\":[{\"c\":2,\"d\":1}],\"b\":3}");
+    // keys rewritten through pairs handed out before
+    NodePair::Ptr &held = obj.pairs[0];
+    CHECK(format_node(obj, canonical) == "{\"0\":null,\"a\":[{\"c\":2,\"d\":1}],\"b\":3}");
+    held->key.reset(new NodeKey(USTRING("1")));
+    CHECK(format_node(obj, canonical) == "{\"0\":null,\"1\":3,\"a\":[{\"c\":2,\"d\":1}]}");
+
+    FrozenNode frozen = freeze(move(node));
+    const PairVector &pairs = static_cast<const NodeObject &>(*frozen).pairs;
+    vector<size_t> buffer;
+    const vector<size_t> *order = &pairs.key_order(buffer);
+    CHECK(order != &buffer);
+    CHECK(format_node(*frozen, canonical) == "{\"0\":null,\"1\":3,\"a\":[{\"c\":2,\"d\":1}]}");
+    CHECK(&pairs.key_order(buffer) == order);
+
+    ShapeTable shapes;
+    Parser parser;
+    parser.use_shapes(&shapes);
+    const char *input = "[{\"y\": 1, \"x\": 2}, {\"y\": 3, \"x\": 4}]";
+    for (const Token::Ptr &tok : get_tokens(USTRING(input))) {
+        parser.feed(*tok);
+    }
+    node = parser.pop_result();
+    const NodeList &list = static_cast<const NodeList &>(*node);
+    const NodeObject &first = static_cast<const NodeObject &>(*list.value[0]);
+    const NodeObject &second = static_cast<const NodeObject &>(*list.value[1]);
+    vector<size_t> first_buffer;
+    vector<size_t> second_buffer;
+    CHECK(&first.pairs.key_order(first_buffer) == &second.pairs.key_order(second_buffer));
+    CHECK(format_node(*node, canonical) == "[{\"x\":2,\"y\":1},{\"x\":4,\"y\":3}]");
+}
+
+
+TEST_CASE("Test Formatter string flags") {
+    Node::Ptr node = parse_string("[\"plain\", \"\\u00e9t\\u00e9\", \"a\\\"b\", \"\\t\", \"\"]");
+    const NodeList &list = static_cast<const NodeList &>(*node);
+    vector<pair<bool, bool>> flags = {
+        {true, true}, {false, true}, {true, false}, {true, false}, {true, true},
+    };
+    for (size_t i = 0; i < flags.size(); ++i) {
+        const NodeString &str = static_cast<const NodeString &>(*list.value[i]);
+        CHECK(str.is_ascii() == flags[i].first);
+        CHECK(str.is_escape_free() == flags[i].second);
+        NodeString::Ptr copy(str.clone());
+        CHECK(copy->is_ascii() == str.is_ascii());
+        CHECK(copy->is_escape_free() == str.is_escape_free());
+    }
+    CHECK(format_node(*node, FormatOption().compact(true))
+        == "[\"plain\",\"\xc3\xa9t\xc3\xa9\",\"a\\\"b\",\"\\t\",\"\"]");
+
+    ustring value = USTRING("long enough to use every chunk of the output buffer ");
+    while (value.size() < 3000) {
+        value += value;
+    }
+    NodeString str(value);
+    CHECK(str.is_ascii());
+    value.push_back(0x1f600);
+    str.assign(value);
+    CHECK(!str.is_ascii());
+    CHECK(str.repr() == "\"" + u8_encode(value) + "\"");
+    value.back() = '\n';
+    str.assign(move(value));
+    CHECK(str.is_escape_free() == false);
+    CHECK(str.repr().substr(str.repr().size() - 3) == "\\n\"");
+
+    // leaves reused by the parser
+    Parser parser;
+    for (const char *input : {"[\"ab\"]", "[\"a\\n\"]", "[\"\\u554a\"]", "[\"ab\"]"}) {
+        parser.reset();
+        parser.reuse(move(node));
+        for (const Token::Ptr &tok : get_tokens(USTRING(input))) {
+            parser.feed(*tok);
+        }
+        node = parser.pop_result();
+        CHECK(format_node(*node) == format_node(*parse_string(input)));
+    }
+}
+
+
 TEST_CASE("Test Formatter compound value") {
     check_fmt("[]", "[]");
     check_fmt("{}", "{}");
@@ -102,3 +451,358 @@ TEST_CASE("Test FormatterOption") {
         FormatOption().use_tab(true)
     );
 }
+
+
+TEST_CASE("Test Formatter compact") {
+    FormatOption compact = FormatOption().compact(true).indent(2);
+    check_fmt("[]", "[]", compact);
+    check_fmt("{}", "{}", compact);
+    check_fmt("\"a\\n\"", "\"a\\n\"", compact);
+    check_fmt(
+        "[1, [], {\"a\": [true, null, \"s\"], \"b\": {}}, [[4, 5], {\"c\": -1.50e1}]]",
+        "[1,[],{\"a\":[true,null,\"s\"],\"b\":{}},[[4,5],{\"c\":-15.0}]]", compact);
+
+    Parser parser;
+    parser.pack_numbers(true);
+    for (const Token::Ptr &tok : get_tokens(USTRING("[[1, 2], [2.5], [], {\"x\": [3]}]"))) {
+        parser.feed(*tok);
+    }
+    CHECK(format_node(*parser.pop_result(), compact) == "[[1,2],[2.5],[],{\"x\":[3]}]");
+
+    NodePair pair(NodeString::Ptr(new NodeString(USTRING("k"))), parse_string("[1, 2]"));
+    CHECK(format_node(pair, compact) == "\"k\":[1,2]");
+    CHECK(format_node(pair) == "\"k\": [1, 2]");
+}
+
+
+TEST_CASE("Test Formatter deep nesting") {
+    const size_t depth = 100000;
+    string lists = string(depth, '[') + string(depth, ']');
+    check_fmt(lists, lists);
+
+    string objects;
+    string expected;
+    for (size_t i = 0; i < depth; ++i) {
+        objects += "{\"a\": ";
+        expected += i + 1 < depth ? "{\n\"a\": " : "{\"a\": ";    // the innermost is simple
+    }
+    objects += "1";
+    expected += "1}";
+    for (size_t i = 0; i < depth; ++i) {
+        objects += "}";
+        expected += i + 1 < depth ? "\n}" : "";
+    }
+    check_fmt(objects, expected, FormatOption().indent(0));
+    string compact;
+    for (size_t i = 0; i < depth; ++i) {
+        compact += "{\"a\":";
+    }
+    check_fmt(objects, compact + "1" + string(depth, '}'), FormatOption().compact(true));
+}
+
+
+TEST_CASE("Test Formatter sinks") {
+    string item = "{\"k\": \"\\u0001\\\"\u554a\\n\", \"v\": [1, null]}";
+    string input = "[";
+    for (int i = 0; i < 1000; ++i) {
+        input += (i == 0 ? "" : ", ") + item;
+    }
+    input += "]";
+    Node::Ptr node = parse_string(input);
+    string expected = format_node(*node);
+    CHECK(expected.size() > 30000);
+    CHECK(node->repr() == expected);
+
+    StringSink str;
+    Formatter().format(str, *node);
+    CHECK(str.size() == expected.size());
+    CHECK(str.take() == expected);
+    CHECK(str.size() == 0);
+    str.write("abc");
+    CHECK(str.str() == "abc");
+    str.reserve(10000);
+    str.fill('x', 5000);
+    CHECK(str.take() == "abc" + string(5000, 'x'));
+    CHECK(Formatter().to_string(*node) == expected);    // not measured, grown as written
+
+    char buffer[100];
+    vector<size_t> chunks;
+    string output;
+    BufferedSink buffered(buffer, sizeof(buffer), [&](const char *data, size_t size) {
+        chunks.push_back(size);
+        output.append(data, size);
+    });
+    Formatter().format(buffered, *node);
+    CHECK(chunks.size() == expected.size() / 100);
+    buffered.flush();
+    CHECK(output == expected);
+    CHECK(chunks.back() == expected.size() % 100);
+
+    FILE *file = tmpfile();
+    REQUIRE(file != nullptr);
+    FdSink fd(fileno(file));
+    Formatter().format(fd, *node);
+    fd.flush();
+    rewind(file);
+    string read(expected.size() + 1, '\0');
+    CHECK(fread(&read[0], 1, read.size(), file) == expected.size());
+    read.resize(expected.size());
+    CHECK(read == expected);
+    fclose(file);
+}
+
+
+TEST_CASE("Test Formatter measure") {
+    const char *inputs[] = {
+        "null", "-12", "[]", "{}", "[[], {}, [[]]]", "[1.5, 1e300, 2.5e-7, 123456789012]",
+        "{\"k\": \"\\u0001\\\"啊\\ud83d\\ude00\\n\", \"v\": [1, null, {\"w\": true}]}",
+        "[{\"b\": [1, {\"c\": []}], \"a\": 0.1}, [[\"x\"], 2], {\"\": {}}]",
+    };
+    FormatOption options[] = {
+        FormatOption(), FormatOption().indent(2), FormatOption().use_tab(true),
+        FormatOption().compact(true), FormatOption().compact(true).ensure_ascii(true),
+        FormatOption().compact(true).float_precision(3), FormatOption().canonical(true),
+        FormatOption().compact(true).float_precision(100),
+    };
+    for (const char *input : inputs) {
+        Node::Ptr node = parse_string(input);
+        FrozenNode frozen = freeze(parse_string(input));
+        for (const FormatOption &opt : options) {
+            string expected = format_node(*node, opt);
+            CHECK(Formatter::measure(*node, opt) == expected.size());
+            // twice, the second time from the cached sizes
+            CHECK(Formatter::measure(*frozen, opt) == expected.size());
+            CHECK(Formatter::measure(*frozen, opt) == expected.size());
+            CHECK(Formatter(opt).to_string(*node) == expected);
+            CHECK(Formatter(opt).to_string(*frozen) == expected);
+
+            StringSink out;
+            Formatter(opt).format(out, *node, 2);
+            CHECK(Formatter(opt).measure(*node, 2) == out.size());
+            CHECK(Formatter(opt).to_string(*node, 2) == out.str());
+        }
+    }
+
+    // cached for compact output of frozen trees, shared with versions from replace_path()
+    FormatOption compact = FormatOption().compact(true);
+    FrozenNode frozen = freeze(parse_string("[{\"a\": [1, 2], \"b\": {\"c\": \"d\"}}, [3]]"));
+    const NodeList &root = static_cast<const NodeList &>(*frozen);
+    CHECK(Formatter::measure(root, compact) == 31);
+    size_t size = 0;
+    CHECK(root.value.cache()->size.get(1, size));   // 1 is the key of plain compact output
+    CHECK(size == 31);
+    CHECK_FALSE(root.value.cache()->size.get(3, size));
+    Node::Ptr updated = replace_path(frozen, {0, USTRING("b"), USTRING("c")}, parse_string("[]"));
+    CHECK(Formatter::measure(*updated, compact) == 30);
+    CHECK(Formatter::measure(root, compact) == 31);
+    const NodeList &copy = static_cast<const NodeList &>(*updated);
+    CHECK_FALSE(copy.value.cache()->size.get(1, size));
+    CHECK(static_cast<const NodeList &>(*copy.value[1]).value.cache()->size.get(1, size));
+    CHECK(size == 3);
+
+    // not cached for other trees, their children may change through references held elsewhere
+    NodeList &list = static_cast<NodeList &>(*updated);
+    NodeObject &obj = static_cast<NodeObject &>(*list.value[0]);
+    NodeList &held = static_cast<NodeList &>(*obj.pairs.value(0));
+    CHECK(Formatter::measure(list, compact) == 30);
+    held.value.emplace_back(new NodeInt(100));
+    CHECK(Formatter::measure(list, compact) == 34);
+    obj.pairs.emplace_back(new NodePair(
+        NodeString::Ptr(new NodeString(USTRING("e"))), Node::Ptr(new NodeNull())));
+    CHECK(Formatter::measure(list, compact) == 43);
+    CHECK(Formatter::measure(list, compact) == format_node(list, compact).size());
+
+    ShapeTable shapes;
+    Parser parser;
+    parser.use_shapes(&shapes);
+    const char *input = "[{\"y\": 1, \"x\": [2]}, {\"y\": 3, \"x\": 4}]";
+    for (const Token::Ptr &tok : get_tokens(USTRING(input))) {
+        parser.feed(*tok);
+    }
+    Node::Ptr node = parser.pop_result();
+    CHECK(Formatter::measure(*node, compact) == 31);
+    NodeObject &shaped = static_cast<NodeObject &>(*static_cast<NodeList &>(*node).value[1]);
+    shaped.pairs.value(1).reset(new NodeInt(-40));  // keeps the shape
+    CHECK(Formatter::measure(*node, compact) == 33);
+    CHECK(Formatter(compact).to_string(*node) == "[{\"y\":1,\"x\":[2]},{\"y\":3,\"x\":-40}]");
+}
+
+
+TEST_CASE("Test Formatter fragments") {
+    const char *inputs[] = {
+        "[]", "[[], {}, [[]]]", "[1.5, {\"k\": \"\\u0001\\\"啊\\ud83d\\ude00\"}, [null]]",
+        "[{\"b\": [1, {\"c\": []}], \"a\": 0.1}, [[\"x\"], 2], {\"\": {}}]",
+    };
+    FormatOption options[] = {FormatOption().compact(true), FormatOption().canonical(true)};
+    for (const char *input : inputs) {
+        Node::Ptr node = parse_string(input);
+        FrozenNode doc = freeze(parse_string(input));
+        for (size_t size : {1, 8, 20, 1000}) {
+            for (FormatOption opt : options) {
+                string expected = format_node(*node, opt);
+                opt.fragment_size(size);
+                CHECK(format_node(*node, opt) == expected);
+                // twice, the second time from the cached fragments
+                CHECK(format_node(*doc, opt) == expected);
+                CHECK(format_node(*doc, opt) == expected);
+                CHECK(Formatter(opt).to_string(*doc) == expected);
+            }
+        }
+    }
+
+    // the largest subtrees of frozen trees within fragment_size are cached,
+    // and shared with versions from replace_path()
+    FormatOption opt = FormatOption().compact(true).fragment_size(16);
+    const char *input = "[{\"a\": [1, 2], \"b\": {\"c\": \"d\"}}, [3], [[4]]]";
+    FrozenNode frozen = freeze(parse_string(input));
+    const NodeList &root = static_cast<const NodeList &>(*frozen);
+    CHECK(format_node(root, opt) == "[{\"a\":[1,2],\"b\":{\"c\":\"d\"}},[3],[[4]]]");
+    const NodeList &list = static_cast<const NodeList &>(*root.value[1]);
+    const NodeList &nested = static_cast<const NodeList &>(*root.value[2]);
+    shared_ptr<const string> fragment = list.value.cache()->fragment.get(1);
+    REQUIRE(fragment);
+    CHECK(*fragment == "[3]");
+    CHECK(nested.value.cache()->fragment.get(1));
+    CHECK_FALSE(static_cast<const NodeList &>(*nested.value[0]).value.cache()->fragment.get(1));
+    CHECK_FALSE(root.value.cache()->fragment.get(1));
+    CHECK_FALSE(list.value.cache()->fragment.get(3));
+
+    Node::Ptr updated = replace_path(frozen, {0, USTRING("b")}, parse_string("5"));
+    CHECK(format_node(*updated, opt) == "[{\"a\":[1,2],\"b\":5},[3],[[4]]]");
+    CHECK(format_node(root, opt) == "[{\"a\":[1,2],\"b\":{\"c\":\"d\"}},[3],[[4]]]");
+    const NodeList &copy = static_cast<const NodeList &>(*updated);
+    CHECK(static_cast<const NodeList &>(*copy.value[1]).value.cache()->fragment.get(1) == fragment);
+
+    // not cached for other trees, their children may change through references held elsewhere
+    FormatOption large = FormatOption().compact(true).fragment_size(1000);
+    NodeList &tree = static_cast<NodeList &>(*updated);
+    NodeObject &obj = static_cast<NodeObject &>(*tree.value[0]);
+    NodeList &held = static_cast<NodeList &>(*obj.pairs.value(0));
+    CHECK(format_node(tree, large) == "[{\"a\":[1,2],\"b\":5},[3],[[4]]]");
+    CHECK_FALSE(tree.value.cache()->fragment.get(1));
+    held.value.emplace_back(new NodeInt(6));
+    CHECK(format_node(tree, large) == "[{\"a\":[1,2,6],\"b\":5},[3],[[4]]]");
+}
+
+
+template<class Builder>
+static void add_children(Builder &builder) {
+    builder.add(nullptr).add(true).add(1).add(2.5).add("utf-8 \xe5\x95\x8a");
+    builder.add(USTRING("ustring")).add(parse_string("[1, {\"a\": [2, 3]}]"));
+    builder.add_array([](ArrayBuilder &list) {
+        list.add(3u).add_array([](ArrayBuilder &) {});
+    });
+    builder.add_object([](ObjectBuilder &obj) {
+        obj.add("x", -1).add(USTRING("y"), "z");
+        obj.add_object("nested", [](ObjectBuilder &) {});
+        obj.add_array("list", [](ArrayBuilder &list) { list.add(false); });
+    });
+}
+
+
+TEST_CASE("Test ArrayBuilder and ObjectBuilder") {
+    string input = "[null, true, 1, 2.5, \"utf-8 \u554a\", \"ustring\", [1, {\"a\": [2, 3]}],"
+        " [3, []], {\"x\": -1, \"y\": \"z\", \"nested\": {}, \"list\": [false]}]";
+    ArrayBuilder list;
+    list.reserve(9);
+    add_children(list);
+    Node::Ptr node = list.build();
+    CHECK(*node == *parse_string(input));
+    CHECK(static_cast<NodeList &>(*node).value.capacity() == 9);
+
+    NodePair::KeyPtr key(new NodeKey(USTRING("shared")));
+    ObjectBuilder obj;
+    obj.add(key, 1).add(key, parse_string("[2]")).add("other", 3);
+    node = obj.build();
+    CHECK(*node == *parse_string("{\"shared\": 1, \"shared\": [2], \"other\": 3}"));
+    CHECK(static_cast<NodeObject &>(*node).pairs[1]->key == key);
+
+    // streaming, one child per line
+    ostringstream os;
+    {
+        ArrayBuilder stream(os);
+        add_children(stream);
+    }
+    CHECK(*parse_string(os.str()) == *parse_string(input));
+    CHECK(os.str().substr(0, 20) == "[\n    null,\n    true");
+    ostringstream compact;
+    {
+        ObjectBuilder stream(compact, FormatOption().compact(true));
+        stream.add("a", 1).add_array("b", [](ArrayBuilder &list) {
+            add_children(list);
+        });
+        stream.add_object("c", [](ObjectBuilder &) {});
+    }
+    CHECK(compact.str() == "{\"a\":1,\"b\":" + format_node(
+        *parse_string(input), FormatOption().compact(true)) + ",\"c\":{}}");
+    CHECK(os.str().find(
+        "    [\n"
+        "        1,\n"
+        "        {\n"
+        "            \"a\": [2, 3]\n"
+        "        }\n"
+        "    ],\n"
+        "    [\n"
+        "        3,\n"
+        "        []\n"
+        "    ],\n") != string::npos);
+
+    // unsigned 64-bit values are exact
+    uint64_t big = numeric_limits<uint64_t>::max();
+    node = ArrayBuilder().add(big).add(uint64_t(7)).add(uint64_t(1) << 63).build();
+    CHECK(format_node(*node) == "[18446744073709551615, 7, 9223372036854775808]");
+    CHECK(static_cast<const NodeList &>(*node).value[1]->type == NodeType::INT);
+    CHECK(static_cast<const NodeNumber &>(*static_cast<const NodeList &>(*node).value[0])
+        .as_uint64() == big);
+    ostringstream unsigned_stream;
+    ArrayBuilder(unsigned_stream, FormatOption().compact(true)).add(big).add(-1);
+    CHECK(unsigned_stream.str() == "[18446744073709551615,-1]");
+
+    // keys can not be sorted while streaming
+    ostringstream unsorted;
+    CHECK_THROWS_AS(ObjectBuilder(unsorted, FormatOption().canonical(true)), invalid_argument);
+    CHECK(unsorted.str().empty());
+
+    ostringstream empty;
+    ObjectBuilder stream(empty, FormatOption().use_tab(true));
+    stream.finish();
+    CHECK(empty.str() == "{}");
+}
+
+
+TEST_CASE("Test streaming builders on errors") {
+    string written;
+    bool failing = false;
+    char buffer[64];
+    BufferedSink sink(buffer, sizeof(buffer), [&](const char *data, size_t size) {
+        if (failing) {
+            throw runtime_error("write failed");
+        }
+        written.append(data, size);
+    });
+    FormatOption compact = FormatOption().compact(true);
+
+    // not closed while an exception propagates, so the output does not look complete
+    try {
+        ArrayBuilder stream(sink, compact);
+        stream.add(1).add_array([](ArrayBuilder &list) {
+            list.add("a");
+            throw runtime_error("no more items");
+        });
+    } catch (runtime_error &) {
+    }
+    sink.flush();
+    CHECK(written == "[1,[\"a\"");
+
+    // errors of the sink are thrown by finish() and ignored by the destructor
+    failing = true;
+    {
+        ObjectBuilder stream(sink, compact);
+        stream.add("key", 1);
+        CHECK_THROWS_AS(stream.finish(), runtime_error);
+    }
+    {
+        ObjectBuilder stream(sink, compact);
+        stream.add("key", 1);
+    }
+}
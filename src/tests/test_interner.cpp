@@ -0,0 +1,113 @@
+#include <string>
+#include <thread>
+#include <vector>
+#include "catch.hpp"
+
+#include "helper.h"
+#include "../interner.h"
+
+
+using std::string;
+using std::thread;
+using std::to_string;
+using std::vector;
+
+
+TEST_CASE("Test KeyInterner") {
+    KeyInterner interner(4);
+    NodePair::KeyPtr a = interner.intern(USTRING("a"));
+    CHECK(a->value() == USTRING("a"));
+    CHECK(a->key_hash == hash_ustring(USTRING("a")));
+    CHECK(interner.intern(USTRING("a")) == a);
+    CHECK(interner.intern(USTRING("b")) != a);
+
+    vector<NodePair::KeyPtr> keys;
+    for (int i = 0; i < 1000; ++i) {
+        keys.push_back(interner.intern(u8_decode(to_string(i).data())));
+    }
+    for (int i = 0; i < 1000; ++i) {
+        CHECK(interner.intern(u8_decode(to_string(i).data())) == keys[i]);
+    }
+    CHECK(interner.size() == 1002);
+}
+
+
+TEST_CASE("Test KeyInterner limits") {
+    KeyInterner interner(4, 10, 8);
+    vector<NodePair::KeyPtr> keys;
+    for (int i = 0; i < 20; ++i) {
+        keys.push_back(interner.intern(u8_decode(to_string(i).data())));
+    }
+    CHECK(interner.size() == 10);
+    for (int i = 0; i < 10; ++i) {
+        CHECK(interner.intern(u8_decode(to_string(i).data())) == keys[i]);
+    }
+    for (int i = 10; i < 20; ++i) {
+        NodePair::KeyPtr again = interner.intern(u8_decode(to_string(i).data()));
+        CHECK(again != keys[i]);
+        CHECK(again->value() == keys[i]->value());
+        CHECK(again->key_hash == keys[i]->key_hash);
+    }
+
+    KeyInterner wide(4, 10, 8);
+    CHECK(wide.intern(USTRING("12345678")) == wide.intern(USTRING("12345678")));
+    CHECK(wide.intern(USTRING("123456789")) != wide.intern(USTRING("123456789")));
+    CHECK(wide.intern(USTRING("123456789"))->value() == USTRING("123456789"));
+    CHECK(wide.size() == 1);
+}
+
+
+TEST_CASE("Test KeyInterner concurrent") {
+    const int n_threads = 8;
+    const int n_keys = 2000;
+    KeyInterner interner;
+    vector<vector<NodePair::KeyPtr>> results(n_threads);
+
+    vector<thread> threads;
+    for (int t = 0; t < n_threads; ++t) {
+        threads.emplace_back([&interner, &results, t]() {
+            for (int i = 0; i < n_keys; ++i) {
+                int k = (i * 7 + t * 13) % n_keys;  // different order for each thread
+                results[t].push_back(interner.intern(u8_decode(to_string(k).data())));
+            }
+        });
+    }
+    for (thread &th : threads) {
+        th.join();
+    }
+
+    CHECK(interner.size() == n_keys);
+    for (int t = 0; t < n_threads; ++t) {
+        for (int i = 0; i < n_keys; ++i) {
+            int k = (i * 7 + t * 13) % n_keys;
+            REQUIRE(results[t][i] == interner.intern(u8_decode(to_string(k).data())));
+        }
+    }
+}
+
+
+TEST_CASE("Test Parser intern_keys") {
+    KeyInterner interner;
+    vector<Node::Ptr> docs;
+    for (int i = 0; i < 2; ++i) {
+        auto tokens = get_tokens(USTRING("{\"id\": 1, \"tags\": {\"id\": 2}}"));
+        Parser parser;
+        parser.intern_keys(&interner);
+        for (const auto &tok : tokens) {
+            parser.feed(*tok);
+        }
+        docs.push_back(parser.pop_result());
+    }
+
+    const NodeObject &a = static_cast<const NodeObject &>(*docs[0]);
+    const NodeObject &b = static_cast<const NodeObject &>(*docs[1]);
+    CHECK(a == b);
+    CHECK(a.pairs[0]->key == b.pairs[0]->key);
+    CHECK(a.pairs[1]->key == b.pairs[1]->key);
+    const NodeObject &tags = static_cast<const NodeObject &>(*a.pairs[1]->value);
+    CHECK(tags.pairs[0]->key == a.pairs[0]->key);
+    CHECK(interner.size() == 2);
+
+    CHECK(*a.find(*interner.intern(USTRING("id"))) == NodeInt(1));
+    CHECK(a.find(*interner.intern(USTRING("x"))) == nullptr);
+}
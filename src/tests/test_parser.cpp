@@ -1,17 +1,33 @@
 #include <algorithm>
+#include <atomic>
+#include <cstdlib>
 #include <memory>
+#include <new>
+#include <stdexcept>
 #include <string>
+#include <unordered_set>
 #include <vector>
 #include "catch.hpp"
 
+#include "../dedup.h"
 #include "../exceptions.h"
+#include "../formatter.h"
+#include "../memory.h"
 #include "../scanner.h"
 #include "../parser.h"
+#include "../path.h"
+#include "../shape.h"
 #include "../unicode.h"
 
 
+using std::atomic;
+using std::bad_alloc;
 using std::find;
+using std::move;
+using std::nothrow_t;
+using std::out_of_range;
 using std::string;
+using std::unordered_set;
 using std::vector;
 
 
@@ -55,7 +71,7 @@ NodeObject::Ptr O(const vector<NodePair *> &pairs) {
 }
 
 
-Node::Ptr parse(const string &str) {
+Node::Ptr parse(const string &str, ShapeTable *shapes = nullptr, bool pack = false) {
     ustring us = u8_decode(str.data());
     Scanner scanner;
     for (auto ch : us) {
@@ -66,6 +82,7 @@ Node::Ptr parse(const string &str) {
     scanner.feed(' ');
 
     Parser parser;
+    parser.use_shapes(shapes).pack_numbers(pack);
     Token::Ptr tok;
     while ((tok = scanner.pop())) {
         parser.feed(*tok);
@@ -117,3 +134,636 @@ TEST_CASE("Test clone_node") {
     });
     CHECK(*node == *clone_node<NodeObject>(*node));
 }
+
+
+TEST_CASE("Test NodeObject find") {
+    for (size_t size : {size_t(3), NodeObject::INDEX_THRESHOLD * 4}) {
+        NodeObject::Ptr obj = O({});
+        for (size_t i = 0; i < size; ++i) {
+            obj->pairs.emplace_back(P("k" + to_string(i), P(i)));
+        }
+        obj->pairs.emplace_back(P("k0", P(-1)));     // duplicated
+
+        const NodeObject &cobj = *obj;
+        for (size_t i = 0; i < size; ++i) {
+            REQUIRE(cobj.find(USTRING(("k" + to_string(i)).data())) != nullptr);
+            CHECK(cobj[USTRING(("k" + to_string(i)).data())] == *N(i));
+        }
+        CHECK(cobj.find(USTRING("k")) == nullptr);
+        CHECK_THROWS_AS(cobj[USTRING("k")], out_of_range);
+
+        // index follows mutations
+        obj->pairs[1].reset(P("x", P(100)));
+        CHECK(cobj.find(USTRING("k1")) == nullptr);
+        CHECK(cobj[USTRING("x")] == *N(100));
+        obj->pairs.erase(obj->pairs.begin());
+        CHECK(cobj[USTRING("k0")] == *N(-1));
+
+        CHECK((*obj)[USTRING("new")] == NodeNull());
+        CHECK(cobj[USTRING("new")] == NodeNull());
+        CHECK(*obj->pairs.back()->key == NodeString(USTRING("new")));
+
+        // and keys rewritten through pairs handed out before
+        NodePair::Ptr &held = obj->pairs[0];
+        REQUIRE(cobj.find(USTRING("x")) != nullptr);
+        held->key.reset(new NodeKey(USTRING("y")));
+        CHECK(cobj.find(USTRING("x")) == nullptr);
+        CHECK(cobj[USTRING("y")] == *N(100));
+
+        // frozen objects keep the index
+        FrozenNode frozen = freeze(move(obj));
+        const NodeObject &fobj = static_cast<const NodeObject &>(*frozen);
+        CHECK(fobj[USTRING("y")] == *N(100));
+        CHECK(fobj.find(USTRING("x")) == nullptr);
+        CHECK(fobj.find(USTRING("k1")) == nullptr);
+        CHECK(fobj[USTRING("k2")] == *N(2));
+    }
+}
+
+
+TEST_CASE("Test Parser use_shapes") {
+    const char *input =
+        "[{\"a\": 1, \"b\": {\"c\": 2}}, {\"a\": 3, \"b\": {\"c\": 4}}, {\"b\": 5}, {}]";
+    ShapeTable shapes;
+    Node::Ptr node = parse(input, &shapes);
+    CHECK(*node == *parse(input));
+    CHECK(node->repr() == parse(input)->repr());
+    CHECK(shapes.size() == 3);
+
+    NodeList &list = static_cast<NodeList &>(*node);
+    NodeObject &first = static_cast<NodeObject &>(*list.value[0]);
+    NodeObject &second = static_cast<NodeObject &>(*list.value[1]);
+    REQUIRE(first.pairs.get_shape());
+    CHECK(first.pairs.get_shape() == second.pairs.get_shape());
+    CHECK(!static_cast<NodeObject &>(*list.value[3]).pairs.get_shape());
+    CHECK(*second.find(USTRING("a")) == NodeInt(3));
+    CHECK(second.find(USTRING("c")) == nullptr);
+
+    // shape is kept when only values change
+    second.pairs.value(0).reset(new NodeBool(true));
+    CHECK(second.pairs.get_shape());
+    CHECK(second[USTRING("a")] == NodeBool(true));
+
+    NodeObject::Ptr cloned = clone_node<NodeObject>(second);
+    CHECK(cloned->pairs.get_shape() == second.pairs.get_shape());
+    CHECK(*cloned == second);
+
+    // falls back to plain pairs when keys change
+    second[USTRING("d")];
+    CHECK(!second.pairs.get_shape());
+    CHECK(second == *parse("{\"a\": true, \"b\": {\"c\": 4}, \"d\": null}"));
+    CHECK(first.pairs.get_shape());
+
+    // const access to pairs keeps the shape, non-const access converts
+    const NodeObject &cfirst = first;
+    CHECK(*cfirst.pairs[1]->key == NodeString(USTRING("b")));
+    CHECK(*cfirst.pairs[1]->value == *first.pairs.value(1));
+    CHECK(first.pairs.get_shape());
+    // refers to the stored values, no copies
+    PairRef ref = cfirst.pairs[0];
+    first.pairs.value(0).reset(new NodeInt(20));
+    CHECK(&ref.value == &cfirst.pairs.value(0));
+    CHECK(*ref.value == NodeInt(20));
+    size_t count = 0;
+    for (PairRef pair : cfirst.pairs) {
+        CHECK(pair.value.get() == cfirst.pairs.value(count++).get());
+    }
+    CHECK(count == 2);
+    CHECK(first.pairs.get_shape());
+    first.pairs[0]->value.reset(new NodeInt(10));
+    CHECK(!first.pairs.get_shape());
+    CHECK(first == *parse("{\"a\": 10, \"b\": {\"c\": 2}}"));
+
+    ShapeTable small(1);
+    CHECK(*parse(input, &small) == *parse(input));
+    CHECK(small.size() == 1);
+}
+
+
+TEST_CASE("Test Parser pack_numbers") {
+    Node::Ptr ints = parse("[1, -2, 3]", nullptr, true);
+    REQUIRE(ints->type == NodeType::INT_ARRAY);
+    CHECK(static_cast<NodeIntArray &>(*ints).value == (vector<int64_t>{1, -2, 3}));
+    CHECK(*ints == *L({P(1), P(-2), P(3)}));
+    CHECK(*L({P(1), P(-2), P(3)}) == *ints);
+    CHECK(*ints != *L({P(1), P(-2)}));
+    CHECK(*clone_node<NodeIntArray>(*ints) == *ints);
+
+    Node::Ptr floats = parse("[1.5, 2e-3]", nullptr, true);
+    REQUIRE(floats->type == NodeType::FLOAT_ARRAY);
+    CHECK(static_cast<NodeFloatArray &>(*floats).value == (vector<double>{1.5, 2e-3}));
+    CHECK(*floats != *parse("[1, 2]", nullptr, true));
+
+    for (const char *input : {
+        "[1, 2.5]", "[1.5, 2]", "[1, \"a\", 2]", "[[1, 2], 3]", "[]", "[null, 1]",
+        "{\"a\": [1, 2], \"b\": [[]], \"c\": [1]}",
+    }) {
+        Node::Ptr packed = parse(input, nullptr, true);
+        Node::Ptr plain = parse(input);
+        CHECK(*packed == *plain);
+        CHECK(*plain == *packed);
+        CHECK(packed->repr() == plain->repr());
+    }
+    CHECK(parse("[1, 2.5]", nullptr, true)->type == NodeType::LIST);
+}
+
+
+TEST_CASE("Test NodeNumber") {
+    CHECK(NodeNumber("-12.5e-3").decimal() == "-0.0125");
+    CHECK(NodeNumber("1.50E+2").decimal() == "150");
+    CHECK(NodeNumber("-0.0e5").decimal() == "0");
+    CHECK(NodeNumber("123.456").decimal() == "123.456");
+
+    CHECK(NodeNumber("9223372036854775807").as_int64() == INT64_MAX);
+    CHECK(NodeNumber("-9223372036854775808").as_int64() == INT64_MIN);
+    CHECK(NodeNumber("1.5e1").as_int64() == 15);
+    CHECK_THROWS_AS(NodeNumber("9223372036854775808").as_int64(), out_of_range);
+    CHECK_THROWS_AS(NodeNumber("1.5").as_int64(), out_of_range);
+    CHECK(NodeNumber("18446744073709551615").as_uint64() == UINT64_MAX);
+    CHECK_THROWS_AS(NodeNumber("18446744073709551616").as_uint64(), out_of_range);
+    CHECK_THROWS_AS(NodeNumber("-1").as_uint64(), out_of_range);
+    CHECK_THROWS_AS(NodeNumber("1e100").as_uint64(), out_of_range);
+
+    CHECK(NodeNumber("0.1").as_double() == 0.1);
+    CHECK(NodeNumber("-2.5e-3").as_double() == -2.5e-3);
+    CHECK_THROWS_AS(NodeNumber("1e400").as_double(), out_of_range);
+
+    CHECK(NodeNumber("1.50e1") == NodeNumber("15"));
+    CHECK(NodeNumber("0") == NodeNumber("-0.0"));
+    CHECK(NodeNumber("1") != NodeNumber("10"));
+    CHECK(NodeNumber("1") != NodeInt(1));
+
+    // exponents beyond int64_t are not clamped to equal values
+    CHECK(NodeNumber("1e123456789012345678") == NodeNumber("10e123456789012345677"));
+    CHECK(NodeNumber("1e30000000000") != NodeNumber("1e30000000001"));
+    CHECK(NodeNumber("1e1234567890123456789") != NodeNumber("1e1234567890123456790"));
+    CHECK(NodeNumber("1e1234567890123456789") == NodeNumber("1e1234567890123456789"));
+    CHECK(NodeNumber("1e1234567890123456789").hash()
+        != NodeNumber("1e1234567890123456790").hash());
+    CHECK(NodeNumber("0e1234567890123456789") == NodeNumber("0"));
+    CHECK(NodeNumber("1e-0000000000000000000001") == NodeNumber("0.1"));
+    CHECK_THROWS_AS(NodeNumber("1e1234567890123456789").as_uint64(), out_of_range);
+    CHECK_THROWS_AS(NodeNumber("1e1234567890123456789").decimal(), out_of_range);
+}
+
+
+TEST_CASE("Test Node hash") {
+    const char *input = "[{\"a\": [1, 2], \"b\": {\"c\": [1.5, 0.0]}}, {\"a\": [], \"b\": \"x\"}]";
+    ShapeTable shapes;
+    Node::Ptr plain = parse(input);
+    CHECK(plain->hash() == parse(input)->hash());
+    CHECK(plain->hash() == parse(input, &shapes, true)->hash());
+    CHECK(plain->hash() == clone_node<Node>(*plain)->hash());
+    CHECK(plain->hash() != parse("[{\"a\": [1, 2]}]")->hash());
+    CHECK(parse("[]", nullptr, true)->hash() == L({})->hash());
+    CHECK(NodeNumber("1.50e1").hash() == NodeNumber("15").hash());
+    CHECK(NodeFloat(0.0).hash() == NodeFloat(-0.0).hash());
+    CHECK(NodeKey(USTRING("a")).hash() == NodeString(USTRING("a")).hash());
+
+    // cached hash follows mutations through non-const access
+    NodeList &list = static_cast<NodeList &>(*plain);
+    NodeObject &obj = static_cast<NodeObject &>(*list.value[1]);
+    static_cast<NodeList &>(*obj.find(USTRING("a"))).value.emplace_back(P(3));
+    Node::Ptr mutated = parse(
+        "[{\"a\": [1, 2], \"b\": {\"c\": [1.5, 0.0]}}, {\"a\": [3], \"b\": \"x\"}]");
+    CHECK(*plain == *mutated);
+    CHECK(plain->hash() == mutated->hash());
+    CHECK(plain->hash() != parse(input)->hash());
+
+    // hashes are cached for frozen trees only, others may change through held references
+    NodeList &held = static_cast<NodeList &>(*obj.find(USTRING("a")));
+    size_t before = plain->hash();
+    held.value[0].reset(new NodeInt(4));
+    CHECK(!list.value.frozen());
+    CHECK(plain->hash() != before);
+    mutated = parse("[{\"a\": [1, 2], \"b\": {\"c\": [1.5, 0.0]}}, {\"a\": [4], \"b\": \"x\"}]");
+    CHECK(*plain == *mutated);
+    CHECK(plain->hash() == mutated->hash());
+
+    // unequal cached hashes of frozen trees short-circuit equality
+    FrozenNode frozen = freeze(move(plain));
+    FrozenNode other = freeze(parse(input));
+    CHECK(static_cast<const NodeList &>(*frozen).value.frozen());
+    CHECK(*frozen != *other);
+    CHECK(*other == *parse(input));
+    CHECK(*frozen == *mutated);
+
+    unordered_set<const Node *, NodePtrHash, NodePtrEqual> set;
+    Node::Ptr a = parse("[1, {\"x\": null}]");
+    Node::Ptr b = parse("[1, {\"x\": null}]", &shapes, true);
+    Node::Ptr c = parse("[1, {\"x\": true}]");
+    set.insert(a.get());
+    set.insert(b.get());
+    set.insert(c.get());
+    CHECK(set.size() == 2);
+    CHECK(std::hash<Node>()(*a) == hash_node(*b));
+}
+
+
+TEST_CASE("Test Parser feed moved token") {
+    TokenString tok(USTRING("longer than the inline buffer of a string"));
+    const unichar *data = tok.value.data();
+    Parser parser;
+    parser.feed(move(tok));
+    CHECK(static_cast<const NodeString &>(*parser.pop_result()).value().data() == data);
+
+    TokenString copied(USTRING("longer than the inline buffer of a string"));
+    parser.reset();
+    parser.feed(copied);
+    CHECK(*parser.pop_result() == NodeString(copied.value));
+}
+
+
+TEST_CASE("Test dedup_subtrees") {
+    string item = "{\"tags\": [\"a\", \"b\", \"c\"], \"settings\": {\"x\": 1, \"y\": [true]}}";
+    string input = "[" + item + ", " + item + ", " + item + ", {\"tags\": [\"a\", \"b\", \"c\"]}]";
+    for (ShapeTable *shapes : {static_cast<ShapeTable *>(nullptr), new ShapeTable()}) {
+        DedupStats stats;
+        FrozenNode doc = dedup_subtrees(parse(input, shapes), &stats);
+        CHECK(stats.subtrees == 9);     // 4 in each repeated item, and the last tags
+        CHECK(stats.bytes > 0);
+        CHECK(*doc == *parse(input));
+
+        const NodeList &list = static_cast<const NodeList &>(*doc);
+        const NodeObject &first = static_cast<const NodeObject &>(*list.value[0]);
+        const NodeObject &second = static_cast<const NodeObject &>(*list.value[1]);
+        CHECK(first.pairs.shares(second.pairs));
+        CHECK(static_cast<const NodeList &>(first[USTRING("tags")]).value.shares(
+            static_cast<const NodeList &>(*static_cast<const NodeObject &>(*list.value[3]).find(
+                USTRING("tags"))).value));
+
+        // modified versions copy on write
+        Node::Ptr updated = replace_path(doc, {1, USTRING("tags"), 2}, parse("\"d\""));
+        CHECK(*doc == *parse(input));
+        const NodeList &copy = static_cast<const NodeList &>(*updated);
+        CHECK(static_cast<const NodeObject &>(*copy.value[0]).pairs.shares(first.pairs));
+        CHECK(!static_cast<const NodeObject &>(*copy.value[1]).pairs.shares(first.pairs));
+        CHECK(*copy.value[1] == *parse(
+            "{\"tags\": [\"a\", \"b\", \"d\"], \"settings\": {\"x\": 1, \"y\": [true]}}"));
+
+        // subtrees already sharing children are merged as a whole only
+        updated = replace_path(doc, {3}, parse(item));
+        FrozenNode again = dedup_subtrees(move(updated), &stats);
+        CHECK(stats.subtrees == 1);
+        CHECK(static_cast<const NodeObject &>(*static_cast<const NodeList &>(*again).value[3])
+            .pairs.shares(first.pairs));
+        delete shapes;
+    }
+
+    // a canonical plain list inside a node merged into one holding a packed array
+    NodeList::Ptr root(new NodeList());
+    NodeList::Ptr packed(new NodeList());
+    packed->value.emplace_back(new NodeIntArray({1, 2}));
+    root->value.push_back(move(packed));
+    for (int i = 0; i < 3; ++i) {
+        root->value.push_back(parse("[[1, 2]]"));
+    }
+    DedupStats stats;
+    FrozenNode doc = dedup_subtrees(move(root), &stats);
+    CHECK(*doc == *parse("[[[1, 2]], [[1, 2]], [[1, 2]], [[1, 2]]]"));
+    CHECK(stats.subtrees == 5);     // the outer lists, and the inner lists but the first
+}
+
+
+TEST_CASE("Test clone") {
+    string input = "{\"a\": [1, {\"b\": [2, 3]}], \"c\": {\"d\": null}}";
+    Node::Ptr node = parse(input);
+    NodeObject &obj = static_cast<NodeObject &>(*node);
+    NodeObject &c = static_cast<NodeObject &>(*obj.find(USTRING("c")));  // held across clone()
+    Node::Ptr cloned = clone_node<Node>(*node);
+    NodeObject &cobj = static_cast<NodeObject &>(*cloned);
+    CHECK(!obj.pairs.shares(cobj.pairs));
+    CHECK(*cloned == *node);
+
+    c[USTRING("e")];
+    static_cast<NodeList &>(*cobj.find(USTRING("a"))).value.pop_back();
+    CHECK(*node == *parse("{\"a\": [1, {\"b\": [2, 3]}], \"c\": {\"d\": null, \"e\": null}}"));
+    CHECK(*cloned == *parse("{\"a\": [1], \"c\": {\"d\": null}}"));
+
+    // shaped objects keep their shape
+    ShapeTable shapes;
+    node = parse("[{\"x\": 1, \"y\": [2]}, {\"x\": 3, \"y\": []}]", &shapes);
+    cloned = clone_node<Node>(*node);
+    CHECK(*cloned == *node);
+    const NodeObject &first = static_cast<const NodeObject &>(
+        *static_cast<const NodeList &>(*cloned).value[0]);
+    CHECK(first.pairs.get_shape() == static_cast<const NodeObject &>(
+        *static_cast<const NodeList &>(*node).value[1]).pairs.get_shape());
+    CHECK(!first.pairs.shares(static_cast<const NodeObject &>(
+        *static_cast<const NodeList &>(*node).value[0]).pairs));
+}
+
+
+static void feed_all(Parser &parser, const string &str) {
+    Scanner scanner;
+    for (auto ch : u8_decode(str.data())) {
+        scanner.feed(ch);
+    }
+    scanner.feed(' ');
+    Token::Ptr tok;
+    while ((tok = scanner.pop())) {
+        parser.feed(*tok);
+    }
+}
+
+
+// Live heap bytes and blocks requested through operator new, see the test below.
+static atomic<size_t> live_bytes{0};
+static atomic<size_t> live_blocks{0};
+static const size_t HEADER = 16;    // holds the size, keeps the alignment of malloc
+
+
+static void *counted_new(size_t size) noexcept {
+    char *block = static_cast<char *>(malloc(HEADER + size));
+    if (block == nullptr) {
+        return nullptr;
+    }
+    *reinterpret_cast<size_t *>(block) = size;
+    live_bytes += size;
+    live_blocks++;
+    return block + HEADER;
+}
+
+
+static void counted_delete(void *ptr) noexcept {
+    if (ptr == nullptr) {
+        return;
+    }
+    char *block = static_cast<char *>(ptr) - HEADER;
+    live_bytes -= *reinterpret_cast<size_t *>(block);
+    live_blocks--;
+    free(block);
+}
+
+
+void *operator new(size_t size) {
+    void *ptr = counted_new(size);
+    if (ptr == nullptr) {
+        throw bad_alloc();
+    }
+    return ptr;
+}
+
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+
+void *operator new(size_t size, const nothrow_t &) noexcept {
+    return counted_new(size);
+}
+
+
+void *operator new[](size_t size, const nothrow_t &) noexcept {
+    return counted_new(size);
+}
+
+
+void operator delete(void *ptr) noexcept {
+    counted_delete(ptr);
+}
+
+
+void operator delete[](void *ptr) noexcept {
+    counted_delete(ptr);
+}
+
+
+void operator delete(void *ptr, const nothrow_t &) noexcept {
+    counted_delete(ptr);
+}
+
+
+void operator delete[](void *ptr, const nothrow_t &) noexcept {
+    counted_delete(ptr);
+}
+
+
+TEST_CASE("Test memory_usage") {
+    string text = "a string too long to be stored inline";
+    Node::Ptr node = parse("[1, \"" + text + "\", {\"k\": [true, null]}]");
+    MemoryUsage usage = memory_usage(*node);
+    size_t key = sizeof(NodeKey) + control_block_size<NodeKey>();
+    size_t list_body = decltype(NodeList::value)::body_size();
+    CHECK(usage.nodes == 2 * sizeof(NodeList) + sizeof(NodeInt) + sizeof(NodeString)
+        + sizeof(NodeObject) + sizeof(NodePair) + key + sizeof(NodeBool) + sizeof(NodeNull)
+        + 2 * list_body + PairVector::body_size());
+    CHECK(usage.arrays == 6 * sizeof(Node::Ptr));
+    CHECK(usage.strings == text.size() * sizeof(unichar));    // the key is inline
+    CHECK(usage.caches == 0);
+    CHECK(usage.unused >= sizeof(unichar));
+    CHECK(usage.slack >= usage.blocks * sizeof(size_t));
+    CHECK(tree_bytes(*node) == usage.total());
+
+    // the shared key is counted once, and not at all by tree_bytes()
+    Node::Ptr copy(node->clone());
+    size_t shared_key = usage.total() - tree_bytes(*node);
+    CHECK(memory_usage(*copy).nodes == usage.nodes);
+    CHECK(tree_bytes(*copy) == memory_usage(*copy).total() - shared_key);
+    CHECK(shared_key > key);
+
+    // shared children are counted once, and not at all by tree_bytes()
+    FrozenNode frozen = freeze(move(node));
+    copy = replace_path(frozen, {0}, N(2));
+    MemoryUsage shared = memory_usage(*copy);
+    CHECK(shared.nodes == usage.nodes);
+    CHECK(shared.strings == usage.strings);
+    const Node &obj = *static_cast<const NodeList &>(*copy).value[2];
+    CHECK(tree_bytes(*copy)
+        == shared.total() - memory_usage(obj).total() + memory_usage(NodeObject()).total());
+}
+
+
+TEST_CASE("Test memory_usage against the allocator") {
+    string input = "{\"a long key, not inline\": [\"a long string, not inline\", 1, 2.5],"
+        " \"packed\": [1, 2, 3], \"empty\": [], \"index\": {";
+    for (size_t i = 0; i < NodeObject::INDEX_THRESHOLD; ++i) {
+        input += string(i == 0 ? "" : ", ") + "\"" + char('a' + i) + "\": {}";
+    }
+    input += "}}";
+    FormatOption fragments = FormatOption().compact(true).fragment_size(64);
+    auto build_caches = [&fragments](const FrozenNode &frozen) {
+        vector<size_t> buffer;
+        static_cast<const NodeObject &>(*frozen).pairs.key_order(buffer);
+        Formatter(fragments).to_string(*frozen);
+    };
+    Parser parser;
+    parser.pack_numbers(true);
+    feed_all(parser, input);
+    build_caches(freeze(parser.pop_result()));     // allocates the statics and parser buffers
+
+    size_t bytes = live_bytes;
+    size_t blocks = live_blocks;
+    parser.reset();
+    feed_all(parser, input);
+    size_t used = parser.bytes_used();
+    Node::Ptr node = parser.pop_result();
+    // taken before the checks, which allocate
+    size_t parsed_bytes = live_bytes - bytes;
+    size_t parsed_blocks = live_blocks - blocks;
+    MemoryUsage usage = memory_usage(*node);
+    CHECK(parsed_bytes == usage.requested());
+    CHECK(parsed_blocks == usage.blocks);
+    CHECK(used == usage.requested() - usage.unused);
+
+    // the caches of frozen trees, and the control block of frozen
+    bytes = live_bytes;
+    blocks = live_blocks;
+    FrozenNode frozen = freeze(move(node));
+    build_caches(frozen);
+    size_t cached_bytes = live_bytes - bytes;
+    size_t cached_blocks = live_blocks - blocks;
+    MemoryUsage frozen_usage = memory_usage(*frozen);
+    CHECK(frozen_usage.caches > 0);
+    size_t control = control_block_size<Node>();
+    CHECK(cached_bytes == frozen_usage.requested() - usage.requested() + control);
+    CHECK(cached_blocks == frozen_usage.blocks - usage.blocks + 1);
+
+    bytes = live_bytes;
+    blocks = live_blocks;
+    frozen.reset();
+    size_t freed_bytes = bytes - live_bytes;
+    size_t freed_blocks = blocks - live_blocks;
+    CHECK(freed_bytes == frozen_usage.requested() + control);
+    CHECK(freed_blocks == frozen_usage.blocks + 1);
+}
+
+
+TEST_CASE("Test Parser byte_budget") {
+    string input = "{\"a long key, not inline\": [\"a long string, not inline\", 1, 2.5],"
+        " \"another long key\": [1, 2, {\"empty\": {}}, []]}";
+    for (bool pack : {false, true}) {
+        for (ShapeTable *shapes : {static_cast<ShapeTable *>(nullptr), new ShapeTable()}) {
+            Parser parser;
+            parser.pack_numbers(pack).use_shapes(shapes);
+            feed_all(parser, input);
+            size_t used = parser.bytes_used();
+            Node::Ptr node = parser.pop_result();
+            MemoryUsage usage = memory_usage(*node);
+            if (shapes == nullptr) {
+                CHECK(used == usage.requested() - usage.unused);
+            } else {
+                CHECK(used >= usage.requested() - usage.unused);     // keys moved to shapes
+            }
+
+            parser.reset();
+            CHECK(parser.bytes_used() == 0);
+            parser.byte_budget(used);
+            feed_all(parser, input);
+            CHECK(parser.pop_result()->hash() == node->hash());
+
+            parser.reset();
+            parser.byte_budget(used - 1);
+            REQUIRE_THROWS_AS(feed_all(parser, input), BudgetExceeded);
+            delete shapes;
+        }
+    }
+}
+
+
+TEST_CASE("Test Parser reuse") {
+    string first = "{\"id\": 1, \"name\": \"first name, not inline\", \"tags\": [\"x\", 2.5],"
+        " \"nested\": {\"ok\": true, \"items\": [1, 2, 3]}, \"none\": null, \"empty\": {}}";
+    string second = "{\"id\": 2, \"name\": \"other name, not inline\", \"tags\": [\"y\", 3.5],"
+        " \"nested\": {\"ok\": false, \"items\": [4, 5, 6]}, \"none\": null, \"empty\": {}}";
+    Parser parser;
+    feed_all(parser, first);
+    Node::Ptr node = parser.pop_result();
+    const NodeObject &obj = static_cast<const NodeObject &>(*node);
+    const Node *root = node.get();
+    const Node::Ptr *pair_value = &obj.pairs[3]->value;     // stored in the reused pair
+    const Node *items = &static_cast<const NodeObject &>(obj[USTRING("nested")])[USTRING("items")];
+    const unichar *name = static_cast<const NodeString &>(obj[USTRING("name")]).value().data();
+
+    // same structure, nothing allocated
+    parser.reset();
+    parser.reuse(move(node));
+    feed_all(parser, second);
+    node = parser.pop_result();
+    CHECK((*node == *parse(second)));
+    CHECK(node.get() == root);
+    CHECK(&obj.pairs[3]->value == pair_value);
+    CHECK(&static_cast<const NodeObject &>(obj[USTRING("nested")])[USTRING("items")] == items);
+    CHECK(static_cast<const NodeString &>(obj[USTRING("name")]).value().data() == name);
+    CHECK(obj.find(USTRING("name")) != nullptr);
+
+    // diverging documents
+    vector<string> inputs = {
+        "{\"id\": \"1\", \"name\": [1, 2, 3, 4], \"tags\": [], \"other\": {\"ok\": 1}}",
+        "{\"id\": 1, \"tags\": [\"x\"], \"nested\": {\"ok\": {}, \"items\": [1.5, 2]}}",
+        "[1, 2, [3, 4], {\"a\": {}}, null, \"s\"]",
+        "[[1], 2, [3, {\"a\": []}], {\"a\": {\"b\": 1}}]",
+        first, second, first,
+    };
+    for (bool pack : {false, true}) {
+        for (ShapeTable *shapes : {static_cast<ShapeTable *>(nullptr), new ShapeTable()}) {
+            for (const string &input : inputs) {
+                parser.reset();
+                parser.pack_numbers(pack).use_shapes(shapes).reuse(move(node));
+                feed_all(parser, input);
+                node = parser.pop_result();
+                CHECK((*node == *parse(input)));
+            }
+            parser.use_shapes(nullptr);
+            delete shapes;
+        }
+    }
+}
+
+
+TEST_CASE("Test replace_path") {
+    Node::Ptr node = parse("{\"a\": [1, {\"b\": [2, 3]}], \"c\": {\"d\": null}}", nullptr, true);
+    const Node &cnode = *node;
+    CHECK(*find_path(cnode, {USTRING("a"), 1, USTRING("b")}) == *L({P(2), P(3)}));
+    CHECK(find_path(cnode, {USTRING("a"), 1, USTRING("b"), 0}) == nullptr);  // packed
+    CHECK(find_path(cnode, {USTRING("a"), 2}) == nullptr);
+    CHECK(find_path(cnode, {USTRING("c"), 0}) == nullptr);
+
+    FrozenNode frozen = freeze(move(node));
+    Node::Ptr updated = replace_path(frozen, {USTRING("a"), 1, USTRING("b"), 0}, N(5));
+    CHECK(*updated == *parse("{\"a\": [1, {\"b\": [5, 3]}], \"c\": {\"d\": null}}"));
+    CHECK(*frozen == *parse("{\"a\": [1, {\"b\": [2, 3]}], \"c\": {\"d\": null}}"));
+    const Node &c = *find_path(cnode, {USTRING("c")});
+    CHECK(static_cast<const NodeObject &>(c).pairs.shares(
+        static_cast<const NodeObject &>(*find_path(*updated, {USTRING("c")})).pairs));
+
+    updated = replace_path(freeze(move(updated)), {USTRING("c"), USTRING("e")}, N(6));
+    CHECK(*updated == *parse("{\"a\": [1, {\"b\": [5, 3]}], \"c\": {\"d\": null, \"e\": 6}}"));
+    CHECK(*replace_path(frozen, {}, N(1)) == *N(1));
+    CHECK_THROWS_AS(replace_path(frozen, {USTRING("x"), USTRING("y")}, N(1)), out_of_range);
+    CHECK_THROWS_AS(replace_path(frozen, {USTRING("a"), 2}, N(1)), out_of_range);
+    CHECK(path_repr({USTRING("x"), 2}) == "[\"x\"][2]");
+
+    Node *b0 = find_path(*updated, {USTRING("a"), 1, USTRING("b"), 0});
+    REQUIRE(b0 != nullptr);
+    static_cast<NodeInt *>(b0)->value = 7;
+    CHECK(*updated == *parse("{\"a\": [1, {\"b\": [7, 3]}], \"c\": {\"d\": null, \"e\": 6}}"));
+}
+
+
+TEST_CASE("Test deep nesting") {
+    const size_t depth = 100000;    // far deeper than the call stack allows
+    string lists = string(depth, '[') + string(depth, ']');
+    string objects;
+    for (size_t i = 0; i < depth; ++i) {
+        objects += "{\"a\": [1, ";
+    }
+    objects += "null";
+    for (size_t i = 0; i < depth; ++i) {
+        objects += "]}";
+    }
+
+    for (const string &input : {lists, objects}) {
+        Node::Ptr node = parse(input);
+        Node::Ptr other = parse(input);
+        CHECK(node->hash() == other->hash());
+        CHECK((*node == *other));     // no repr of the operands
+        Node::Ptr cloned = clone_node<Node>(*node);
+        CHECK((*cloned == *other));
+        DedupStats stats;
+        FrozenNode frozen = dedup_subtrees(move(node), &stats);
+        CHECK(stats.subtrees == 0);
+        CHECK((*frozen == *other));     // no repr of the operands
+    }
+}
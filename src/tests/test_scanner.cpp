@@ -17,9 +17,10 @@ using std::string;
 using std::vector;
 
 
-vector<Token::Ptr> get_tokens(const string &str) {
+vector<Token::Ptr> get_tokens(const string &str, bool lazy = false) {
     ustring us = u8_decode(str.data());
     Scanner scanner;
+    scanner.lazy_numbers(lazy);
     for (auto ch : us) {
         scanner.feed(ch);
     }
@@ -119,6 +120,28 @@ TEST_CASE("Test scanner number") {
     // overflow
     CHECK(get_float("123123123123123123123123123123") == Approx(1.23123E+29));
     CHECK(isinf(get_float("0.4e006699999999999999999999999999999999999999999999999999999")));
+
+    // correctly rounded
+    CHECK(get_float("0.1") == 0.1);
+    CHECK(get_float("-1.7976931348623157e308") == -1.7976931348623157e308);
+    CHECK(get_float("4.9406564584124654e-324") == 4.9406564584124654e-324);
+    CHECK(get_float("9007199254740993.0") == 9007199254740992.0);
+}
+
+
+TEST_CASE("Test Scanner lazy number") {
+    auto tokens = get_tokens("[-0, 12.50, 1E+2, -3e-0]", true);
+    REQUIRE(tokens.size() == 9);
+    CHECK(*tokens[1] == TokenNumber("-0"));
+    CHECK(*tokens[3] == TokenNumber("12.50"));
+    CHECK(*tokens[5] == TokenNumber("1E+2"));
+    CHECK(*tokens[7] == TokenNumber("-3e-0"));
+    CHECK(tokens[3]->start == SourcePos(0, 5));
+    CHECK(tokens[3]->end == SourcePos(0, 9));
+
+    tokens = get_tokens("7", true);
+    REQUIRE(tokens.size() == 1);
+    CHECK(*tokens[0] == TokenNumber("7"));
 }
 
 
@@ -66,4 +66,30 @@ TEST_CASE("Test unicode encode/decode") {
 
 TEST_CASE("Test surrogate") {
     CHECK(UCHAR("𤭢") == u16_assemble_surrogate(0xd852, 0xdf62));
+
+    unichar hi = 0;
+    unichar lo = 0;
+    u16_split_surrogate(UCHAR("𤭢"), hi, lo);
+    CHECK(hi == 0xd852);
+    CHECK(lo == 0xdf62);
+    for (unichar ch : {0x10000u, 0x1f600u, 0x10ffffu}) {
+        u16_split_surrogate(ch, hi, lo);
+        CHECK(is_surrogate_high(hi));
+        CHECK(is_surrogate_low(lo));
+        CHECK(u16_assemble_surrogate(hi, lo) == ch);
+    }
+}
+
+
+TEST_CASE("Test u16_less") {
+    CHECK(u16_less(USTRING("a"), USTRING("b")));
+    CHECK(u16_less(USTRING("a"), USTRING("ab")));
+    CHECK(!u16_less(USTRING("ab"), USTRING("ab")));
+    CHECK(!u16_less(USTRING("b"), USTRING("ab")));
+    // U+1F600 is encoded as d83d de00, which is below U+E000
+    CHECK(u16_less(USTRING("😀"), ustring(1, 0xe000)));
+    CHECK(!u16_less(ustring(1, 0xe000), USTRING("😀")));
+    CHECK(u16_less(ustring(1, 0xd7ff), USTRING("😀")));
+    CHECK(u16_less(USTRING("😀"), USTRING("😁")));
+    CHECK(u16_less(ustring(1, 0x10000), ustring(1, 0x10ffff)));
 }
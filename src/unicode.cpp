@@ -132,6 +132,25 @@ ustring u8_decode(const char *s) {
 }
 
 
+// decode exactly len bytes, embedded '\0' is allowed.
+ustring u8_decode(const char *s, size_t len) {
+    const char *end = s + len;
+    size_t ulen = 0;
+    for (const char *p = s; p < end; p += u8_read_char_len(p)) {
+        ulen++;
+    }
+
+    ustring ans;
+    ans.reserve(ulen);
+    while (s < end) {
+        int clen = u8_read_char_len(s);
+        ans.push_back(u8_read_char(s));
+        s += clen;
+    }
+    return ans;
+}
+
+
 size_t u8_byte_len(const ustring &us) {
     size_t ans = 0;
     for (unichar ch : us) {
@@ -201,3 +220,33 @@ unichar u16_assemble_surrogate(unichar hi, unichar lo) {
     assert(is_surrogate_low(lo));
     return (((hi - 0xd800) << 10) | (lo - 0xdc00)) + 0x010000;
 }
+
+
+// the first UTF-16 code unit of ch
+static unichar u16_lead(unichar ch) {
+    return ch < 0x010000 ? ch : 0xd800 + ((ch - 0x010000) >> 10);
+}
+
+
+// Differs from the code point order where BMP chars above the surrogates meet others.
+bool u16_less(const ustring &a, const ustring &b) {
+    size_t size = a.size() < b.size() ? a.size() : b.size();
+    for (size_t i = 0; i < size; ++i) {
+        if (a[i] != b[i]) {
+            unichar lead_a = u16_lead(a[i]);
+            unichar lead_b = u16_lead(b[i]);
+            // the same lead leaves the trail, which is in code point order
+            return lead_a != lead_b ? lead_a < lead_b : a[i] < b[i];
+        }
+    }
+    return a.size() < b.size();
+}
+
+
+// the inverse of u16_assemble_surrogate()
+void u16_split_surrogate(unichar ch, unichar &hi, unichar &lo) {
+    assert(0x010000 <= ch && ch <= 0x10ffff);
+    ch -= 0x010000;
+    hi = 0xd800 + (ch >> 10);
+    lo = 0xdc00 + (ch & 0x3ff);
+}
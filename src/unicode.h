@@ -37,6 +37,7 @@ int u8_char_len(unichar ch);
 char *u8_write_char(char *buf, unichar ch);
 size_t u8_unicode_len(const char *s);
 ustring u8_decode(const char *s);
+ustring u8_decode(const char *s, size_t len);
 size_t u8_byte_len(const ustring &us);
 string u8_encode(const ustring &us);
 
@@ -51,6 +52,9 @@ bool is_surrogate_high(unichar ch);
 bool is_surrogate_low(unichar ch);
 bool is_surrogate(unichar ch);
 unichar u16_assemble_surrogate(unichar hi, unichar lo);
+void u16_split_surrogate(unichar ch, unichar &hi, unichar &lo);
+// compares the UTF-16 encodings
+bool u16_less(const ustring &a, const ustring &b);
 
 
 #define UCHAR u8_read_char  // convert a string literal to unichar